@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2023 Akita Software
+ */
+
+/*
+ * Checks that every base64 kernel in src/akita_base64.c, with the scalar
+ * tail after it, writes exactly what ngx_encode_base64 writes. Built and
+ * run by "make check"; see the Makefile.
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../src/akita_base64.c"
+
+#define CHECK_MAX_INPUT  (64 * 1024)
+#define CHECK_GUARD      64
+
+typedef struct {
+  const char *name;
+  ngx_akita_base64_pt encode;  /* NULL for ngx_encode_base64 alone */
+} check_level_t;
+
+static u_char input[CHECK_MAX_INPUT];
+static u_char expected[ngx_base64_encoded_length(CHECK_MAX_INPUT)];
+static u_char output[ngx_base64_encoded_length(CHECK_MAX_INPUT) + CHECK_GUARD];
+static ngx_uint_t failures;
+
+static void
+check_fail(check_level_t *level, const char *what, size_t len) {
+  if (failures++ < 20) {
+    printf("%s: %s, input of %zu bytes\n", level->name, what, len);
+  }
+}
+
+/* Encode len bytes of input at the given level, and compare the result
+ * with ngx_encode_base64's. */
+static void
+check_input(check_level_t *level, size_t len) {
+  ngx_str_t in, out;
+  u_char *last;
+  size_t i;
+
+  in.data = input;
+  in.len = len;
+  out.data = expected;
+  ngx_encode_base64(&out, &in);
+
+  ngx_memset(output, 0xa5, out.len + CHECK_GUARD);
+  ngx_akita_base64_kernel = level->encode;
+  last = ngx_akita_base64_encode(output, input, len);
+
+  if ((size_t) (last - output) != out.len
+      || ngx_memcmp(output, expected, out.len) != 0) {
+    check_fail(level, "output differs from ngx_encode_base64", len);
+  }
+
+  for (i = out.len; i < out.len + CHECK_GUARD; i++) {
+    if (output[i] != 0xa5) {
+      check_fail(level, "wrote past the end of its output", len);
+      break;
+    }
+  }
+}
+
+static void
+check_level(check_level_t *level) {
+  static const size_t sizes[] = { 1024, 4095, 4096, 4097, 12345, CHECK_MAX_INPUT };
+  ngx_uint_t i, b;
+  size_t len;
+
+  /* Every length either side of the 16- and 28-byte loop cutoffs, and
+   * of the scalar tail, with every byte value */
+  for (len = 0; len <= 100; len++) {
+    for (b = 0; b < 256; b++) {
+      for (i = 0; i < len; i++) {
+        input[i] = (u_char) (b + i * 13);
+      }
+      check_input(level, len);
+    }
+  }
+
+  srandom(1);
+  for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    for (len = 0; len < sizes[i]; len++) {
+      input[len] = (u_char) random();
+    }
+    check_input(level, sizes[i]);
+  }
+}
+
+int
+main(void) {
+  check_level_t levels[] = {
+    { "scalar", NULL },
+#if (NGX_AKITA_HAVE_SSSE3)
+    { "ssse3", ngx_akita_base64_encode_ssse3 },
+#endif
+#if (NGX_AKITA_HAVE_AVX2)
+    { "avx2", ngx_akita_base64_encode_avx2 },
+#endif
+    { NULL, NULL }
+  };
+  check_level_t *level, picked;
+
+  __builtin_cpu_init();
+
+  for (level = levels; level->name != NULL; level++) {
+#if (NGX_AKITA_HAVE_SSSE3)
+    if (level->encode == ngx_akita_base64_encode_ssse3
+        && !__builtin_cpu_supports("ssse3")) {
+      printf("%s: not supported by this CPU, skipped\n", level->name);
+      continue;
+    }
+#endif
+#if (NGX_AKITA_HAVE_AVX2)
+    if (level->encode == ngx_akita_base64_encode_avx2
+        && !__builtin_cpu_supports("avx2")) {
+      printf("%s: not supported by this CPU, skipped\n", level->name);
+      continue;
+    }
+#endif
+    check_level(level);
+    printf("%s: %s\n", level->name, failures ? "FAILED" : "ok");
+    if (failures) {
+      return 1;
+    }
+  }
+
+  /* The kernel picked at start-up, through the public entry point */
+  ngx_akita_base64_init();
+  picked.name = "ngx_akita_base64_encode";
+  picked.encode = ngx_akita_base64_kernel;
+  check_level(&picked);
+  printf("%s: %s\n", picked.name, failures ? "FAILED" : "ok");
+
+  return failures ? 1 : 0;
+}
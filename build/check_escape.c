@@ -0,0 +1,222 @@
+/*
+ * Copyright (C) 2023 Akita Software
+ */
+
+/*
+ * Checks that every escaping kernel in src/akita_escape.c writes exactly
+ * what two passes of ngx_escape_json write, including when the output
+ * runs out part way. Built and run by "make check"; see the Makefile.
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../src/akita_escape.c"
+
+#define CHECK_MAX_INPUT  8192
+#define CHECK_GUARD      64
+
+typedef struct {
+  const char *name;
+  ngx_akita_escape_pt escape;
+  ngx_akita_escape_scan_pt scan;
+} check_level_t;
+
+static u_char input[CHECK_MAX_INPUT];
+static u_char expected[CHECK_MAX_INPUT * NGX_AKITA_ESCAPE_MAX];
+static u_char taken[CHECK_MAX_INPUT * NGX_AKITA_ESCAPE_MAX];
+static u_char output[CHECK_MAX_INPUT * NGX_AKITA_ESCAPE_MAX + CHECK_GUARD];
+static ngx_uint_t failures;
+
+/* Escape src with ngx_escape_json, sizing the output first as callers of
+ * it do. Returns the length of the output. */
+static size_t
+check_reference(u_char *dst, u_char *src, size_t size) {
+  size_t len;
+
+  len = size + ngx_escape_json(NULL, src, size);
+  if ((u_char *) ngx_escape_json(dst, src, size) != dst + len) {
+    printf("ngx_escape_json sized its output wrongly\n");
+    exit(1);
+  }
+  return len;
+}
+
+static void
+check_fail(check_level_t *level, const char *what, size_t size, size_t room) {
+  if (failures++ < 20) {
+    printf("%s: %s, input of %zu bytes, room for %zu\n",
+           level->name, what, size, room);
+  }
+}
+
+/*
+ * Escape size bytes of input with room for room bytes of output, and
+ * check that what was written is the escaping of the bytes it says it
+ * took, nothing was written past the room, and it made progress if it
+ * could. Returns the number of bytes taken.
+ */
+static size_t
+check_once(check_level_t *level, u_char *src, size_t size, size_t room) {
+  u_char *p;
+  size_t n, len, i;
+
+  ngx_memset(output, 0xa5, room + CHECK_GUARD);
+
+  p = output;
+  n = level->escape(&p, output + room, src, size);
+
+  if (n > size || p > output + room) {
+    check_fail(level, "overran its input or output", size, room);
+    return size;
+  }
+
+  for (i = room; i < room + CHECK_GUARD; i++) {
+    if (output[i] != 0xa5) {
+      check_fail(level, "wrote past the end of its output", size, room);
+      break;
+    }
+  }
+
+  len = check_reference(taken, src, n);
+  if ((size_t) (p - output) != len || ngx_memcmp(output, taken, len) != 0) {
+    check_fail(level, "output differs from ngx_escape_json", size, room);
+  }
+
+  if (n == 0 && size > 0 && room >= NGX_AKITA_ESCAPE_MAX) {
+    check_fail(level, "made no progress", size, room);
+    return size;
+  }
+
+  return n;
+}
+
+/* Check the input with room to spare, then with the output running out
+ * at every possible point. */
+static void
+check_input(check_level_t *level, size_t size) {
+  size_t len, room, n, done, scan;
+
+  len = check_reference(expected, input, size);
+
+  /* A byte is only escaped with room for the longest escape. */
+  n = check_once(level, input, size, len + NGX_AKITA_ESCAPE_MAX);
+  if (n != size) {
+    check_fail(level, "stopped short with room to spare", size,
+               len + NGX_AKITA_ESCAPE_MAX);
+  }
+
+  scan = level->scan(input, size);
+  if (scan != ngx_akita_escape_scan_scalar(input, size)) {
+    check_fail(level, "scan differs from the scalar scan", size, 0);
+  }
+
+  if (size > 96) {
+    return;
+  }
+
+  for (room = 0; room < len + NGX_AKITA_ESCAPE_MAX; room++) {
+    (void) check_once(level, input, size, room);
+  }
+
+  /* Escaping in pieces, as a witness does when its buffer fills up */
+  for (room = NGX_AKITA_ESCAPE_MAX; room < 48; room++) {
+    for (done = 0; done < size; done += n) {
+      n = check_once(level, input + done, size - done, room);
+    }
+  }
+}
+
+static void
+check_level(check_level_t *level) {
+  static const size_t offsets[] = { 0, 15, 16, 31, 32 };
+  static const size_t sizes[] = { 1, 16, 17, 32, 33, 40, 64, 65, 96 };
+  ngx_uint_t b, i, j;
+  size_t size;
+
+  /* Each byte value at the offsets where the 16- and 32-byte blocks
+   * start and end, and at the end of the input */
+  for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    size = sizes[i];
+    for (b = 0; b < 256; b++) {
+      for (j = 0; j <= sizeof(offsets) / sizeof(offsets[0]); j++) {
+        if (j < sizeof(offsets) / sizeof(offsets[0]) && offsets[j] >= size) {
+          continue;
+        }
+        ngx_memset(input, 'a', size);
+        input[j < sizeof(offsets) / sizeof(offsets[0]) ? offsets[j] : size - 1] = b;
+        check_input(level, size);
+      }
+    }
+  }
+
+  /* Every byte value in a row, and runs of special bytes */
+  for (size = 0; size <= 96; size++) {
+    for (i = 0; i < size; i++) {
+      input[i] = (u_char) (i * 7 + size);
+    }
+    check_input(level, size);
+
+    ngx_memset(input, '"', size);
+    check_input(level, size);
+  }
+
+  /* Long inputs, mostly plain with an occasional special byte */
+  srandom(1);
+  for (i = 0; i < 64; i++) {
+    size = random() % CHECK_MAX_INPUT;
+    for (j = 0; j < size; j++) {
+      input[j] = random() % 64 == 0 ? random() % 256 : 'a' + random() % 26;
+    }
+    check_input(level, size);
+  }
+}
+
+int
+main(void) {
+  check_level_t levels[] = {
+    { "scalar", ngx_akita_escape_json_scalar, ngx_akita_escape_scan_scalar },
+#if (NGX_AKITA_HAVE_SSE2)
+    { "sse2", ngx_akita_escape_json_sse2, ngx_akita_escape_scan_sse2 },
+#endif
+#if (NGX_AKITA_HAVE_AVX2)
+    { "avx2", ngx_akita_escape_json_avx2, ngx_akita_escape_scan_avx2 },
+#endif
+    { NULL, NULL, NULL }
+  };
+  check_level_t *level;
+  u_char *p;
+  size_t len;
+
+  for (level = levels; level->name != NULL; level++) {
+#if (NGX_AKITA_HAVE_AVX2)
+    __builtin_cpu_init();
+    if (level->escape == ngx_akita_escape_json_avx2
+        && !__builtin_cpu_supports("avx2")) {
+      printf("%s: not supported by this CPU, skipped\n", level->name);
+      continue;
+    }
+#endif
+    check_level(level);
+    printf("%s: %s\n", level->name, failures ? "FAILED" : "ok");
+    if (failures) {
+      return 1;
+    }
+  }
+
+  /* The kernel picked at start-up, through the public entry point */
+  ngx_akita_escape_init();
+  ngx_memcpy(input, "a\"b\\c\n\x01", 7);
+  len = check_reference(expected, input, 7);
+  p = output;
+  if (ngx_akita_escape_json(&p, output + sizeof(output), input, 7) != 7
+      || (size_t) (p - output) != len
+      || ngx_memcmp(output, expected, len) != 0) {
+    printf("ngx_akita_escape_json: FAILED\n");
+    return 1;
+  }
+
+  return 0;
+}
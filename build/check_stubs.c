@@ -0,0 +1,22 @@
+/*
+ * Copyright (C) 2023 Akita Software
+ */
+
+/*
+ * The checks link against ngx_string.o alone. These stand in for the
+ * rest of nginx that it refers to, none of which the checks use.
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <stdlib.h>
+
+void *
+ngx_pnalloc(ngx_pool_t *pool, size_t size) {
+  abort();
+}
+
+void *
+ngx_alloc(size_t size, ngx_log_t *log) {
+  abort();
+}
@@ -0,0 +1,419 @@
+/*
+ * Copyright (C) 2023 Akita Software
+ */
+
+#include "ngx_http_akita_module.h"
+#include "akita_admission.h"
+#include "akita_stats.h"
+#include "akita_sender.h"
+#include "akita_budget.h"
+
+static ngx_uint_t ngx_akita_admission_load(ngx_http_akita_main_conf_t *amcf,
+                                           ngx_http_akita_agent_set_t *agents);
+static void ngx_akita_admission_release(void *data);
+
+/* This worker's captures in flight */
+static ngx_uint_t ngx_akita_in_flight;
+static size_t ngx_akita_in_flight_size;
+
+/* This worker's place on the degradation ladder, and when it last moved */
+static ngx_uint_t ngx_akita_fidelity;
+static ngx_msec_t ngx_akita_fidelity_changed;
+
+ngx_str_t ngx_akita_fidelity_names[] = {
+  ngx_string("full"),
+  ngx_string("truncated"),
+  ngx_string("headers"),
+  ngx_string("metadata")
+};
+
+/* Defaults for akita_degrade */
+static const ngx_uint_t default_degrade[] = { 0, 50, 75, 90 };
+static const size_t default_degrade_body_size = 4096;
+
+/* How far below a threshold (in percentage points) the load must be, and
+ * for how long since the last move, before stepping back up. */
+static const ngx_uint_t ngx_akita_degrade_margin = 10;
+static const ngx_msec_t ngx_akita_degrade_hold = 1000;
+
+/* This worker's capture rate, smoothed agent round-trip time, and when
+ * the rate last changed */
+static ngx_uint_t ngx_akita_rate = NGX_HTTP_AKITA_RATE_SCALE;
+static ngx_msec_t ngx_akita_srtt;
+static ngx_msec_t ngx_akita_rate_changed;
+
+/* Defaults for akita_adaptive_rate; the latency is a quarter of the
+ * timeout for calls to the agent. */
+static const ngx_msec_t default_rate_latency = 500;
+static const ngx_uint_t default_rate_min = NGX_HTTP_AKITA_RATE_SCALE / 100;
+static const ngx_uint_t default_rate_increase = NGX_HTTP_AKITA_RATE_SCALE / 20;
+static const ngx_msec_t ngx_akita_rate_interval = 1000;
+
+char *
+ngx_akita_admission_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+  ngx_http_akita_main_conf_t *amcf = conf;
+  ngx_str_t *value, s;
+  ngx_uint_t i;
+  ngx_int_t n;
+  ssize_t size;
+
+  if (amcf->max_in_flight != NGX_CONF_UNSET_UINT
+      || amcf->max_in_flight_size != NGX_CONF_UNSET_SIZE) {
+    return "is duplicate";
+  }
+
+  value = cf->args->elts;
+  for (i = 1; i < cf->args->nelts; i++) {
+    if (ngx_strncmp(value[i].data, "witnesses=", 10) == 0) {
+      n = ngx_atoi(value[i].data + 10, value[i].len - 10);
+      if (n == NGX_ERROR || n < 1) {
+        goto invalid;
+      }
+      amcf->max_in_flight = n;
+      continue;
+    }
+
+    if (ngx_strncmp(value[i].data, "size=", 5) == 0) {
+      s.len = value[i].len - 5;
+      s.data = value[i].data + 5;
+
+      size = ngx_parse_size(&s);
+      if (size == NGX_ERROR || size == 0) {
+        goto invalid;
+      }
+      amcf->max_in_flight_size = size;
+      continue;
+    }
+
+  invalid:
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+    return NGX_CONF_ERROR;
+  }
+
+  return NGX_CONF_OK;
+}
+
+char *
+ngx_akita_admission_degrade_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+  ngx_http_akita_main_conf_t *amcf = conf;
+  ngx_str_t *value, s;
+  ngx_uint_t i, fidelity;
+  ngx_int_t n;
+  ssize_t size;
+  size_t len;
+
+  if (amcf->degrade != NULL) {
+    return "is duplicate";
+  }
+
+  amcf->degrade = ngx_palloc(cf->pool, sizeof(default_degrade));
+  if (amcf->degrade == NULL) {
+    return NGX_CONF_ERROR;
+  }
+  ngx_memcpy(amcf->degrade, default_degrade, sizeof(default_degrade));
+  amcf->degrade_body_size = default_degrade_body_size;
+
+  value = cf->args->elts;
+  for (i = 1; i < cf->args->nelts; i++) {
+    if (ngx_strncmp(value[i].data, "truncated_size=", 15) == 0) {
+      s.len = value[i].len - 15;
+      s.data = value[i].data + 15;
+
+      size = ngx_parse_size(&s);
+      if (size == NGX_ERROR) {
+        goto invalid;
+      }
+      amcf->degrade_body_size = size;
+      continue;
+    }
+
+    for (fidelity = NGX_HTTP_AKITA_FIDELITY_TRUNCATED;
+         fidelity <= NGX_HTTP_AKITA_FIDELITY_METADATA;
+         fidelity++) {
+      len = ngx_akita_fidelity_names[fidelity].len;
+      if (fidelity == NGX_HTTP_AKITA_FIDELITY_TRUNCATED) {
+        /* The parameter is "truncate", not "truncated". */
+        len--;
+      }
+
+      if (value[i].len > len
+          && ngx_strncmp(value[i].data, ngx_akita_fidelity_names[fidelity].data, len) == 0
+          && value[i].data[len] == '=') {
+        break;
+      }
+    }
+
+    if (fidelity > NGX_HTTP_AKITA_FIDELITY_METADATA) {
+      goto invalid;
+    }
+
+    n = ngx_atoi(value[i].data + len + 1, value[i].len - len - 1);
+    if (n == NGX_ERROR || n < 1 || n > 100) {
+      goto invalid;
+    }
+    amcf->degrade[fidelity] = n;
+    continue;
+
+  invalid:
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+    return NGX_CONF_ERROR;
+  }
+
+  if (amcf->degrade[NGX_HTTP_AKITA_FIDELITY_TRUNCATED] > amcf->degrade[NGX_HTTP_AKITA_FIDELITY_HEADERS]
+      || amcf->degrade[NGX_HTTP_AKITA_FIDELITY_HEADERS] > amcf->degrade[NGX_HTTP_AKITA_FIDELITY_METADATA]) {
+    return "thresholds must not decrease from truncate to metadata";
+  }
+
+  return NGX_CONF_OK;
+}
+
+char *
+ngx_akita_admission_rate_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+  ngx_http_akita_main_conf_t *amcf = conf;
+  ngx_str_t *value, s;
+  ngx_uint_t i;
+  ngx_msec_t latency;
+  ngx_int_t n;
+
+  if (amcf->rate_latency) {
+    return "is duplicate";
+  }
+
+  amcf->rate_latency = default_rate_latency;
+  amcf->rate_min = default_rate_min;
+  amcf->rate_increase = default_rate_increase;
+
+  value = cf->args->elts;
+  for (i = 1; i < cf->args->nelts; i++) {
+    if (ngx_strncmp(value[i].data, "latency=", 8) == 0) {
+      s.len = value[i].len - 8;
+      s.data = value[i].data + 8;
+
+      latency = ngx_parse_time(&s, 0);
+      if (latency == (ngx_msec_t) NGX_ERROR || latency == 0) {
+        goto invalid;
+      }
+      amcf->rate_latency = latency;
+      continue;
+    }
+
+    if (ngx_strncmp(value[i].data, "min=", 4) == 0) {
+      n = ngx_atoi(value[i].data + 4, value[i].len - 4);
+      if (n == NGX_ERROR || n < 1 || n > 100) {
+        goto invalid;
+      }
+      amcf->rate_min = n * (NGX_HTTP_AKITA_RATE_SCALE / 100);
+      continue;
+    }
+
+    if (ngx_strncmp(value[i].data, "increase=", 9) == 0) {
+      n = ngx_atoi(value[i].data + 9, value[i].len - 9);
+      if (n == NGX_ERROR || n < 1 || n > 100) {
+        goto invalid;
+      }
+      amcf->rate_increase = n * (NGX_HTTP_AKITA_RATE_SCALE / 100);
+      continue;
+    }
+
+  invalid:
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+    return NGX_CONF_ERROR;
+  }
+
+  return NGX_CONF_OK;
+}
+
+ngx_flag_t
+ngx_akita_admission_sample(ngx_http_request_t *r) {
+  ngx_http_akita_loc_conf_t *config;
+  ngx_akita_stats_t *stats;
+  ngx_uint_t rate;
+
+  if (ngx_akita_budget_exhausted()) {
+    stats = ngx_akita_stats_get(r);
+    if (stats != NULL) {
+      (void) ngx_atomic_fetch_add(&stats->over_budget, 1);
+    }
+    return 0;
+  }
+
+  /* The agent may ask for less than we would take. */
+  config = ngx_http_get_module_loc_conf(r, ngx_http_akita_module);
+  rate = ngx_min(ngx_akita_rate, ngx_http_akita_agents_sample_rate(config->agents));
+
+  if (rate >= NGX_HTTP_AKITA_RATE_SCALE
+      || (ngx_uint_t) ngx_random() % NGX_HTTP_AKITA_RATE_SCALE < rate) {
+    return 1;
+  }
+
+  stats = ngx_akita_stats_get(r);
+  if (stats != NULL) {
+    (void) ngx_atomic_fetch_add(&stats->unsampled, 1);
+  }
+  return 0;
+}
+
+void
+ngx_akita_admission_latency(ngx_msec_t rtt) {
+  ngx_http_akita_main_conf_t *amcf;
+  ngx_msec_t elapsed;
+  ngx_uint_t rate;
+
+  amcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_akita_module);
+  if (amcf == NULL || amcf->rate_latency == 0) {
+    return;
+  }
+
+  /* Smooth the round-trip time as TCP does, with a gain of 1/8. */
+  ngx_akita_srtt = ngx_akita_srtt ? (7 * ngx_akita_srtt + rtt) / 8 : ngx_max(rtt, 1);
+
+  elapsed = ngx_current_msec - ngx_akita_rate_changed;
+  rate = ngx_akita_rate;
+
+  if (ngx_akita_srtt > amcf->rate_latency) {
+    /* Back off once per round trip, so that calls already on their way
+     * when the rate was last cut don't cut it again. */
+    if (elapsed >= ngx_akita_srtt) {
+      rate = ngx_max(rate / 2, amcf->rate_min);
+    }
+  } else if (elapsed >= ngx_akita_rate_interval) {
+    rate = ngx_min(rate + amcf->rate_increase, NGX_HTTP_AKITA_RATE_SCALE);
+  }
+
+  if (rate != ngx_akita_rate) {
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "akita: capture rate %ui/%ui, smoothed agent latency %M",
+                   rate, NGX_HTTP_AKITA_RATE_SCALE, ngx_akita_srtt);
+    ngx_akita_rate = rate;
+    ngx_akita_rate_changed = ngx_current_msec;
+  }
+}
+
+size_t *
+ngx_akita_admission_admit(ngx_http_request_t *r) {
+  ngx_http_akita_main_conf_t *amcf;
+  ngx_akita_stats_t *stats;
+  ngx_pool_cleanup_t *cln;
+  size_t *charged;
+
+  amcf = ngx_http_get_module_main_conf(r, ngx_http_akita_module);
+
+  if ((amcf->max_in_flight && ngx_akita_in_flight >= amcf->max_in_flight)
+      || (amcf->max_in_flight_size && ngx_akita_in_flight_size >= amcf->max_in_flight_size)) {
+    stats = ngx_akita_stats_get(r);
+    if (stats != NULL) {
+      (void) ngx_atomic_fetch_add(&stats->shed, 1);
+    }
+    return NULL;
+  }
+
+  /* Release the capture along with the memory it was charged for. */
+  cln = ngx_pool_cleanup_add(r->pool, sizeof(size_t));
+  if (cln == NULL) {
+    return NULL;
+  }
+  charged = cln->data;
+  *charged = 0;
+  cln->handler = ngx_akita_admission_release;
+
+  ngx_akita_in_flight++;
+  return charged;
+}
+
+void
+ngx_akita_admission_degrade(ngx_http_request_t *r, ngx_http_akita_ctx_t *ctx,
+                            ngx_http_akita_loc_conf_t *config) {
+  ngx_http_akita_main_conf_t *amcf;
+  ngx_akita_stats_t *stats;
+  ngx_uint_t load, fidelity;
+
+  amcf = ngx_http_get_module_main_conf(r, ngx_http_akita_module);
+  if (amcf->degrade != NULL) {
+    load = ngx_akita_admission_load(amcf, config->agents);
+
+    fidelity = NGX_HTTP_AKITA_FIDELITY_FULL;
+    while (fidelity < NGX_HTTP_AKITA_FIDELITY_METADATA
+           && load >= amcf->degrade[fidelity + 1]) {
+      fidelity++;
+    }
+
+    if (fidelity > ngx_akita_fidelity
+        || (fidelity < ngx_akita_fidelity
+            && load + ngx_akita_degrade_margin < amcf->degrade[ngx_akita_fidelity]
+            && ngx_current_msec - ngx_akita_fidelity_changed >= ngx_akita_degrade_hold)) {
+      if (fidelity < ngx_akita_fidelity) {
+        fidelity = ngx_akita_fidelity - 1;
+      }
+      ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                    "Akita capture fidelity is now \"%V\", at load %ui%%",
+                    &ngx_akita_fidelity_names[fidelity], load);
+      ngx_akita_fidelity = fidelity;
+      ngx_akita_fidelity_changed = ngx_current_msec;
+    }
+  }
+
+  ctx->fidelity = ngx_akita_fidelity;
+  switch (ctx->fidelity) {
+  case NGX_HTTP_AKITA_FIDELITY_FULL:
+    ctx->max_body_size = config->max_body_size;
+    break;
+  case NGX_HTTP_AKITA_FIDELITY_TRUNCATED:
+    ctx->max_body_size = ngx_min(config->max_body_size, amcf->degrade_body_size);
+    break;
+  default:
+    ctx->max_body_size = 0;
+  }
+  ctx->max_body_size = ngx_min(ctx->max_body_size,
+                               ngx_http_akita_agents_max_body_size(config->agents));
+
+  if (ctx->fidelity != NGX_HTTP_AKITA_FIDELITY_FULL) {
+    stats = ngx_akita_stats_get(r);
+    if (stats != NULL) {
+      (void) ngx_atomic_fetch_add(&stats->degraded, 1);
+    }
+  }
+}
+
+/* The worker's load: the fullest of its in-flight limits, its queues to
+ * the agents and its CPU budget, or the agents' smoothed latency against
+ * the akita_adaptive_rate target, as a percentage. */
+static ngx_uint_t
+ngx_akita_admission_load(ngx_http_akita_main_conf_t *amcf,
+                         ngx_http_akita_agent_set_t *agents) {
+  ngx_uint_t load, i;
+
+  load = 0;
+  if (amcf->max_in_flight) {
+    load = ngx_max(load, ngx_akita_in_flight * 100 / amcf->max_in_flight);
+  }
+  if (amcf->max_in_flight_size) {
+    load = ngx_max(load, ngx_akita_in_flight_size * 100 / amcf->max_in_flight_size);
+  }
+  for (i = 0; i < agents->nagents; i++) {
+    load = ngx_max(load, ngx_akita_sender_load(agents->agents[i]));
+  }
+  if (amcf->rate_latency) {
+    load = ngx_max(load, ngx_akita_srtt * 100 / amcf->rate_latency);
+  }
+  return ngx_max(load, ngx_akita_budget_load());
+}
+
+void
+ngx_akita_admission_charge(size_t *charged, size_t size) {
+  if (charged == NULL) {
+    return;
+  }
+  *charged += size;
+  ngx_akita_in_flight_size += size;
+}
+
+static void
+ngx_akita_admission_release(void *data) {
+  size_t *charged = data;
+
+  ngx_akita_in_flight--;
+  ngx_akita_in_flight_size -= *charged;
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2023 Akita Software
+ */
+
+#ifndef _AKITA_NGX_MODULE_AKITA_ADMISSION_H_INCLUDED
+#define _AKITA_NGX_MODULE_AKITA_ADMISSION_H_INCLUDED
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+/*
+ * Admission control for captures. Each worker counts the requests it is
+ * capturing, and the bytes of witness data held in their pools, from the
+ * start of the capture until the request is freed (which also covers any
+ * subrequest carrying the witness to the agent). A new capture is shed,
+ * and counted in the "shed" statistic, while either count is at the
+ * limit set by akita_max_in_flight.
+ *
+ * Before it comes to that, akita_degrade has a worker capture less of
+ * each request as its load grows. The load is the largest of the two
+ * counts above, as a percentage of their limits, how full the detached
+ * sender's queue for each agent is, how much of the CPU budget (see
+ * akita_budget.h) is used, and the smoothed latency of calls to the
+ * agents against the akita_adaptive_rate target (see below; latency is
+ * only tracked, and only counts, when akita_adaptive_rate is set). The
+ * worker steps down the ladder of fidelities (full, truncated bodies,
+ * headers only, metadata only) as soon as the load reaches each
+ * threshold, but only steps back up, one rung at a time, once the load
+ * has stayed below the threshold by a margin for a while.
+ *
+ * With akita_adaptive_rate, only a fraction of requests are captured at
+ * all, adjusted by additive increase and multiplicative decrease. Each
+ * worker keeps a smoothed round-trip time of its calls to the agents
+ * (from when a call is handed over to when the agent answers). While it
+ * is above the target, the rate is halved at most once per round trip;
+ * while below, it goes up by a fixed step each second.
+ */
+
+/* Names of the NGX_HTTP_AKITA_FIDELITY_* values, as written in witnesses */
+extern ngx_str_t ngx_akita_fidelity_names[];
+
+/*
+ * Implements the 'akita_max_in_flight' directive:
+ *   akita_max_in_flight [witnesses=<number>] [size=<size>];
+ */
+char *
+ngx_akita_admission_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+/*
+ * Admit a request for capture. Returns the counter that the witness data
+ * held for it should be charged to, or NULL if it was shed (or the
+ * counter couldn't be allocated).
+ */
+size_t *
+ngx_akita_admission_admit(ngx_http_request_t *r);
+
+/*
+ * Implements the 'akita_degrade' directive:
+ *   akita_degrade [truncate=<percent>] [headers=<percent>]
+ *                 [metadata=<percent>] [truncated_size=<size>];
+ */
+char *
+ngx_akita_admission_degrade_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+/*
+ * Choose the fidelity of a capture that has been admitted, and set
+ * ctx->fidelity and ctx->max_body_size accordingly.
+ */
+void
+ngx_akita_admission_degrade(ngx_http_request_t *r, ngx_http_akita_ctx_t *ctx,
+                            ngx_http_akita_loc_conf_t *config);
+
+/*
+ * Implements the 'akita_adaptive_rate' directive:
+ *   akita_adaptive_rate [latency=<time>] [min=<percent>] [increase=<percent>];
+ */
+char *
+ngx_akita_admission_rate_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+/*
+ * Decide whether to capture a request, at the current capture rate.
+ * Requests that are left out are counted in the "unsampled" statistic.
+ */
+ngx_flag_t
+ngx_akita_admission_sample(ngx_http_request_t *r);
+
+/* Report the time the agent took to answer a call. */
+void
+ngx_akita_admission_latency(ngx_msec_t rtt);
+
+/* Charge size more bytes to a request's counter, which may be NULL. */
+void
+ngx_akita_admission_charge(size_t *charged, size_t size);
+
+#endif /* _AKITA_NGX_MODULE_AKITA_ADMISSION_H_INCLUDED */
@@ -0,0 +1,156 @@
+/*
+ * Copyright (C) 2023 Akita Software
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include "akita_base64.h"
+
+#if ((__x86_64__ || __i386__) && (__GNUC__ || __clang__))
+#include <immintrin.h>
+#define NGX_AKITA_HAVE_SSSE3  1
+#define NGX_AKITA_HAVE_AVX2   1
+#endif
+
+typedef size_t (*ngx_akita_base64_pt)(u_char *dst, u_char *src, size_t len);
+
+#if (NGX_AKITA_HAVE_SSSE3)
+static size_t ngx_akita_base64_encode_ssse3(u_char *dst, u_char *src, size_t len);
+#endif
+#if (NGX_AKITA_HAVE_AVX2)
+static size_t ngx_akita_base64_encode_avx2(u_char *dst, u_char *src, size_t len);
+#endif
+
+/* Encodes as many whole groups as it can, and returns how many bytes of
+ * src that was; NULL where there is no vector kernel. */
+static ngx_akita_base64_pt ngx_akita_base64_kernel;
+
+void
+ngx_akita_base64_init(void) {
+#if (NGX_AKITA_HAVE_AVX2)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    ngx_akita_base64_kernel = ngx_akita_base64_encode_avx2;
+    return;
+  }
+#endif
+#if (NGX_AKITA_HAVE_SSSE3)
+  if (__builtin_cpu_supports("ssse3")) {
+    ngx_akita_base64_kernel = ngx_akita_base64_encode_ssse3;
+  }
+#endif
+}
+
+u_char *
+ngx_akita_base64_encode(u_char *dst, u_char *src, size_t len) {
+  ngx_str_t in, out;
+  size_t n;
+
+  if (ngx_akita_base64_kernel != NULL) {
+    n = ngx_akita_base64_kernel(dst, src, len);
+    dst += n / 3 * 4;
+    src += n;
+    len -= n;
+  }
+
+  in.data = src;
+  in.len = len;
+  out.data = dst;
+  ngx_encode_base64(&out, &in);
+  return dst + out.len;
+}
+
+/*
+ * The vector kernels follow Wojciech Muła's base64 encoding with pshufb.
+ * Each 3 bytes of input are spread over a 32-bit lane, the four 6-bit
+ * indices are moved into the bottom of its four bytes with two
+ * multiplies, and each index is turned into its character by adding an
+ * offset looked up by which range of the alphabet it falls in.
+ */
+
+#if (NGX_AKITA_HAVE_SSSE3)
+
+__attribute__((target("ssse3")))
+static size_t
+ngx_akita_base64_encode_ssse3(u_char *dst, u_char *src, size_t len) {
+  __m128i in, t0, t1, t2, t3, indices, result, less;
+  size_t n;
+
+  /* 12 bytes are used from each 16 loaded. */
+  for (n = 0; len - n >= 16; n += 12) {
+    in = _mm_loadu_si128((__m128i *) (src + n));
+    in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7,
+                                           4, 5, 3, 4, 1, 2, 0, 1));
+
+    t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+    t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+    t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+    indices = _mm_or_si128(t1, t3);
+
+    /* 0..25 -> 13, 26..51 -> 0, 52..61 -> 1..10, 62 -> 11, 63 -> 12 */
+    result = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+    less = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+    result = _mm_or_si128(result, _mm_and_si128(less, _mm_set1_epi8(13)));
+    result = _mm_shuffle_epi8(_mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52,
+                                            '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                            '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+                                            '/' - 63, 'A', 0, 0),
+                              result);
+    result = _mm_add_epi8(result, indices);
+
+    _mm_storeu_si128((__m128i *) dst, result);
+    dst += 16;
+  }
+
+  return n;
+}
+
+#endif
+
+#if (NGX_AKITA_HAVE_AVX2)
+
+/* As ngx_akita_base64_encode_ssse3, with 12 bytes in each half. */
+__attribute__((target("avx2")))
+static size_t
+ngx_akita_base64_encode_avx2(u_char *dst, u_char *src, size_t len) {
+  __m256i in, t0, t1, t2, t3, indices, result, less;
+  size_t n;
+
+  for (n = 0; len - n >= 28; n += 24) {
+    in = _mm256_inserti128_si256(
+           _mm256_castsi128_si256(_mm_loadu_si128((__m128i *) (src + n))),
+           _mm_loadu_si128((__m128i *) (src + n + 12)), 1);
+    in = _mm256_shuffle_epi8(in, _mm256_set_epi8(10, 11, 9, 10, 7, 8, 6, 7,
+                                                 4, 5, 3, 4, 1, 2, 0, 1,
+                                                 10, 11, 9, 10, 7, 8, 6, 7,
+                                                 4, 5, 3, 4, 1, 2, 0, 1));
+
+    t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+    t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+    t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+    t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+    indices = _mm256_or_si256(t1, t3);
+
+    result = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+    less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+    result = _mm256_or_si256(result, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+    result = _mm256_shuffle_epi8(_mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52,
+                                                  '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                                  '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+                                                  '/' - 63, 'A', 0, 0,
+                                                  'a' - 26, '0' - 52, '0' - 52, '0' - 52,
+                                                  '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                                  '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+                                                  '/' - 63, 'A', 0, 0),
+                                 result);
+    result = _mm256_add_epi8(result, indices);
+
+    _mm256_storeu_si256((__m256i *) dst, result);
+    dst += 32;
+  }
+
+  return n;
+}
+
+#endif
@@ -0,0 +1,29 @@
+/*
+ * Copyright (C) 2023 Akita Software
+ */
+
+#ifndef _AKITA_NGX_MODULE_AKITA_BASE64_H_INCLUDED
+#define _AKITA_NGX_MODULE_AKITA_BASE64_H_INCLUDED
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+/*
+ * Base64 encoding, with the same output as ngx_encode_base64. Whole
+ * groups of input are encoded 24 or 12 bytes at a time with AVX2 or
+ * SSSE3, picked when the worker starts; what is left is handed to
+ * ngx_encode_base64.
+ */
+
+/* Pick the fastest kernel this CPU supports. */
+void
+ngx_akita_base64_init(void);
+
+/*
+ * Encode len bytes of src into dst, which must have room for
+ * ngx_base64_encoded_length(len) bytes. Returns the end of the output.
+ */
+u_char *
+ngx_akita_base64_encode(u_char *dst, u_char *src, size_t len);
+
+#endif /* _AKITA_NGX_MODULE_AKITA_BASE64_H_INCLUDED */
@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2023 Akita Software
+ */
+
+#include "ngx_http_akita_module.h"
+#include "akita_budget.h"
+
+#if ((__x86_64__ || __i386__) && (__GNUC__ || __clang__))
+#include <x86intrin.h>
+#define NGX_AKITA_HAVE_RDTSC  1
+#endif
+
+static uint64_t ngx_akita_budget_ticks(void);
+static void ngx_akita_budget_roll(void);
+
+/* This worker's budget, in ticks per second, and its use. The window is
+ * the current second; used_last is what was used in the one before. */
+static ngx_msec_t ngx_akita_budget_window;
+static uint64_t ngx_akita_budget_window_ticks;
+static uint64_t ngx_akita_budget_ticks_per_ms;
+static uint64_t ngx_akita_budget_limit;
+static uint64_t ngx_akita_budget_used;
+static uint64_t ngx_akita_budget_used_last;
+
+/* Length of a window, in milliseconds */
+static const ngx_msec_t ngx_akita_budget_interval = 1000;
+
+char *
+ngx_akita_budget_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+  ngx_http_akita_main_conf_t *amcf = conf;
+  ngx_str_t *value;
+  ngx_int_t n;
+
+  if (amcf->cpu_budget) {
+    return "is duplicate";
+  }
+
+  /* A percentage of one core, with up to two decimal places */
+  value = cf->args->elts;
+  n = ngx_atofp(value[1].data, value[1].len, 2);
+  if (n == NGX_ERROR || n == 0 || n > 10000) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid CPU budget \"%V\"", &value[1]);
+    return NGX_CONF_ERROR;
+  }
+
+  amcf->cpu_budget = n;
+  return NGX_CONF_OK;
+}
+
+uint64_t
+ngx_akita_budget_start(void) {
+  ngx_http_akita_main_conf_t *amcf;
+
+  amcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_akita_module);
+  if (amcf == NULL || amcf->cpu_budget == 0) {
+    return 0;
+  }
+  return ngx_akita_budget_ticks();
+}
+
+void
+ngx_akita_budget_stop(uint64_t start) {
+  if (start == 0) {
+    return;
+  }
+  ngx_akita_budget_used += ngx_akita_budget_ticks() - start;
+}
+
+ngx_flag_t
+ngx_akita_budget_exhausted(void) {
+  ngx_akita_budget_roll();
+  return ngx_akita_budget_limit && ngx_akita_budget_used >= ngx_akita_budget_limit;
+}
+
+ngx_uint_t
+ngx_akita_budget_load(void) {
+  ngx_akita_budget_roll();
+  if (ngx_akita_budget_limit == 0) {
+    return 0;
+  }
+  return ngx_max(ngx_akita_budget_used, ngx_akita_budget_used_last) * 100
+         / ngx_akita_budget_limit;
+}
+
+/* Read the time-stamp counter, or else the monotonic clock in
+ * nanoseconds. Never returns 0, which means "not timing". */
+static uint64_t
+ngx_akita_budget_ticks(void) {
+#if (NGX_AKITA_HAVE_RDTSC)
+  return __rdtsc() | 1;
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec) | 1;
+#endif
+}
+
+/* Start a new window once a second has passed, recalibrating the ticks in
+ * a millisecond against nginx's clock. Until the first calibration there
+ * is no limit. */
+static void
+ngx_akita_budget_roll(void) {
+  ngx_http_akita_main_conf_t *amcf;
+  ngx_msec_t elapsed;
+  uint64_t now;
+
+  elapsed = ngx_current_msec - ngx_akita_budget_window;
+  if (elapsed < ngx_akita_budget_interval) {
+    return;
+  }
+
+  amcf = ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_akita_module);
+  if (amcf == NULL || amcf->cpu_budget == 0) {
+    return;
+  }
+
+  now = ngx_akita_budget_ticks();
+  if (ngx_akita_budget_window_ticks != 0) {
+    ngx_akita_budget_ticks_per_ms = (now - ngx_akita_budget_window_ticks) / elapsed;
+  }
+
+  /* cpu_budget is in hundredths of a percent of a second's ticks. */
+  ngx_akita_budget_limit = ngx_akita_budget_ticks_per_ms * ngx_akita_budget_interval
+                           * amcf->cpu_budget / 10000;
+
+  /* A window that ended long ago says nothing about the last second. */
+  ngx_akita_budget_used_last = elapsed < 2 * ngx_akita_budget_interval
+                               ? ngx_akita_budget_used : 0;
+  ngx_akita_budget_used = 0;
+  ngx_akita_budget_window = ngx_current_msec;
+  ngx_akita_budget_window_ticks = now;
+}
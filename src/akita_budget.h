@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2023 Akita Software
+ */
+
+#ifndef _AKITA_NGX_MODULE_AKITA_BUDGET_H_INCLUDED
+#define _AKITA_NGX_MODULE_AKITA_BUDGET_H_INCLUDED
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+/*
+ * A per-worker budget for the time spent mirroring: building witnesses,
+ * escaping bodies and handing them to the agent. Each stretch of such
+ * work is timed with the CPU's time-stamp counter where there is one (a
+ * monotonic clock otherwise), calibrated against nginx's clock once a
+ * second. Since a worker is single-threaded, the time is a close stand-in
+ * for the CPU it uses.
+ *
+ * Once the budget for the current second is spent, no new captures start
+ * and captures in progress stop copying bodies, until the next second.
+ * With akita_degrade, the share of the budget used also counts towards
+ * the worker's load.
+ */
+
+/*
+ * Implements the 'akita_cpu_budget' directive:
+ *   akita_cpu_budget <percent>;
+ */
+char *
+ngx_akita_budget_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+/* Start timing some work; pass the result to ngx_akita_budget_stop. */
+uint64_t
+ngx_akita_budget_start(void);
+
+/* Charge the time since start to the budget. */
+void
+ngx_akita_budget_stop(uint64_t start);
+
+/* Return true if the budget for the current second is spent. */
+ngx_flag_t
+ngx_akita_budget_exhausted(void);
+
+/* The share of the budget used, as a percentage: the larger of the last
+ * second's and this one's so far. 0 if there is no budget. */
+ngx_uint_t
+ngx_akita_budget_load(void);
+
+#endif /* _AKITA_NGX_MODULE_AKITA_BUDGET_H_INCLUDED */
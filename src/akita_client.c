@@ -4,6 +4,14 @@
 
 #include "ngx_http_akita_module.h"
 #include "akita_client.h"
+#include "akita_sender.h"
+#include "akita_admission.h"
+#include "akita_ring.h"
+#include "akita_datagram.h"
+#include "akita_escape.h"
+#include "akita_json.h"
+#include "akita_base64.h"
+#include "akita_frame.h"
 
 /* Functions for generating JSON objects. */
 
@@ -14,16 +22,75 @@ typedef struct json_data_s {
   ngx_chain_t *tail;           /* Tail of output data */
   ngx_uint_t content_length;   /* Total size of data so far */
   ngx_uint_t oom;              /* Nonzero if OOM hit */
+  size_t *charged;             /* Admission counter for allocations, or NULL */
+  u_char *paid;                /* The tail buffer is charged for up to here, */
+  size_t unpaid;               /* and for this much room after it as it fills */
 } json_data_t;
 
-static json_data_t* json_alloc( ngx_pool_t *pool );                             
+static json_data_t* json_alloc( ngx_pool_t *pool, size_t *charged, size_t size,
+                                size_t room );
 static unsigned char * json_ensure_space( json_data_t *buf, ngx_uint_t size );
+static unsigned char * json_add_buf( json_data_t *buf, size_t size, size_t room );
+static void json_charge_room( json_data_t *buf );
 static void json_write_char( json_data_t *buf, unsigned char c );
 static void json_write_string_literal( json_data_t *buf, ngx_str_t *str );
+static void json_write_escaped( json_data_t *buf, u_char *src, size_t len );
+static void json_write_raw( json_data_t *buf, u_char *src, size_t len );
+static void json_link( json_data_t *buf, u_char *src, size_t len );
+static void json_prepend( json_data_t *buf, void *data, size_t len );
 static void json_write_time_literal( json_data_t *buf, struct timeval *tm  );
 static void json_write_uint_property( json_data_t *buf, ngx_str_t *key, ngx_uint_t n );
 static void json_snprintf(json_data_t *j, size_t max_len, const char *fmt, ...);
-static ngx_int_t json_escape_buf(json_data_t *j, ngx_http_request_t *r, size_t max_size, size_t *total_size, ngx_buf_t *buf);
+static size_t json_string_literal_size( ngx_str_t *str );
+static size_t json_uint_property_size( ngx_str_t *key );
+static ngx_int_t json_escape_buf(json_data_t *j, ngx_http_request_t *r, size_t max_size, size_t *total_size,
+                                 struct json_body_s *body, ngx_buf_t *buf);
+
+/* How a body is written into its witness */
+#define JSON_BODY_STRING     0    /* Escaped into the "body" string */
+#define JSON_BODY_UNDECIDED  1    /* Escaped or base64, once a sample is seen */
+#define JSON_BODY_BASE64     2    /* Base64-encoded into the "body" string */
+#define JSON_BODY_RAW        3    /* Copied, to be embedded as "body_json" */
+#define JSON_BODY_BINARY     4    /* In body sections of a binary frame */
+
+/* A body being written into a witness */
+typedef struct json_body_s {
+  ngx_uint_t encoding;         /* One of the JSON_BODY_* values */
+  json_data_t *raw;            /* The copy, for JSON_BODY_RAW, or the
+                                  sections, for JSON_BODY_BINARY */
+  ngx_akita_json_validator_t validator;
+  u_char carry[3];             /* Input not yet base64-encoded */
+  size_t ncarry;
+  u_char *sample;              /* Start of the body, for JSON_BODY_UNDECIDED */
+  size_t nsample;
+  ngx_uint_t fallback;         /* Encoding of a body that can't be embedded */
+  ngx_uint_t section;          /* Type of the body sections */
+  size_t length;               /* Bytes in the body sections */
+  ngx_flag_t link;             /* Buffers outlive the witness, so they
+                                  can be linked into it, not copied */
+  size_t expected;             /* Bytes of body expected to be written */
+} json_body_t;
+
+static size_t json_expected_body_size( off_t content_length_n, size_t max_body_size );
+static ngx_flag_t json_body_embedded( ngx_http_akita_loc_conf_t *config,
+                                      ngx_str_t *content_type );
+static size_t json_body_size( ngx_http_akita_loc_conf_t *config,
+                              ngx_str_t *content_type, size_t expected,
+                              size_t *room );
+static ngx_int_t json_start_body( ngx_http_request_t *r, json_data_t *j,
+                                  json_body_t **body, ngx_str_t *content_type,
+                                  ngx_uint_t section, size_t expected,
+                                  size_t trailer );
+static void json_write_section( json_data_t *j, json_body_t *body, u_char *src,
+                                size_t len, ngx_flag_t link );
+static void json_frame_sections( json_data_t *j, ngx_uint_t type, json_body_t *body );
+static void json_frame( json_data_t *j, ngx_akita_witness_kind_e kind );
+static void json_finish_body( json_data_t *j, json_body_t *body );
+static void json_raw_body_fallback( json_data_t *j, json_body_t *body );
+static void json_write_body( json_data_t *j, json_body_t *body, u_char *src, size_t len );
+static void json_choose_encoding( json_data_t *j, json_body_t *body );
+static ngx_flag_t json_body_binary( u_char *p, size_t len );
+static void json_write_base64( json_data_t *j, json_body_t *body, u_char *src, size_t len );
 
 /* A key and string value to write into a JSON object */
 typedef struct json_kv_string_s {
@@ -33,15 +100,18 @@ typedef struct json_kv_string_s {
 } json_kv_string_t;
 
 static void json_write_kv_strings( json_data_t *buf, json_kv_string_t *kvs );
+static size_t json_kv_strings_size( json_kv_string_t *kvs );
+static void json_append( json_data_t *buf, json_data_t *other );
 
 static ngx_int_t ngx_akita_get_request_id(ngx_http_request_t *r, ngx_str_t *dest);
 static void ngx_akita_write_headers_list(json_data_t *j, ngx_list_t *headers_list);
-static void ngx_akita_write_body(json_data_t *j, ngx_http_request_t *r, size_t max_size );
+static size_t ngx_akita_headers_list_size(ngx_list_t *headers_list);
 static void ngx_akita_clear_headers(ngx_http_request_t *r);
 static ngx_int_t ngx_akita_set_request_size(ngx_http_request_t *r, ngx_uint_t content_length);
-static ngx_int_t ngx_akita_set_json_content_type(ngx_http_request_t *r);
+static ngx_int_t ngx_akita_set_content_type(ngx_http_request_t *r, ngx_str_t *type);
 static ngx_int_t ngx_akita_send_api_call(ngx_http_request_t *r,
                                          ngx_str_t agent_path,
+                                         ngx_akita_witness_kind_e kind,
                                          ngx_http_post_subrequest_t *callback,
                                          ngx_http_akita_loc_conf_t *config,
                                          ngx_chain_t *body,
@@ -49,24 +119,58 @@ static ngx_int_t ngx_akita_send_api_call(ngx_http_request_t *r,
   
 static const ngx_uint_t json_initial_size = 4096;
 
-/* Allocate a new buffer for JSON. Returns NULL if the allocation fails. */
+/* Longest decimal written for an unsigned integer; handles 64 bits */
+static const size_t json_max_decimal_len = 20;
+
+static ngx_str_t json_time_format = ngx_string("\"2006-01-02T15:04:05.999999Z\"");
+
+/* Keys of the fields around a body */
+static ngx_str_t json_body_key = ngx_string( "body" );
+static ngx_str_t json_body_json_key = ngx_string( "body_json" );
+static ngx_str_t json_body_length_key = ngx_string( "body_length" );
+static json_kv_string_t json_base64_fields[] = {
+  { ngx_string( "body_encoding" ), ngx_string( "base64" ), 0 },
+  { ngx_null_string, ngx_null_string, 0 },
+};
+
+/* Keys of the fields written when a witness is finished */
+static ngx_str_t json_truncated_key = ngx_string( "truncated" );
+static ngx_str_t json_request_arrived_key = ngx_string( "request_arrived" );
+static ngx_str_t json_response_complete_key = ngx_string( "response_complete" );
+
+/* How much of a body is looked at to choose its encoding */
+static const size_t json_body_sample_size = 1024;
+
+/*
+ * Allocate a new buffer for JSON, with room for size bytes, or our
+ * initial size if size is 0. The last room bytes of it are room for a
+ * body, which is only charged to admission as it is written into.
+ * Returns NULL if the allocation fails.
+ */
 static json_data_t *
-json_alloc( ngx_pool_t *pool ) {
+json_alloc( ngx_pool_t *pool, size_t *charged, size_t size, size_t room ) {
   ngx_bufs_t bufs;
   json_data_t *j = ngx_pcalloc(pool, sizeof(json_data_t));
   if (j == NULL) {
     return NULL;
   }
   
+  if (size == 0) {
+    size = json_initial_size;
+  }
   j->pool = pool;
+  j->charged = charged;
   bufs.num = 1;
-  bufs.size = json_initial_size;
+  bufs.size = size;
   j->chain = ngx_create_chain_of_bufs(pool, &bufs );
   if (j->chain == NULL) {
     return NULL;
   }
   j->tail = j->chain;
   j->content_length = 0;
+  j->paid = j->chain->buf->start + size - room;
+  j->unpaid = room;
+  ngx_akita_admission_charge(charged, size - room);
   return j;
 }
 
@@ -80,21 +184,30 @@ json_alloc( ngx_pool_t *pool ) {
  */
 static unsigned char *
 json_ensure_space(json_data_t *j, ngx_uint_t size) {
-  ngx_chain_t *cl;
   ngx_buf_t *curr_buf;
   
-  /* end-start is the capacity of the buffer, so end is not usable. */
+  /* end points just past the buffer, so a write may fill it up to end. */
   curr_buf = j->tail->buf;
-  if (curr_buf->last + size < curr_buf->end ) {
+  if (curr_buf->last + size <= curr_buf->end ) {
     return curr_buf->last;
   }
 
   /* Create a buffer at least large enough, and at least our initial size. */
-  if (size > json_initial_size) {
-    curr_buf = ngx_create_temp_buf(j->pool, size);
-  } else {
-    curr_buf = ngx_create_temp_buf(j->pool, json_initial_size);
-  }
+  return json_add_buf(j, ngx_max(size, json_initial_size), 0);
+}
+
+/*
+ * Add an empty buffer of exactly size bytes to the end of the output, and
+ * return a pointer to its start. The last room bytes are charged to
+ * admission only as they are written into, as for json_alloc. If an
+ * error occurs, sets `j->oom` and returns NULL.
+ */
+static unsigned char *
+json_add_buf(json_data_t *j, size_t size, size_t room) {
+  ngx_chain_t *cl;
+  ngx_buf_t *curr_buf;
+
+  curr_buf = ngx_create_temp_buf(j->pool, size);
   if (curr_buf == NULL) {
     j->oom = 1;
     return NULL;
@@ -107,11 +220,43 @@ json_ensure_space(json_data_t *j, ngx_uint_t size) {
   }
   cl->buf = curr_buf;
   cl->next = NULL;
+  json_charge_room(j);
+  ngx_akita_admission_charge(j->charged, size - room);
+  j->paid = curr_buf->start + size - room;
+  j->unpaid = room;
   j->tail->next = cl;
   j->tail = cl;
   return curr_buf->last;  
 }
 
+/* Charge to admission whatever has been written into the room left in
+ * the tail buffer. Room that is never written into is never charged. */
+static void
+json_charge_room(json_data_t *j) {
+  ngx_buf_t *b = j->tail->buf;
+  size_t n;
+
+  if (j->unpaid == 0 || b->last <= j->paid) {
+    return;
+  }
+
+  n = ngx_min((size_t) (b->last - j->paid), j->unpaid);
+  ngx_akita_admission_charge(j->charged, n);
+  j->paid = b->last;
+  j->unpaid -= n;
+}
+
+/* Append the contents of another JSON buffer by linking in its chain. */
+static void
+json_append(json_data_t *j, json_data_t *other) {
+  json_charge_room(j);
+  j->tail->next = other->chain;
+  j->tail = other->tail;
+  j->content_length += other->content_length;
+  j->paid = other->paid;
+  j->unpaid = other->unpaid;
+}
+
 /*
  * Write a single character to the JSON buffer. Sets `j->oom` if an error
  * occurs.
@@ -131,20 +276,99 @@ static void json_write_char( json_data_t *j, unsigned char c ) {
  * Sets `j->oom` if an error occurs.
  */
 static void json_write_string_literal(json_data_t *j, ngx_str_t *str) {
+  json_write_char( j, '"' );
+  json_write_escaped( j, str->data, str->len );
+  json_write_char( j, '"' );
+}
+
+/*
+ * Write JSON-escaped text to the JSON buffer, in one pass over it. Space
+ * is asked for as if nothing needed escaping; whatever doesn't fit goes
+ * on in the next buffer. Sets `j->oom` if an error occurs.
+ */
+static void
+json_write_escaped(json_data_t *j, u_char *src, size_t len) {
   unsigned char *dst;
-  uintptr_t sz;
+  size_t n;
+
+  while (len > 0) {
+    dst = json_ensure_space( j, ngx_max(len, NGX_AKITA_ESCAPE_MAX) );
+    if (dst == NULL) {
+      return;
+    }
+    n = ngx_akita_escape_json(&dst, j->tail->buf->end, src, len);
+    j->content_length += dst - j->tail->buf->last;
+    j->tail->buf->last = dst;
+    src += n;
+    len -= n;
+  }
+}
 
-  /* The doc says return value is the complete size but it's just the delta */
-  sz = ngx_escape_json( NULL, str->data, str->len ) + str->len + 2;
-  dst = json_ensure_space( j, sz );
+/* Copy text that is already JSON to the JSON buffer; may set `j->oom'. */
+static void
+json_write_raw(json_data_t *j, u_char *src, size_t len) {
+  unsigned char *dst;
+
+  if (len == 0) {
+    return;
+  }
+  dst = json_ensure_space( j, len );
   if (dst == NULL) {
     return;
   }
-  *dst++ = '"';
-  dst = (unsigned char *)ngx_escape_json(dst, str->data, str->len);
-  *dst++ = '"';
-  j->content_length += sz;
-  j->tail->buf->last = dst;
+  j->tail->buf->last = ngx_cpymem(dst, src, len);
+  j->content_length += len;
+}
+
+/*
+ * Link memory that will outlive the output into it, rather than copying
+ * it. The new buffer is full, so nothing else is written into it. Sets
+ * `j->oom` if an error occurs.
+ */
+static void
+json_link(json_data_t *j, u_char *src, size_t len) {
+  ngx_buf_t *b;
+  ngx_chain_t *cl;
+
+  b = ngx_calloc_buf(j->pool);
+  cl = ngx_alloc_chain_link(j->pool);
+  if (b == NULL || cl == NULL) {
+    j->oom = 1;
+    return;
+  }
+
+  b->start = b->pos = src;
+  b->end = b->last = src + len;
+  b->memory = 1;
+
+  cl->buf = b;
+  cl->next = NULL;
+  json_charge_room(j);
+  j->tail->next = cl;
+  j->tail = cl;
+  j->content_length += len;
+  j->unpaid = 0;
+}
+
+/* Put data in front of the output, in a buffer of its own; may set
+ * `j->oom'. */
+static void
+json_prepend(json_data_t *j, void *data, size_t len) {
+  ngx_buf_t *b;
+  ngx_chain_t *cl;
+
+  b = ngx_create_temp_buf(j->pool, len);
+  cl = ngx_alloc_chain_link(j->pool);
+  if (b == NULL || cl == NULL) {
+    j->oom = 1;
+    return;
+  }
+  b->last = ngx_cpymem(b->pos, data, len);
+
+  cl->buf = b;
+  cl->next = j->chain;
+  j->chain = cl;
+  j->content_length += len;
 }
 
 /* Printf to a JSON buffer; may set `j->oom' on failure. */
@@ -166,10 +390,9 @@ static void json_snprintf(json_data_t *j, size_t max_len, const char *fmt, ...)
 /* Write a key and an unsigned integer to the JSON buffer.
    Sets 'j->oom' if an error occurs. */
 static void json_write_uint_property(json_data_t *j, ngx_str_t *key, ngx_uint_t n) {  
-  const int max_decimal_len = 20; /* handles 64-bit unsigned */
   json_write_string_literal(j, key);
   json_write_char(j, ':');
-  json_snprintf(j, max_decimal_len, "%ud", n);
+  json_snprintf(j, json_max_decimal_len, "%ud", n);
 }
 
 /*
@@ -203,16 +426,46 @@ static void json_write_kv_strings(json_data_t *j, json_kv_string_t *kv) {
  * Sets `j->oom` if an error occurs.
  */
 static void json_write_time_literal(json_data_t *j, struct timeval *tv) {
-  static ngx_str_t format = ngx_string("\"2006-01-02T15:04:05.999999Z\"");
   ngx_tm_t tm;
   ngx_gmtime(tv->tv_sec, &tm);
-  json_snprintf(j, format.len, "\"%4d-%02d-%02dT%02d:%02d:%02d.%06dZ\"",
+  json_snprintf(j, json_time_format.len, "\"%4d-%02d-%02dT%02d:%02d:%02d.%06dZ\"",
                 tm.ngx_tm_year, tm.ngx_tm_mon,
                 tm.ngx_tm_mday, tm.ngx_tm_hour,
                 tm.ngx_tm_min, tm.ngx_tm_sec,
                 tv->tv_usec);
 }
 
+/*
+ * Sizes of what the functions above write, so that a witness can be
+ * sized before it is written. Integers are counted at their longest.
+ */
+static size_t
+json_string_literal_size(ngx_str_t *str) {
+  return str->len + ngx_escape_json(NULL, str->data, str->len) + 2;
+}
+
+static size_t
+json_uint_property_size(ngx_str_t *key) {
+  return json_string_literal_size(key) + 1 + json_max_decimal_len;
+}
+
+static size_t
+json_kv_strings_size(json_kv_string_t *kv) {
+  size_t size = 0;
+  ngx_uint_t n = 0;
+
+  for (; kv->key.len > 0; kv++) {
+    if (kv->omit) {
+      continue;
+    }
+    size += json_string_literal_size(&kv->key) + 1
+            + json_string_literal_size(&kv->value);
+    n++;
+  }
+  /* Commas between pairs */
+  return n > 0 ? size + n - 1 : 0;
+}
+
 /* API request schema and subrequest manipulation */
 
 /* Request format:
@@ -264,7 +517,7 @@ ngx_akita_clear_headers(ngx_http_request_t *r) {
   ngx_list_init(&r->headers_in.headers, r->pool, 4, sizeof(ngx_table_elt_t));
 }
 
-/* Write the list of headers to the JSON API call */
+/* Write the list of headers to the JSON API call; NULL for none */
 static void
 ngx_akita_write_headers_list(json_data_t *j, ngx_list_t *headers_list ) {
   ngx_list_part_t *header_part;
@@ -276,7 +529,9 @@ ngx_akita_write_headers_list(json_data_t *j, ngx_list_t *headers_list ) {
   json_write_string_literal(j, &headers_key);
   json_write_char(j, ':' );
   json_write_char(j, '[' );  
-  for (header_part = &(headers_list->part); header_part; header_part = header_part->next) {
+  for (header_part = headers_list ? &(headers_list->part) : NULL;
+       header_part;
+       header_part = header_part->next) {
     headers = header_part->elts;
     for (i = 0; i < header_part->nelts; i++) {
       if (need_comma) {
@@ -297,6 +552,29 @@ ngx_akita_write_headers_list(json_data_t *j, ngx_list_t *headers_list ) {
   json_write_char(j, ']' );  
 }
 
+/* Size of what ngx_akita_write_headers_list writes for the list */
+static size_t
+ngx_akita_headers_list_size(ngx_list_t *headers_list) {
+  ngx_list_part_t *header_part;
+  ngx_table_elt_t *headers;
+  ngx_uint_t i, n = 0;
+  size_t size = sizeof("\"headers\":[]") - 1;
+
+  for (header_part = headers_list ? &(headers_list->part) : NULL;
+       header_part;
+       header_part = header_part->next) {
+    headers = header_part->elts;
+    for (i = 0; i < header_part->nelts; i++) {
+      size += sizeof("{\"header\":,\"value\":}") - 1
+              + json_string_literal_size(&headers[i].key)
+              + json_string_literal_size(&headers[i].value);
+      n++;
+    }
+  }
+  /* Commas between headers */
+  return n > 0 ? size + n - 1 : size;
+}
+
 /*
  * Write the buffer to a JSON string literal.
  * Assumes the quotes have already been added.
@@ -307,23 +585,30 @@ ngx_akita_write_headers_list(json_data_t *j, ngx_list_t *headers_list ) {
   * Returns an Nginx error code.
  */
 static ngx_int_t
-json_escape_buf(json_data_t *j, ngx_http_request_t *r, size_t max_size, size_t *total_size, ngx_buf_t *buf) {
-  unsigned char *unescaped, *dst;
+json_escape_buf(json_data_t *j, ngx_http_request_t *r, size_t max_size, size_t *total_size,
+                json_body_t *body, ngx_buf_t *buf) {
+  unsigned char *unescaped;
   size_t unescaped_len = 0;
   unsigned char *file_buf = NULL;
   ssize_t num_read;
-  uintptr_t size_delta;
 
   /* If at max size, record length */
   if (*total_size >= max_size) {
+    if (body->encoding == JSON_BODY_RAW && ngx_buf_size(buf) > 0) {
+      /* A truncated body can't be embedded as JSON. */
+      json_raw_body_fallback(j, body);
+    }
     *total_size += ngx_buf_size(buf);
-    return NGX_OK;
+    return j->oom ? NGX_ERROR : NGX_OK;
   }
 
   unescaped_len = ngx_buf_size(buf);
   /* Truncate if over max size */
   if (*total_size + unescaped_len > max_size) {
     unescaped_len = max_size - *total_size;
+    if (body->encoding == JSON_BODY_RAW) {
+      json_raw_body_fallback(j, body);
+    }
   }
   /* Record the real size */
   *total_size += ngx_buf_size(buf);
@@ -360,14 +645,38 @@ json_escape_buf(json_data_t *j, ngx_http_request_t *r, size_t max_size, size_t *
     return NGX_ERROR;
   }
 
-  size_delta = ngx_escape_json(NULL, unescaped, unescaped_len);
-  dst = json_ensure_space(j, unescaped_len + size_delta);
-  if (dst == NULL) {
+  if (body->encoding == JSON_BODY_RAW
+      && ngx_akita_json_validate(&body->validator, unescaped, unescaped_len) != NGX_OK) {
+    json_raw_body_fallback(j, body);
+  }
+
+  switch (body->encoding) {
+  case JSON_BODY_RAW:
+    json_write_raw(body->raw, unescaped, unescaped_len);
+    if (body->raw->oom) {
+      return NGX_ERROR;
+    }
+    break;
+  case JSON_BODY_BINARY:
+    /* Memory read from the file is ours to keep. */
+    json_write_section(body->raw, body, unescaped, unescaped_len,
+                       body->link || file_buf != NULL);
+    if (body->raw->oom) {
+      return NGX_ERROR;
+    }
+    file_buf = NULL;
+    break;
+  default:
+    json_write_body(j, body, unescaped, unescaped_len);
+  }
+  if (j->oom) {
     return NGX_ERROR;
   }
-  dst = (unsigned char *)ngx_escape_json(dst, unescaped, unescaped_len);
-  j->content_length += (unescaped_len + size_delta);
-  j->tail->buf->last = dst;
+
+  json_charge_room(j);
+  if (body->raw != NULL) {
+    json_charge_room(body->raw);
+  }
 
   if (file_buf != NULL) {
     /*
@@ -381,41 +690,379 @@ json_escape_buf(json_data_t *j, ngx_http_request_t *r, size_t max_size, size_t *
   return NGX_OK;
 }
 
-/* Write the contents of the body, up to the given size, as a 
-   JSON literal string. If the content is truncated,
-   indicate this by a "truncated" field giving the truncated size. */
+/*
+ * Start the body of a witness. In the binary format, the body is kept in
+ * sections of its own, to follow the metadata. With akita_embed_json, a
+ * JSON body is
+ * copied as it is into a buffer of its own, to be embedded as the value
+ * of "body_json" if it turns out to be valid. Otherwise the body is
+ * written into the "body" string as it arrives, escaped or base64-encoded
+ * according to akita_body_encoding.
+ *
+ * expected is how much of the body to make room for, and trailer the size
+ * of the fields that follow it.
+ */
+static ngx_int_t
+json_start_body(ngx_http_request_t *r, json_data_t *j,
+                json_body_t **body, ngx_str_t *content_type,
+                ngx_uint_t section, size_t expected, size_t trailer) {
+  ngx_http_akita_loc_conf_t *config;
+  json_body_t *b;
+
+  b = ngx_pcalloc(r->pool, sizeof(json_body_t));
+  if (b == NULL) {
+    return NGX_ERROR;
+  }
+  b->expected = expected;
+  *body = b;
+
+  config = ngx_http_get_module_loc_conf(r, ngx_http_akita_module);
+
+  /* In a binary frame, the body goes in sections after the metadata. */
+  if (config->format == NGX_HTTP_AKITA_FORMAT_BINARY) {
+    b->encoding = JSON_BODY_BINARY;
+    b->section = section;
+    /* Room for a section header; json_write_section makes room for
+       the body when it is copied rather than linked. */
+    b->raw = json_alloc(r->pool, j->charged, sizeof(ngx_akita_frame_section_t), 0);
+    if (b->raw == NULL) {
+      return NGX_ERROR;
+    }
+    return j->oom ? NGX_ERROR : NGX_OK;
+  }
+
+  /* A JSON body that can't be embedded after all is encoded the same way. */
+  switch (config->body_encoding) {
+  case NGX_HTTP_AKITA_BODY_BASE64:
+    b->fallback = JSON_BODY_BASE64;
+    break;
+  case NGX_HTTP_AKITA_BODY_AUTO:
+    b->fallback = JSON_BODY_UNDECIDED;
+    b->sample = ngx_palloc(r->pool, json_body_sample_size);
+    if (b->sample == NULL) {
+      return NGX_ERROR;
+    }
+    ngx_akita_admission_charge(j->charged, json_body_sample_size);
+    break;
+  default:
+    b->fallback = JSON_BODY_STRING;
+  }
+
+  if (json_body_embedded(config, content_type)) {
+    b->encoding = JSON_BODY_RAW;
+    /* Once the copy is linked in, the fields after it are written into
+       its buffer. */
+    b->raw = json_alloc(r->pool, j->charged, expected + trailer, expected);
+    if (b->raw == NULL) {
+      return NGX_ERROR;
+    }
+    ngx_akita_json_validate_init(&b->validator);
+    return j->oom ? NGX_ERROR : NGX_OK;
+  }
+
+  b->encoding = b->fallback;
+  json_write_string_literal( j, &json_body_key );
+  json_write_char( j, ':' );
+  json_write_char( j, '"' );
+  return j->oom ? NGX_ERROR : NGX_OK;
+}
+
+/* How much of a body to expect, from its Content-Length (-1 if unknown). */
+static size_t
+json_expected_body_size(off_t content_length_n, size_t max_body_size) {
+  if (content_length_n < 0) {
+    return 0;
+  }
+  return ngx_min((size_t) content_length_n, max_body_size);
+}
+
+/* Is the body to be copied, to be embedded as JSON if it is valid? */
+static ngx_flag_t
+json_body_embedded(ngx_http_akita_loc_conf_t *config, ngx_str_t *content_type) {
+  return config->format == NGX_HTTP_AKITA_FORMAT_JSON
+         && config->embed_json && content_type != NULL
+         && ngx_akita_json_content_type(content_type);
+}
+
+/*
+ * Size of what json_start_body and json_finish_body write into the
+ * metadata for a body of the expected size. Of that, room is set to the
+ * part the body itself is written into. A JSON body to be embedded is
+ * linked in from its own buffer, so only its key is counted; if it has
+ * to be escaped after all, the escaped body goes on in new buffers. In
+ * the binary format, the body sections are sized as they are written.
+ */
+static size_t
+json_body_size(ngx_http_akita_loc_conf_t *config, ngx_str_t *content_type,
+               size_t expected, size_t *room) {
+  size_t size;
+
+  *room = 0;
+
+  if (config->format == NGX_HTTP_AKITA_FORMAT_BINARY) {
+    return json_uint_property_size( &json_body_length_key );
+  }
+
+  if (json_body_embedded(config, content_type)) {
+    return json_string_literal_size( &json_body_json_key ) + 1;
+  }
+
+  size = json_string_literal_size( &json_body_key ) + sizeof(":\"\"") - 1;
+  if (config->body_encoding == NGX_HTTP_AKITA_BODY_BASE64) {
+    *room = ngx_base64_encoded_length(expected);
+    return size + *room + 1 + json_kv_strings_size( json_base64_fields );
+  }
+  /* Text needing no escapes, which is the usual case */
+  *room = expected;
+  return size + expected;
+}
+
+/* Give up on embedding a body as JSON, and write what was copied so far
+ * into the "body" string instead, encoded as akita_body_encoding says.
+ * Sets `j->oom` if an error occurs. */
 static void
-ngx_akita_write_body(json_data_t *j, ngx_http_request_t *r, size_t max_size ) {
-  ngx_chain_t *in;
-  size_t total_size = 0; 
-  static ngx_str_t body_key = ngx_string( "body" );
-  static ngx_str_t truncated_key = ngx_string( "truncated" );
-  
-  json_write_string_literal( j, &body_key );
+json_raw_body_fallback(json_data_t *j, json_body_t *body) {
+  ngx_chain_t *cl;
+
+  json_write_string_literal( j, &json_body_key );
   json_write_char( j, ':' );
   json_write_char( j, '"' );
 
-  if (r->request_body == NULL) {
-    json_write_char( j, '"' );
+  cl = body->raw->chain;
+  body->encoding = body->fallback;
+  body->raw = NULL;
+
+  for ( ; cl != NULL; cl = cl->next) {
+    json_write_body( j, body, cl->buf->pos, cl->buf->last - cl->buf->pos );
+  }
+}
+
+/* Finish the body of a witness: link in a complete, valid JSON body, or
+ * close the string holding it and say how it was encoded. In the binary
+ * format, just give the length of the body sections. */
+static void
+json_finish_body(json_data_t *j, json_body_t *body) {
+  u_char *dst;
+
+  if (body->encoding == JSON_BODY_BINARY) {
+    json_write_uint_property( j, &json_body_length_key, body->length );
     return;
   }
-  
-  for (in = r->request_body->bufs; in; in = in->next) {
-    if (json_escape_buf(j, r, max_size, &total_size, in->buf) != NGX_OK) {
-      /* TODO: a better way of signalling the error */
-      j->oom = 1;
+
+  if (body->encoding == JSON_BODY_RAW) {
+    if (ngx_akita_json_validate_finish(&body->validator) == NGX_OK) {
+      json_write_string_literal( j, &json_body_json_key );
+      json_write_char( j, ':' );
+      json_append( j, body->raw );
       return;
-    }    
+    }
+    json_raw_body_fallback( j, body );
+  }
+
+  /* A body shorter than the sample */
+  if (body->encoding == JSON_BODY_UNDECIDED) {
+    json_choose_encoding( j, body );
+  }
+
+  /* The last, padded group */
+  if (body->encoding == JSON_BODY_BASE64 && body->ncarry > 0) {
+    dst = json_ensure_space( j, 4 );
+    if (dst != NULL) {
+      dst = ngx_akita_base64_encode( dst, body->carry, body->ncarry );
+      j->content_length += dst - j->tail->buf->last;
+      j->tail->buf->last = dst;
+    }
+    body->ncarry = 0;
   }
 
   json_write_char( j, '"' );
 
-  if (total_size > max_size) {
-    json_write_char(j, ',');
-    json_write_uint_property(j, &truncated_key, total_size);
+  if (body->encoding == JSON_BODY_BASE64) {
+    json_write_char( j, ',' );
+    json_write_kv_strings( j, json_base64_fields );
+  }
+}
+
+/*
+ * Write part of a body into the "body" string, escaped or base64-encoded.
+ * With akita_body_encoding auto, the start of the body is kept until
+ * there is enough of it to choose the encoding from. Sets `j->oom` if an
+ * error occurs.
+ */
+static void
+json_write_body(json_data_t *j, json_body_t *body, u_char *src, size_t len) {
+  size_t n;
+
+  if (body->encoding == JSON_BODY_UNDECIDED) {
+    n = ngx_min(len, json_body_sample_size - body->nsample);
+    ngx_memcpy(body->sample + body->nsample, src, n);
+    body->nsample += n;
+    src += n;
+    len -= n;
+
+    if (body->nsample < json_body_sample_size) {
+      return;
+    }
+    json_choose_encoding( j, body );
+  }
+
+  if (body->encoding == JSON_BODY_BASE64) {
+    json_write_base64( j, body, src, len );
+  } else {
+    json_write_escaped( j, src, len );
   }
 }
 
+/* Choose how to encode a body from the sample of it kept so far, and
+ * write the sample out. */
+static void
+json_choose_encoding(json_data_t *j, json_body_t *body) {
+  body->encoding = json_body_binary(body->sample, body->nsample)
+                   ? JSON_BODY_BASE64 : JSON_BODY_STRING;
+  json_write_body( j, body, body->sample, body->nsample );
+  body->nsample = 0;
+}
+
+/*
+ * Does the start of a body look like binary data, which is smaller
+ * base64-encoded than escaped (a control character takes six bytes
+ * escaped) or is not UTF-8 text, which escaping would not carry intact?
+ */
+static ngx_flag_t
+json_body_binary(u_char *p, size_t len) {
+  u_char *last;
+  uint32_t c;
+
+  len = ngx_min(len, json_body_sample_size);
+  last = p + len;
+
+  if ((len + ngx_escape_json(NULL, p, len)) * 3 > len * 4) {
+    return 1;
+  }
+
+  while (p < last) {
+    if (*p < 0x80) {
+      p++;
+      continue;
+    }
+    c = ngx_utf8_decode(&p, last - p);
+    if (c == 0xfffffffe) {
+      /* Cut off by the end of the sample */
+      break;
+    }
+    if (c > 0x10ffff) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Write part of a body base64-encoded. Bytes that don't make up a whole
+ * group are kept until the next part, or the end of the body. Sets
+ * `j->oom` if an error occurs.
+ */
+static void
+json_write_base64(json_data_t *j, json_body_t *body, u_char *src, size_t len) {
+  u_char *dst;
+  size_t take, n;
+
+  n = (body->ncarry + len) / 3;
+  if (n == 0) {
+    ngx_memcpy(body->carry + body->ncarry, src, len);
+    body->ncarry += len;
+    return;
+  }
+
+  dst = json_ensure_space( j, n * 4 );
+  if (dst == NULL) {
+    return;
+  }
+
+  /* Finish the group left over from the last part. */
+  if (body->ncarry > 0) {
+    take = 3 - body->ncarry;
+    ngx_memcpy(body->carry + body->ncarry, src, take);
+    dst = ngx_akita_base64_encode( dst, body->carry, 3 );
+    src += take;
+    len -= take;
+  }
+
+  n = len - len % 3;
+  dst = ngx_akita_base64_encode( dst, src, n );
+  body->ncarry = len - n;
+  ngx_memcpy(body->carry, src + n, body->ncarry);
+
+  j->content_length += dst - j->tail->buf->last;
+  j->tail->buf->last = dst;
+}
+
+/*
+ * Write part of a body as a body section. Memory that outlives the
+ * witness is linked in rather than copied. A copy is given room for the
+ * rest of the body expected, so a body that arrives in several parts is
+ * still copied into one buffer. Sets `j->oom` if an error occurs.
+ */
+static void
+json_write_section(json_data_t *j, json_body_t *body, u_char *src,
+                   size_t len, ngx_flag_t link) {
+  ngx_akita_frame_section_t section;
+  size_t size, room;
+
+  if (len == 0) {
+    return;
+  }
+
+  size = sizeof(ngx_akita_frame_section_t) + (link ? 0 : len);
+  if (j->tail->buf->last + size > j->tail->buf->end) {
+    room = 0;
+    if (!link && body->expected > body->length + len) {
+      room = body->expected - body->length - len;
+    }
+    if (json_add_buf(j, size + room, room) == NULL) {
+      return;
+    }
+  }
+
+  section.type = htons(body->section);
+  section.flags = 0;
+  section.length = htonl(len);
+  json_write_raw(j, (u_char *) &section, sizeof(ngx_akita_frame_section_t));
+
+  if (link) {
+    json_link(j, src, len);
+  } else {
+    json_write_raw(j, src, len);
+  }
+  body->length += len;
+}
+
+/* Turn the metadata in j into a section of the given type, followed by
+ * the body's sections. */
+static void
+json_frame_sections(json_data_t *j, ngx_uint_t type, json_body_t *body) {
+  ngx_akita_frame_section_t section;
+
+  section.type = htons(type);
+  section.flags = 0;
+  section.length = htonl(j->content_length);
+  json_prepend(j, &section, sizeof(ngx_akita_frame_section_t));
+  json_append(j, body->raw);
+}
+
+/* Put the frame header in front of the sections in j. */
+static void
+json_frame(json_data_t *j, ngx_akita_witness_kind_e kind) {
+  ngx_akita_frame_header_t header;
+
+  header.magic = htonl(NGX_AKITA_FRAME_MAGIC);
+  header.version = htons(NGX_AKITA_FRAME_VERSION);
+  header.kind = htons(kind);
+  header.length = htonl(j->content_length);
+  json_prepend(j, &header, sizeof(ngx_akita_frame_header_t));
+}
+
 /* Set the input (request body) content size on a request. */
 static ngx_int_t
 ngx_akita_set_request_size(ngx_http_request_t *r, ngx_uint_t content_length) {
@@ -450,19 +1097,18 @@ ngx_akita_set_request_size(ngx_http_request_t *r, ngx_uint_t content_length) {
   return NGX_OK;
 }
 
-/* Set the content-type header to application/json */
+/* Set the content-type header */
 static ngx_int_t
-ngx_akita_set_json_content_type(ngx_http_request_t *r) {
+ngx_akita_set_content_type(ngx_http_request_t *r, ngx_str_t *type) {
   ngx_table_elt_t *header;
   static ngx_str_t content_type_key = ngx_string("Content-Type");  
-  static ngx_str_t content_type_val = ngx_string("application/json");  
 
   header = ngx_list_push(&r->headers_in.headers);
   if (header == NULL) {
     return NGX_ERROR;
   }
   header->key = content_type_key;
-  header->value = content_type_val;
+  header->value = *type;
   header->hash = 1;
 
   r->headers_in.content_type = header;
@@ -494,17 +1140,39 @@ ngx_akita_send_request_body(ngx_http_request_t *r, ngx_str_t agent_path,
                             ngx_http_akita_ctx_t *ctx,
                             ngx_http_akita_loc_conf_t *config,
                             ngx_http_post_subrequest_t *callback) {
+  ngx_chain_t *in;
+
+  if (ngx_akita_start_request_body(r, ctx, config) != NGX_OK) {
+    return NGX_ERROR;
+  }
+
+  /* The body has been read in full, so its buffers stay put until the
+     request is finished. */
+  ctx->request_body_writer->link = 1;
+
+  if (r->request_body != NULL) {
+    for (in = r->request_body->bufs; in; in = in->next) {
+      if (ngx_akita_append_request_body(r, ctx, config, in->buf) != NGX_OK) {
+        ctx->request_body_json = NULL;
+        return NGX_ERROR;
+      }
+    }
+  }
+
+  return ngx_akita_finish_request_body(r, agent_path, ctx, config, callback);
+}
+
+ngx_int_t
+ngx_akita_start_request_body(ngx_http_request_t *r,
+                             ngx_http_akita_ctx_t *ctx,
+                             ngx_http_akita_loc_conf_t *config) {
   json_data_t *j;
   ngx_str_t request_id;
+  ngx_str_t *content_type;
+  ngx_list_t *headers;
+  size_t expected, trailer, size, room;
   ngx_int_t rc;
   
-  j = json_alloc( r->pool );
-  if (j == NULL) {
-    ngx_log_error( NGX_LOG_ERR, r->connection->log, 0,
-                   "Could not allocate JSON buffer" );
-    return NGX_ERROR;
-  }
-  
   rc = ngx_akita_get_request_id(r, &request_id );
   if (rc != NGX_OK) {
     ngx_log_error( NGX_LOG_ERR, r->connection->log, 0,
@@ -518,6 +1186,8 @@ ngx_akita_send_request_body(ngx_http_request_t *r, ngx_str_t agent_path,
     { ngx_string( "path" ), r->uri, 0 },            /* 2 */
     { ngx_string( "host" ), ngx_null_string, 1 },   /* 3 */
     { ngx_string( "nginx_internal" ), ngx_string( "true" ), 1 }, /* 4 */
+    { ngx_string( "fidelity" ), ngx_akita_fidelity_names[ctx->fidelity],
+      ctx->fidelity == NGX_HTTP_AKITA_FIDELITY_FULL },  /* 5 */
     { ngx_null_string, ngx_null_string, 0 },
   };
   
@@ -535,54 +1205,220 @@ ngx_akita_send_request_body(ngx_http_request_t *r, ngx_str_t agent_path,
   if (r->internal) {
     string_fields[4].omit = 0;
   }
+
+  headers = ctx->fidelity == NGX_HTTP_AKITA_FIDELITY_METADATA
+            ? NULL : &r->headers_in.headers;
+  content_type = r->headers_in.content_type != NULL
+                 ? &r->headers_in.content_type->value : NULL;
+  expected = json_expected_body_size( r->headers_in.content_length_n,
+                                      ctx->max_body_size );
+
+  /* Size the witness, with the fields written once the body has arrived
+     (a truncated length is always counted), so it is written into a
+     single buffer. Only a body longer than expected, or escaped, goes on
+     into more. Those fields go after an embedded body, in its buffer,
+     and the room for the body is charged to admission as it fills. */
+  static ngx_str_t request_start_key = ngx_string("request_start");
+  trailer = 1 + json_uint_property_size( &json_truncated_key )
+            + 1 + json_string_literal_size( &json_request_arrived_key ) + 1
+            + json_time_format.len + 1;
+  if (config->combined && config->format == NGX_HTTP_AKITA_FORMAT_JSON) {
+    /* The response itself, and the closing brace, follow in its buffers. */
+    trailer += sizeof(",\"response\":") - 1;
+  }
+  size = 1 + json_kv_strings_size( string_fields ) + 1
+         + ngx_akita_headers_list_size( headers ) + 1
+         + json_string_literal_size( &request_start_key ) + 1
+         + json_time_format.len + 1
+         + json_body_size( config, content_type, expected, &room );
+  if (!json_body_embedded( config, content_type )) {
+    size += trailer;
+  }
+  if (config->combined && config->format == NGX_HTTP_AKITA_FORMAT_JSON) {
+    size += sizeof("{\"request\":") - 1;
+  }
+
+  j = json_alloc( r->pool, ctx->in_flight, size, room );
+  if (j == NULL) {
+    ngx_log_error( NGX_LOG_ERR, r->connection->log, 0,
+                   "Could not allocate JSON buffer" );
+    return NGX_ERROR;
+  }
   
+  /* A combined witness starts with the request; in the binary format,
+     its sections are simply followed by the response's. */
+  static ngx_str_t request_key = ngx_string("request");
+  if (config->combined && config->format == NGX_HTTP_AKITA_FORMAT_JSON) {
+    json_write_char( j, '{' );
+    json_write_string_literal( j, &request_key );
+    json_write_char( j, ':' );
+  }
+
   json_write_char( j, '{' );
   json_write_kv_strings( j, string_fields );
   json_write_char( j, ',' );
 
-  ngx_akita_write_headers_list( j, &r->headers_in.headers );
+  ngx_akita_write_headers_list( j, headers );
   json_write_char( j, ',' );
     
-  static ngx_str_t request_start_key = ngx_string("request_start");
-  static ngx_str_t request_arrived_key = ngx_string("request_arrived");
   json_write_string_literal( j, &request_start_key );
   json_write_char( j, ':' );
   json_write_time_literal( j, &ctx->request_start );  
   json_write_char( j, ',' );
-  
-  json_write_string_literal( j, &request_arrived_key );
+
+  /* The body is written as it arrives; the time it finished arriving
+     comes after it. */
+  if (json_start_body( r, j, &ctx->request_body_writer, content_type,
+                       NGX_AKITA_FRAME_REQUEST_BODY, expected, trailer ) != NGX_OK) {
+    ngx_log_error( NGX_LOG_ERR, r->connection->log, 0,
+                   "JSON body got out-of-memory" );
+    return NGX_ERROR;
+  }
+
+  ctx->request_body_json = j;
+  ctx->request_body_size = 0;
+  return NGX_OK;
+}
+
+ngx_int_t
+ngx_akita_append_request_body(ngx_http_request_t *r,
+                              ngx_http_akita_ctx_t *ctx,
+                              ngx_http_akita_loc_conf_t *config,
+                              ngx_buf_t *buf) {
+  return json_escape_buf(ctx->request_body_json, r, ctx->max_body_size,
+                         &ctx->request_body_size, ctx->request_body_writer, buf);
+}
+
+ngx_int_t
+ngx_akita_finish_request_body(ngx_http_request_t *r, ngx_str_t agent_path,
+                              ngx_http_akita_ctx_t *ctx,
+                              ngx_http_akita_loc_conf_t *config,
+                              ngx_http_post_subrequest_t *callback) {
+  json_data_t *j = ctx->request_body_json;
+
+  ctx->request_body_json = NULL;
+
+  json_finish_body( j, ctx->request_body_writer );
+  if (ctx->request_body_size > ctx->max_body_size) {
+    json_write_char( j, ',' );
+    json_write_uint_property( j, &json_truncated_key, ctx->request_body_size );
+  }
+  json_write_char( j, ',' );
+
+  json_write_string_literal( j, &json_request_arrived_key );
   json_write_char( j, ':' );
   json_write_time_literal( j, &ctx->request_arrived );
-  json_write_char( j, ',' );
-                            
-  ngx_akita_write_body( j, r, config->max_body_size );
   json_write_char( j, '}' );
 
+  if (config->format == NGX_HTTP_AKITA_FORMAT_BINARY) {
+    json_frame_sections( j, NGX_AKITA_FRAME_REQUEST, ctx->request_body_writer );
+  }
+  json_charge_room( j );
+
   if (j->oom) {
     ngx_log_error( NGX_LOG_ERR, r->connection->log, 0,
                    "JSON body got out-of-memory" );
     return NGX_ERROR;
   }
 
+  /* Hold on to the request until the response is complete. */
+  if (config->combined) {
+    ctx->request_json = j;
+    return NGX_OK;
+  }
+
+  if (config->format == NGX_HTTP_AKITA_FORMAT_BINARY) {
+    json_frame( j, ngx_akita_witness_request );
+  }
+
   /* Mark end of body */
   j->tail->buf->last_buf = 1;
 
-  return ngx_akita_send_api_call(r, agent_path, callback, config, j->chain, j->content_length);
+  return ngx_akita_send_api_call(r, agent_path, ngx_akita_witness_request,
+                                 callback, config, j->chain, j->content_length);
 }
 
 
-/* Create a subrequest with the JSON payload, sent to the configured upstream
-   with the agent_path as the HTTP path. */
+/* Create a subrequest with the JSON payload, sent to the upstream of the
+   agent chosen for the request with the agent_path as the HTTP path. With detached delivery, the payload
+   is instead handed to the agent's sender (added to its next batch, if
+   batching is enabled), with ring delivery it is written to the shared
+   ring, and with datagram delivery it is sent as one or more datagrams;
+   in those cases the callback is not used. */
 static ngx_int_t
 ngx_akita_send_api_call(ngx_http_request_t *r,
                         ngx_str_t agent_path,
+                        ngx_akita_witness_kind_e kind,
                         ngx_http_post_subrequest_t *callback,
                         ngx_http_akita_loc_conf_t *config,
                         ngx_chain_t *body,
                         size_t content_length) {
   ngx_int_t rc;
   ngx_http_request_t *subreq;
-  ngx_http_akita_ctx_t *subreq_ctx;
+  ngx_http_akita_ctx_t *ctx, *subreq_ctx;
+  ngx_http_akita_main_conf_t *amcf;
+  ngx_http_akita_agent_t *agent;
+  ngx_akita_stats_t *stats;
+  ngx_str_t request_id;
+  ngx_str_t *content_type;
+  ngx_int_t index;
+  static ngx_str_t json_content_type = ngx_string("application/json");
+  static ngx_str_t frame_content_type = ngx_string(NGX_AKITA_FRAME_CONTENT_TYPE);
+
+  content_type = config->format == NGX_HTTP_AKITA_FORMAT_BINARY
+                 ? &frame_content_type : &json_content_type;
+
+  amcf = ngx_http_get_module_main_conf(r, ngx_http_akita_module);
+  if (config->delivery == NGX_HTTP_AKITA_DELIVERY_RING) {
+    /* A full ring is counted in the ring itself; it's not an agent failure. */
+    rc = ngx_akita_ring_write(amcf->ring, kind, body, content_length);
+    return rc == NGX_DECLINED ? NGX_OK : rc;
+  }
+
+  if (config->delivery == NGX_HTTP_AKITA_DELIVERY_DATAGRAM) {
+    stats = ngx_akita_stats_get(r);
+    if (stats == NULL) {
+      return NGX_ERROR;
+    }
+    ngx_akita_datagram_send(amcf->datagram, stats, kind, body, content_length);
+    return NGX_OK;
+  }
+
+  /* Both halves of a request go to the same agent: the one chosen for
+     the first half. If that agent has been blocked since, the second
+     half is dropped; it doesn't spend another probe. */
+  ctx = ngx_http_get_module_ctx(r, ngx_http_akita_module);
+  if (ctx != NULL && ctx->agent_chosen
+      && ctx->agent_index < config->agents->nagents) {
+    index = ctx->agent_index;
+    agent = config->agents->agents[index];
+    if (ngx_http_akita_agent_blocked(agent)) {
+      return NGX_OK;
+    }
+
+  } else {
+    if (ngx_akita_get_request_id(r, &request_id) != NGX_OK) {
+      ngx_str_null(&request_id);
+    }
+    index = ngx_http_akita_select_agent(config->agents, &request_id);
+    if (index == NGX_DECLINED) {
+      /* Every agent is backed off. */
+      return NGX_OK;
+    }
+    agent = config->agents->agents[index];
+
+    if (ctx != NULL) {
+      ctx->agent_index = index;
+      ctx->agent_chosen = 1;
+    }
+  }
+
+  if (config->delivery == NGX_HTTP_AKITA_DELIVERY_DETACHED) {
+    if (amcf->batch_size > 0) {
+      return ngx_akita_sender_batch(agent, kind, body, content_length);
+    }
+    return ngx_akita_sender_send(agent, &agent_path, content_type, body, content_length);
+  }
     
   ngx_str_t query_params = ngx_null_string;
   rc = ngx_http_subrequest( r,
@@ -617,14 +1453,14 @@ ngx_akita_send_api_call(ngx_http_request_t *r,
                    "Could not set content-length header" );    
     return NGX_ERROR;
   }
-  if (ngx_akita_set_json_content_type( subreq ) != NGX_OK) {
+  if (ngx_akita_set_content_type( subreq, content_type ) != NGX_OK) {
     ngx_log_error( NGX_LOG_ERR, r->connection->log, 0,
                    "Could not set content type header" );    
     return NGX_ERROR;
   }
   /* TODO: set Host header here as well? */
 
-  /* Assign the subrequest to the Akita agent which was configured
+  /* Assign the subrequest to the Akita agent chosen from those configured
    * for this location. We will find this context later
    * and send it onwards to that location.
    */
@@ -632,7 +1468,9 @@ ngx_akita_send_api_call(ngx_http_request_t *r,
   if (subreq_ctx == NULL) {
     return NGX_ERROR;
   }
-  subreq_ctx->subrequest_upstream = &config->upstream;
+  subreq_ctx->subrequest_upstream = &config->agent_upstreams[index];
+  subreq_ctx->subrequest_agent = agent;
+  subreq_ctx->subrequest_start = ngx_current_msec;
   ngx_http_set_ctx(subreq, subreq_ctx, ngx_http_akita_module);
   return NGX_OK;    
   
@@ -647,21 +1485,19 @@ typedef struct ngx_akita_internal_header_s {
 ngx_int_t
 ngx_akita_start_response_body(ngx_http_request_t *r, 
                               ngx_http_akita_ctx_t *ctx) {
+  ngx_http_akita_loc_conf_t *config;
   u_char *buf;
   json_data_t *j;
   ngx_str_t request_id;
   ngx_int_t rc;
   ngx_list_t extra_headers;
+  ngx_list_t *headers;
   ngx_akita_internal_header_t *int_header;
   ngx_table_elt_t *header;
+  size_t expected, trailer, size, room;
   
-  j = json_alloc( r->pool );
-  if (j == NULL) {
-    ngx_log_error( NGX_LOG_ERR, r->connection->log, 0,
-                   "Could not allocate JSON buffer" );
-    return NGX_ERROR;
-  }
-  
+  config = ngx_http_get_module_loc_conf(r, ngx_http_akita_module);
+
   rc = ngx_akita_get_request_id(r, &request_id );
   if (rc != NGX_OK) {
     ngx_log_error( NGX_LOG_ERR, r->connection->log, 0,
@@ -671,17 +1507,11 @@ ngx_akita_start_response_body(ngx_http_request_t *r,
 
   json_kv_string_t string_fields[] = {
     { ngx_string( "request_id" ), request_id, 0 },  /* 0 */
+    { ngx_string( "fidelity" ), ngx_akita_fidelity_names[ctx->fidelity],
+      ctx->fidelity == NGX_HTTP_AKITA_FIDELITY_FULL },  /* 1 */
     { ngx_null_string, ngx_null_string, 0 },
   };
 
-  json_write_char( j, '{' );
-  json_write_kv_strings( j, string_fields );
-  json_write_char( j, ',' );
-
-  static ngx_str_t response_code_key = ngx_string( "response_code" );
-  json_write_uint_property(j, &response_code_key, r->headers_out.status);
-  json_write_char( j, ',' );
-
   /* Nginx-written headers are not present, nor are the ones from 
    * the upstream response that will be overwritten?  See
    * https://forum.nginx.org/read.php?2,225317,225329#msg-225329
@@ -749,27 +1579,69 @@ ngx_akita_start_response_body(ngx_http_request_t *r,
   
   extra_headers.last->next = &r->headers_out.headers.part;
   extra_headers.last = r->headers_out.headers.last;
-    
-  ngx_akita_write_headers_list( j, &extra_headers );
+
+  headers = ctx->fidelity == NGX_HTTP_AKITA_FIDELITY_METADATA
+            ? NULL : &extra_headers;
+  expected = r->header_only ? 0
+             : json_expected_body_size( r->headers_out.content_length_n,
+                                        ctx->max_body_size );
+
+  /* Size the witness, with the fields written once the body is complete,
+     as for the request. */
+  static ngx_str_t response_code_key = ngx_string( "response_code" );
+  static ngx_str_t response_start_key = ngx_string("response_start");
+  trailer = 1 + json_uint_property_size( &json_truncated_key ) + 1
+            + json_string_literal_size( &json_response_complete_key ) + 1
+            + json_time_format.len + 1;
+  if (config->combined && config->format == NGX_HTTP_AKITA_FORMAT_JSON) {
+    /* Closes the combined witness */
+    trailer += 1;
+  }
+  size = 1 + json_kv_strings_size( string_fields ) + 1
+         + json_uint_property_size( &response_code_key ) + 1
+         + ngx_akita_headers_list_size( headers ) + 1
+         + json_string_literal_size( &response_start_key ) + 1
+         + json_time_format.len + 1
+         + json_body_size( config, &r->headers_out.content_type, expected, &room );
+  if (!json_body_embedded( config, &r->headers_out.content_type )) {
+    size += trailer;
+  }
+
+  j = json_alloc( r->pool, ctx->in_flight, size, room );
+  if (j == NULL) {
+    ngx_log_error( NGX_LOG_ERR, r->connection->log, 0,
+                   "Could not allocate JSON buffer" );
+    return NGX_ERROR;
+  }
+
+  json_write_char( j, '{' );
+  json_write_kv_strings( j, string_fields );
+  json_write_char( j, ',' );
+
+  json_write_uint_property(j, &response_code_key, r->headers_out.status);
+  json_write_char( j, ',' );
+
+  ngx_akita_write_headers_list( j, headers );
   json_write_char( j, ',' );
     
-  static ngx_str_t response_start_key = ngx_string("response_start");
   json_write_string_literal( j, &response_start_key );
   json_write_char( j, ':' );
   json_write_time_literal( j, &ctx->response_start );
   json_write_char( j, ',' );
   
-  static ngx_str_t body_key = ngx_string( "body" );
-  json_write_string_literal( j, &body_key );
-  json_write_char( j, ':' );
-  json_write_char( j, '"' );
-
-  if (j->oom) {
+  if (json_start_body( r, j, &ctx->response_body_writer,
+                       &r->headers_out.content_type,
+                       NGX_AKITA_FRAME_RESPONSE_BODY, expected,
+                       trailer ) != NGX_OK) {
     ngx_log_error( NGX_LOG_ERR, r->connection->log, 0,
                    "JSON body got out-of-memory" );
     return NGX_ERROR;
   }
 
+  /* In log-phase mode, the body is written from copies that are kept
+   * until the request is finished. */
+  ctx->response_body_writer->link = config->log_phase;
+
   /* 
    * Set up context for rest of body.
    * The body filter is called even when content length is zero or
@@ -788,8 +1660,9 @@ ngx_akita_append_response_body(ngx_http_request_t *r,
                                ngx_buf_t *buf) {
   ngx_int_t err;
   err = json_escape_buf(ctx->response_json, r,
-                        config->max_body_size,
+                        ctx->max_body_size,
                         &ctx->response_body_size,
+                        ctx->response_body_writer,
                         buf);
   if (err != NGX_OK) {
     return err;
@@ -809,24 +1682,46 @@ ngx_akita_finish_response_body(ngx_http_request_t *r,
                                ngx_http_akita_loc_conf_t *config,
                                ngx_http_post_subrequest_t *callback) {
   json_data_t *j = ctx->response_json;
+  ngx_akita_witness_kind_e kind = ngx_akita_witness_response;
 
-  /* Finish the literal that contains the response body */
-  json_write_char( j, '"' );
+  /* Finish the response body */
+  json_finish_body( j, ctx->response_body_writer );
   json_write_char( j, ',' );
 
   /* Mark if the body was truncated, and its actual size */
-  if (ctx->response_body_size > config->max_body_size) {
-    static ngx_str_t truncated_key = ngx_string( "truncated" );
-    json_write_uint_property(j, &truncated_key, ctx->response_body_size);
+  if (ctx->response_body_size > ctx->max_body_size) {
+    json_write_uint_property(j, &json_truncated_key, ctx->response_body_size);
     json_write_char( j, ',' );
   }
   
-  static ngx_str_t response_start_key = ngx_string("response_complete");
-  json_write_string_literal( j, &response_start_key );
+  json_write_string_literal( j, &json_response_complete_key );
   json_write_char( j, ':' );
   json_write_time_literal( j, &ctx->response_complete );
 
   json_write_char( j, '}' );
+
+  if (config->format == NGX_HTTP_AKITA_FORMAT_BINARY) {
+    json_frame_sections( j, NGX_AKITA_FRAME_RESPONSE, ctx->response_body_writer );
+    if (ctx->request_json != NULL) {
+      json_append( ctx->request_json, j );
+      j = ctx->request_json;
+      kind = ngx_akita_witness_combined;
+    }
+    json_frame( j, kind );
+
+  } else if (ctx->request_json != NULL) {
+    /* Put the response after the request held from earlier, and close
+     * the combined witness. */
+    static ngx_str_t response_key = ngx_string("response");
+    json_write_char( ctx->request_json, ',' );
+    json_write_string_literal( ctx->request_json, &response_key );
+    json_write_char( ctx->request_json, ':' );
+    json_append( ctx->request_json, j );
+    j = ctx->request_json;
+    json_write_char( j, '}' );
+    kind = ngx_akita_witness_combined;
+  }
+  json_charge_room( j );
   
   if (j->oom) {
     ngx_log_error( NGX_LOG_ERR, r->connection->log, 0,
@@ -837,7 +1732,7 @@ ngx_akita_finish_response_body(ngx_http_request_t *r,
   /* Mark end of body */
   j->tail->buf->last_buf = 1;
 
-  return ngx_akita_send_api_call(r, agent_path, callback, config,
-                                 j->chain, j->content_length);
+  return ngx_akita_send_api_call(r, agent_path, kind,
+                                 callback, config, j->chain, j->content_length);
 }
 
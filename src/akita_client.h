@@ -21,6 +21,9 @@ ngx_akita_client_init(ngx_conf_t *cf);
  * client. This should be called in a body callback where the entire request
  * body is already available.
  *
+ * If combined witnesses are configured, nothing is sent yet; the encoded
+ * request is kept in ctx->request_json until the response is finished.
+ *
  * TODO: replace agent_path with an Nginx upstream.
  */
 ngx_int_t
@@ -29,6 +32,32 @@ ngx_akita_send_request_body(ngx_http_request_t *r, ngx_str_t agent_path,
                             ngx_http_akita_loc_conf_t *config,
                             ngx_http_post_subrequest_t *callback);
 
+/*
+ * Send a request whose body is streamed to the upstream rather than read
+ * first, in three steps. Start records the request's metadata and leaves
+ * ctx->request_body_json with a JSON string for the body started. Append
+ * adds a buffer from the body as it passes through the request body
+ * filter, up to the body size limit. Finish terminates the JSON, clears
+ * ctx->request_body_json, and sends it to agent_path (or holds it in
+ * ctx->request_json, like ngx_akita_send_request_body).
+ */
+ngx_int_t
+ngx_akita_start_request_body(ngx_http_request_t *r,
+                             ngx_http_akita_ctx_t *ctx,
+                             ngx_http_akita_loc_conf_t *config);
+
+ngx_int_t
+ngx_akita_append_request_body(ngx_http_request_t *r,
+                              ngx_http_akita_ctx_t *ctx,
+                              ngx_http_akita_loc_conf_t *config,
+                              ngx_buf_t *buf);
+
+ngx_int_t
+ngx_akita_finish_request_body(ngx_http_request_t *r, ngx_str_t agent_path,
+                              ngx_http_akita_ctx_t *ctx,
+                              ngx_http_akita_loc_conf_t *config,
+                              ngx_http_post_subrequest_t *callback);
+
 /*
  * Records the response's metadata and start building its response body.
  * Allocates ctx->response_json from the pool in r. On return,
@@ -54,7 +83,8 @@ ngx_akita_append_response_body(ngx_http_request_t *r,
 /*
  * Finish sending the response body to Akita, using the partially
  * assembled JSON body in ctx->json_response. Create a new subrequest
- * of the original request r, and send it to agent_path. 
+ * of the original request r, and send it to agent_path. If the request
+ * was held in ctx->request_json, send both in one combined witness.
  */
 ngx_int_t
 ngx_akita_finish_response_body(ngx_http_request_t *r,
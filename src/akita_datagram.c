@@ -0,0 +1,255 @@
+/*
+ * Copyright (C) 2023 Akita Software
+ */
+
+#include "ngx_http_akita_module.h"
+#include "akita_datagram.h"
+
+/* Per-worker state of the datagram transport. The configuration is
+ * copied into each worker, so each one opens its own socket. */
+struct ngx_akita_datagram_s {
+  ngx_addr_t addr;             /* Agent's socket */
+  int type;                    /* SOCK_DGRAM or SOCK_SEQPACKET */
+  size_t max_size;             /* Largest datagram to send, with header */
+  ngx_uint_t oversize;         /* NGX_AKITA_DATAGRAM_TRUNCATE or FRAGMENT */
+  ngx_socket_t fd;             /* Connected socket, or -1 */
+  time_t retry;                /* Don't try to connect again before this */
+  uint32_t next_id;
+};
+
+static ngx_int_t ngx_akita_datagram_open(ngx_akita_datagram_t *dg);
+static ngx_int_t ngx_akita_datagram_sendmsg(ngx_akita_datagram_t *dg, struct iovec *iov, ngx_uint_t n);
+
+/* Most pieces of body to gather into one datagram */
+#define NGX_AKITA_DATAGRAM_IOVS  64
+
+static const size_t default_datagram_size = 64 * 1024;
+static const size_t min_datagram_size = 512;
+
+char *
+ngx_akita_datagram_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+  ngx_http_akita_main_conf_t *amcf = conf;
+  ngx_akita_datagram_t *dg;
+  ngx_str_t *value, s;
+  ngx_uint_t i;
+  ngx_url_t u;
+  ssize_t size;
+
+  if (amcf->datagram != NULL) {
+    return "is duplicate";
+  }
+
+  dg = ngx_pcalloc(cf->pool, sizeof(ngx_akita_datagram_t));
+  if (dg == NULL) {
+    return NGX_CONF_ERROR;
+  }
+  dg->type = SOCK_DGRAM;
+  dg->max_size = default_datagram_size;
+  dg->oversize = NGX_AKITA_DATAGRAM_TRUNCATE;
+  dg->fd = (ngx_socket_t) -1;
+
+  value = cf->args->elts;
+
+  ngx_memzero(&u, sizeof(ngx_url_t));
+  u.url = value[1];
+  if (ngx_parse_url(cf->pool, &u) != NGX_OK || u.family != AF_UNIX) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "%s in \"%V\"", u.err ? u.err : "not a unix: address",
+                       &value[1]);
+    return NGX_CONF_ERROR;
+  }
+  dg->addr = u.addrs[0];
+
+  for (i = 2; i < cf->args->nelts; i++) {
+    if (ngx_strcmp(value[i].data, "type=dgram") == 0) {
+      dg->type = SOCK_DGRAM;
+      continue;
+    }
+
+    if (ngx_strcmp(value[i].data, "type=seqpacket") == 0) {
+      dg->type = SOCK_SEQPACKET;
+      continue;
+    }
+
+    if (ngx_strncmp(value[i].data, "max_size=", 9) == 0) {
+      s.len = value[i].len - 9;
+      s.data = value[i].data + 9;
+
+      size = ngx_parse_size(&s);
+      if (size == NGX_ERROR || size < (ssize_t) min_datagram_size) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid datagram size \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+      }
+      dg->max_size = size;
+      continue;
+    }
+
+    if (ngx_strcmp(value[i].data, "oversize=truncate") == 0) {
+      dg->oversize = NGX_AKITA_DATAGRAM_TRUNCATE;
+      continue;
+    }
+
+    if (ngx_strcmp(value[i].data, "oversize=fragment") == 0) {
+      dg->oversize = NGX_AKITA_DATAGRAM_FRAGMENT;
+      continue;
+    }
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+    return NGX_CONF_ERROR;
+  }
+
+  amcf->datagram = dg;
+  return NGX_CONF_OK;
+}
+
+void
+ngx_akita_datagram_send(ngx_akita_datagram_t *dg, ngx_akita_stats_t *stats,
+                        ngx_uint_t kind, ngx_chain_t *body, size_t content_length) {
+  ngx_akita_datagram_header_t header;
+  struct iovec iov[NGX_AKITA_DATAGRAM_IOVS];
+  size_t payload_max, offset, size, take;
+  ngx_uint_t n, datagrams;
+  ngx_flag_t truncated;
+  ngx_chain_t *cl;
+  u_char *pos;
+
+  if (dg->fd == (ngx_socket_t) -1 && ngx_akita_datagram_open(dg) != NGX_OK) {
+    goto dropped;
+  }
+
+  payload_max = dg->max_size - sizeof(ngx_akita_datagram_header_t);
+
+  header.kind = htons(kind);
+  header.sender = htonl((uint32_t) ngx_pid);
+  header.id = htonl(dg->next_id++);
+  header.length = htonl(content_length);
+
+  cl = body;
+  pos = cl ? cl->buf->pos : NULL;
+  offset = 0;
+  datagrams = 0;
+
+  do {
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(ngx_akita_datagram_header_t);
+    n = 1;
+    size = 0;
+
+    /* Gather as much of the body as fits into this datagram. */
+    while (cl != NULL && size < payload_max && n < NGX_AKITA_DATAGRAM_IOVS) {
+      take = ngx_min((size_t) (cl->buf->last - pos), payload_max - size);
+      if (take > 0) {
+        iov[n].iov_base = pos;
+        iov[n].iov_len = take;
+        n++;
+        size += take;
+        pos += take;
+      }
+
+      if (pos == cl->buf->last) {
+        cl = cl->next;
+        pos = cl ? cl->buf->pos : NULL;
+      }
+    }
+
+    if (size == 0 && offset < content_length) {
+      /* The body ended short of content_length; don't spin sending
+       * empty fragments. */
+      goto dropped;
+    }
+
+    truncated = offset + size < content_length
+                && dg->oversize == NGX_AKITA_DATAGRAM_TRUNCATE;
+    header.offset = htonl(offset);
+    header.flags = htons(truncated ? NGX_AKITA_DATAGRAM_TRUNCATED : 0);
+
+    if (ngx_akita_datagram_sendmsg(dg, iov, n) != NGX_OK) {
+      goto dropped;
+    }
+
+    offset += size;
+    datagrams++;
+  } while (offset < content_length && dg->oversize == NGX_AKITA_DATAGRAM_FRAGMENT);
+
+  if (truncated) {
+    (void) ngx_atomic_fetch_add(&stats->datagram_truncated, 1);
+  }
+  if (datagrams > 1) {
+    (void) ngx_atomic_fetch_add(&stats->datagram_fragmented, 1);
+  }
+  (void) ngx_atomic_fetch_add(&stats->datagram_sent, 1);
+  return;
+
+dropped:
+
+  (void) ngx_atomic_fetch_add(&stats->datagram_dropped, 1);
+}
+
+/* Send one datagram. Returns NGX_ERROR if it wasn't sent. */
+static ngx_int_t
+ngx_akita_datagram_sendmsg(ngx_akita_datagram_t *dg, struct iovec *iov, ngx_uint_t n) {
+  struct msghdr msg;
+  ngx_err_t err;
+
+  ngx_memzero(&msg, sizeof(struct msghdr));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = n;
+
+  if (sendmsg(dg->fd, &msg, 0) != -1) {
+    return NGX_OK;
+  }
+
+  err = ngx_socket_errno;
+  if (err == NGX_EAGAIN || err == ENOBUFS) {
+    /* The agent isn't keeping up; drop this one. */
+    return NGX_ERROR;
+  }
+
+  ngx_log_error(NGX_LOG_INFO, ngx_cycle->log, err,
+                "sendmsg() to Akita agent at \"%V\" failed", &dg->addr.name);
+
+  if (err != EMSGSIZE) {
+    /* The agent has probably gone away; reconnect later. */
+    ngx_close_socket(dg->fd);
+    dg->fd = (ngx_socket_t) -1;
+  }
+  return NGX_ERROR;
+}
+
+/* Connect to the agent's socket, at most once a second. */
+static ngx_int_t
+ngx_akita_datagram_open(ngx_akita_datagram_t *dg) {
+  ngx_socket_t fd;
+
+  if (ngx_time() < dg->retry) {
+    return NGX_DECLINED;
+  }
+  dg->retry = ngx_time() + 1;
+
+  fd = ngx_socket(AF_UNIX, dg->type, 0);
+  if (fd == (ngx_socket_t) -1) {
+    ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_socket_errno,
+                  ngx_socket_n " failed");
+    return NGX_ERROR;
+  }
+
+  /* A Unix socket connects immediately, or not at all. */
+  if (connect(fd, dg->addr.sockaddr, dg->addr.socklen) == -1) {
+    ngx_log_error(NGX_LOG_INFO, ngx_cycle->log, ngx_socket_errno,
+                  "connect() to Akita agent at \"%V\" failed", &dg->addr.name);
+    ngx_close_socket(fd);
+    return NGX_ERROR;
+  }
+
+  if (ngx_nonblocking(fd) == -1) {
+    ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_socket_errno,
+                  ngx_nonblocking_n " failed");
+    ngx_close_socket(fd);
+    return NGX_ERROR;
+  }
+
+  dg->fd = fd;
+  return NGX_OK;
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2023 Akita Software
+ */
+
+#ifndef _AKITA_NGX_MODULE_AKITA_DATAGRAM_H_INCLUDED
+#define _AKITA_NGX_MODULE_AKITA_DATAGRAM_H_INCLUDED
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include "akita_stats.h"
+
+/*
+ * A fire-and-forget transport: each witness is sent to the agent with a
+ * single sendmsg() on a Unix SOCK_DGRAM or SOCK_SEQPACKET socket. Nothing
+ * is read back. Every datagram starts with an ngx_akita_datagram_header_t,
+ * whose integers are in network byte order, with no padding.
+ *
+ * A witness too large for one datagram is either truncated, with
+ * NGX_AKITA_DATAGRAM_TRUNCATED set, or split into fragments with the same
+ * sender and id, each giving the offset of its payload within the
+ * witness. Every worker process numbers its witnesses from 0, and their
+ * fragments may arrive interleaved on the same socket, so fragments must
+ * be reassembled by (sender, id), never by id alone. The witness is
+ * complete when offset plus payload length equals length.
+ */
+
+#define NGX_AKITA_DATAGRAM_TRUNCATED  0x0001
+
+/* What to do with a witness that doesn't fit in max_size */
+#define NGX_AKITA_DATAGRAM_TRUNCATE   0
+#define NGX_AKITA_DATAGRAM_FRAGMENT   1
+
+typedef struct {
+  uint16_t kind;               /* ngx_akita_witness_kind_e */
+  uint16_t flags;              /* NGX_AKITA_DATAGRAM_* */
+  uint32_t sender;             /* Process ID of the worker that sent it */
+  uint32_t id;                 /* Per-worker sequence number of the witness */
+  uint32_t offset;             /* Offset of this payload within the witness */
+  uint32_t length;             /* Length of the whole witness */
+} ngx_akita_datagram_header_t;
+
+typedef struct ngx_akita_datagram_s ngx_akita_datagram_t;
+
+/*
+ * Implements the 'akita_datagram' directive:
+ *   akita_datagram unix:<path> [type=dgram|seqpacket] [max_size=<size>]
+ *                  [oversize=truncate|fragment];
+ */
+char *
+ngx_akita_datagram_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+/*
+ * Send one witness, held in body. Problems are counted in stats rather
+ * than reported, since the agent gives no answer either way.
+ */
+void
+ngx_akita_datagram_send(ngx_akita_datagram_t *dg, ngx_akita_stats_t *stats,
+                        ngx_uint_t kind, ngx_chain_t *body, size_t content_length);
+
+#endif /* _AKITA_NGX_MODULE_AKITA_DATAGRAM_H_INCLUDED */
@@ -0,0 +1,255 @@
+/*
+ * Copyright (C) 2023 Akita Software
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include "akita_escape.h"
+
+#if ((__x86_64__ || __i386__) && (__GNUC__ || __clang__))
+#include <immintrin.h>
+#define NGX_AKITA_HAVE_AVX2  1
+#if (__SSE2__)
+#define NGX_AKITA_HAVE_SSE2  1
+#endif
+#endif
+
+typedef size_t (*ngx_akita_escape_pt)(u_char **dst, u_char *end, u_char *src, size_t size);
+typedef size_t (*ngx_akita_escape_scan_pt)(u_char *src, size_t size);
+
+static size_t ngx_akita_escape_json_scalar(u_char **dst, u_char *end, u_char *src, size_t size);
+static size_t ngx_akita_escape_scan_scalar(u_char *src, size_t size);
+#if (NGX_AKITA_HAVE_SSE2)
+static size_t ngx_akita_escape_json_sse2(u_char **dst, u_char *end, u_char *src, size_t size);
+static size_t ngx_akita_escape_scan_sse2(u_char *src, size_t size);
+#endif
+#if (NGX_AKITA_HAVE_AVX2)
+static size_t ngx_akita_escape_json_avx2(u_char **dst, u_char *end, u_char *src, size_t size);
+static size_t ngx_akita_escape_scan_avx2(u_char *src, size_t size);
+#endif
+
+static ngx_akita_escape_pt ngx_akita_escape_kernel = ngx_akita_escape_json_scalar;
+static ngx_akita_escape_scan_pt ngx_akita_escape_scan_kernel = ngx_akita_escape_scan_scalar;
+
+/* Bytes ngx_escape_json changes: control characters, '"' and '\' */
+static const u_char ngx_akita_escape_special[256] = {
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0,
+};
+
+void
+ngx_akita_escape_init(void) {
+#if (NGX_AKITA_HAVE_AVX2)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    ngx_akita_escape_kernel = ngx_akita_escape_json_avx2;
+    ngx_akita_escape_scan_kernel = ngx_akita_escape_scan_avx2;
+    return;
+  }
+#endif
+#if (NGX_AKITA_HAVE_SSE2)
+  ngx_akita_escape_kernel = ngx_akita_escape_json_sse2;
+  ngx_akita_escape_scan_kernel = ngx_akita_escape_scan_sse2;
+#endif
+}
+
+size_t
+ngx_akita_escape_json(u_char **dst, u_char *end, u_char *src, size_t size) {
+  return ngx_akita_escape_kernel(dst, end, src, size);
+}
+
+size_t
+ngx_akita_escape_scan(u_char *src, size_t size) {
+  return ngx_akita_escape_scan_kernel(src, size);
+}
+
+static size_t
+ngx_akita_escape_scan_scalar(u_char *src, size_t size) {
+  size_t n;
+
+  for (n = 0; n < size && !ngx_akita_escape_special[src[n]]; n++) {
+    /* void */
+  }
+  return n;
+}
+
+/* One byte at a time; also finishes off what the vector kernels leave. */
+static size_t
+ngx_akita_escape_json_scalar(u_char **dst, u_char *end, u_char *src, size_t size) {
+  u_char *p, *s, *last;
+
+  p = *dst;
+  s = src;
+  last = src + size;
+
+  while (s < last) {
+    if (!ngx_akita_escape_special[*s]) {
+      if (p == end) {
+        break;
+      }
+      *p++ = *s++;
+      continue;
+    }
+
+    if (end - p < NGX_AKITA_ESCAPE_MAX) {
+      break;
+    }
+    p = (u_char *) ngx_escape_json(p, s, 1);
+    s++;
+  }
+
+  *dst = p;
+  return s - src;
+}
+
+#if (NGX_AKITA_HAVE_SSE2)
+
+/* Store each block of 16 bytes as it is, then keep only the part before
+ * the first byte that needs escaping, if there is one. */
+static size_t
+ngx_akita_escape_json_sse2(u_char **dst, u_char *end, u_char *src, size_t size) {
+  __m128i quote, backslash, control, v, special;
+  u_char *p, *s, *last;
+  unsigned int mask, n;
+
+  quote = _mm_set1_epi8('"');
+  backslash = _mm_set1_epi8('\\');
+  control = _mm_set1_epi8(0x1f);
+
+  p = *dst;
+  s = src;
+  last = src + size;
+
+  while (last - s >= 16 && end - p >= 16) {
+    v = _mm_loadu_si128((__m128i *) s);
+    _mm_storeu_si128((__m128i *) p, v);
+
+    /* Unsigned v <= 0x1f is max(v, 0x1f) == 0x1f. */
+    special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote),
+                                        _mm_cmpeq_epi8(v, backslash)),
+                           _mm_cmpeq_epi8(_mm_max_epu8(v, control), control));
+    mask = _mm_movemask_epi8(special);
+    if (mask == 0) {
+      s += 16;
+      p += 16;
+      continue;
+    }
+
+    n = __builtin_ctz(mask);
+    s += n;
+    p += n;
+    if (end - p < NGX_AKITA_ESCAPE_MAX) {
+      break;
+    }
+    p = (u_char *) ngx_escape_json(p, s, 1);
+    s++;
+  }
+
+  n = ngx_akita_escape_json_scalar(&p, end, s, last - s);
+  *dst = p;
+  return s - src + n;
+}
+
+static size_t
+ngx_akita_escape_scan_sse2(u_char *src, size_t size) {
+  __m128i quote, backslash, control, v, special;
+  unsigned int mask;
+  size_t n;
+
+  quote = _mm_set1_epi8('"');
+  backslash = _mm_set1_epi8('\\');
+  control = _mm_set1_epi8(0x1f);
+
+  for (n = 0; size - n >= 16; n += 16) {
+    v = _mm_loadu_si128((__m128i *) (src + n));
+    special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote),
+                                        _mm_cmpeq_epi8(v, backslash)),
+                           _mm_cmpeq_epi8(_mm_max_epu8(v, control), control));
+    mask = _mm_movemask_epi8(special);
+    if (mask != 0) {
+      return n + __builtin_ctz(mask);
+    }
+  }
+
+  return n + ngx_akita_escape_scan_scalar(src + n, size - n);
+}
+
+#endif
+
+#if (NGX_AKITA_HAVE_AVX2)
+
+/* As ngx_akita_escape_json_sse2, 32 bytes at a time. */
+__attribute__((target("avx2")))
+static size_t
+ngx_akita_escape_json_avx2(u_char **dst, u_char *end, u_char *src, size_t size) {
+  __m256i quote, backslash, control, v, special;
+  u_char *p, *s, *last;
+  unsigned int mask, n;
+
+  quote = _mm256_set1_epi8('"');
+  backslash = _mm256_set1_epi8('\\');
+  control = _mm256_set1_epi8(0x1f);
+
+  p = *dst;
+  s = src;
+  last = src + size;
+
+  while (last - s >= 32 && end - p >= 32) {
+    v = _mm256_loadu_si256((__m256i *) s);
+    _mm256_storeu_si256((__m256i *) p, v);
+
+    special = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, quote),
+                                              _mm256_cmpeq_epi8(v, backslash)),
+                              _mm256_cmpeq_epi8(_mm256_max_epu8(v, control), control));
+    mask = _mm256_movemask_epi8(special);
+    if (mask == 0) {
+      s += 32;
+      p += 32;
+      continue;
+    }
+
+    n = __builtin_ctz(mask);
+    s += n;
+    p += n;
+    if (end - p < NGX_AKITA_ESCAPE_MAX) {
+      break;
+    }
+    p = (u_char *) ngx_escape_json(p, s, 1);
+    s++;
+  }
+
+  n = ngx_akita_escape_json_scalar(&p, end, s, last - s);
+  *dst = p;
+  return s - src + n;
+}
+
+__attribute__((target("avx2")))
+static size_t
+ngx_akita_escape_scan_avx2(u_char *src, size_t size) {
+  __m256i quote, backslash, control, v, special;
+  unsigned int mask;
+  size_t n;
+
+  quote = _mm256_set1_epi8('"');
+  backslash = _mm256_set1_epi8('\\');
+  control = _mm256_set1_epi8(0x1f);
+
+  for (n = 0; size - n >= 32; n += 32) {
+    v = _mm256_loadu_si256((__m256i *) (src + n));
+    special = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, quote),
+                                              _mm256_cmpeq_epi8(v, backslash)),
+                              _mm256_cmpeq_epi8(_mm256_max_epu8(v, control), control));
+    mask = _mm256_movemask_epi8(special);
+    if (mask != 0) {
+      return n + __builtin_ctz(mask);
+    }
+  }
+
+  return n + ngx_akita_escape_scan_scalar(src + n, size - n);
+}
+
+#endif
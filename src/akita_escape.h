@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2023 Akita Software
+ */
+
+#ifndef _AKITA_NGX_MODULE_AKITA_ESCAPE_H_INCLUDED
+#define _AKITA_NGX_MODULE_AKITA_ESCAPE_H_INCLUDED
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+/*
+ * JSON string escaping in a single pass, with the same output as
+ * ngx_escape_json. Runs of bytes that need no escaping are copied 16 or
+ * 32 at a time with SSE2 or AVX2, picked when the worker starts; each
+ * byte that does need escaping is handed to ngx_escape_json.
+ */
+
+/* Most output for one byte of input, "\u001F" */
+#define NGX_AKITA_ESCAPE_MAX  6
+
+/* Pick the fastest kernel this CPU supports. */
+void
+ngx_akita_escape_init(void);
+
+/*
+ * Escape src into *dst, stopping before the output would go past end,
+ * and move *dst past the output. Returns the number of bytes of src
+ * escaped, which is at least one if size is nonzero and there is room
+ * for NGX_AKITA_ESCAPE_MAX bytes.
+ */
+size_t
+ngx_akita_escape_json(u_char **dst, u_char *end, u_char *src, size_t size);
+
+/*
+ * Returns the number of bytes at the start of src that need no escaping.
+ * Inside a JSON string, the byte after them ends the string, starts an
+ * escape sequence or is not allowed.
+ */
+size_t
+ngx_akita_escape_scan(u_char *src, size_t size);
+
+#endif /* _AKITA_NGX_MODULE_AKITA_ESCAPE_H_INCLUDED */
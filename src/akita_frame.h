@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2023 Akita Software
+ */
+
+#ifndef _AKITA_NGX_MODULE_AKITA_FRAME_H_INCLUDED
+#define _AKITA_NGX_MODULE_AKITA_FRAME_H_INCLUDED
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+/*
+ * The binary witness format (see akita_format). Each witness is a frame:
+ * an ngx_akita_frame_header_t, followed by sections, each of which is an
+ * ngx_akita_frame_section_t followed by length bytes of payload. Integers
+ * are in network byte order, and there is no padding.
+ *
+ * A request or response starts with a metadata section, holding the same
+ * JSON object as in the JSON format but without the body, which follows
+ * in raw body sections. A body may be split over any number of them;
+ * there are none for an empty body. A combined witness has the request's
+ * sections followed by the response's.
+ *
+ * This lets bodies go to the agent as they are, and in-memory request
+ * bodies be linked into the witness rather than copied.
+ */
+
+#define NGX_AKITA_FRAME_MAGIC    0x414b5746    /* "AKWF" */
+#define NGX_AKITA_FRAME_VERSION  1
+
+/* Media type of a frame sent over HTTP */
+#define NGX_AKITA_FRAME_CONTENT_TYPE  "application/x-akita-witness"
+
+/* Section types */
+#define NGX_AKITA_FRAME_REQUEST        1    /* Request metadata */
+#define NGX_AKITA_FRAME_REQUEST_BODY   2    /* Part of the request body */
+#define NGX_AKITA_FRAME_RESPONSE       3    /* Response metadata */
+#define NGX_AKITA_FRAME_RESPONSE_BODY  4    /* Part of the response body */
+
+typedef struct {
+  uint32_t magic;              /* NGX_AKITA_FRAME_MAGIC */
+  uint16_t version;            /* NGX_AKITA_FRAME_VERSION */
+  uint16_t kind;               /* ngx_akita_witness_kind_e */
+  uint32_t length;             /* Length of the sections that follow */
+} ngx_akita_frame_header_t;
+
+typedef struct {
+  uint16_t type;               /* NGX_AKITA_FRAME_* */
+  uint16_t flags;              /* Reserved, always 0 */
+  uint32_t length;             /* Length of the payload that follows */
+} ngx_akita_frame_section_t;
+
+#endif /* _AKITA_NGX_MODULE_AKITA_FRAME_H_INCLUDED */
@@ -0,0 +1,407 @@
+/*
+ * Copyright (C) 2023 Akita Software
+ */
+
+#include "ngx_http_akita_module.h"
+#include "akita_health.h"
+
+/* States of an agent's circuit breaker */
+#define NGX_AKITA_HEALTH_CLOSED     0    /* Calls go through */
+#define NGX_AKITA_HEALTH_OPEN       1    /* Calls are blocked until retry_time */
+#define NGX_AKITA_HEALTH_HALF_OPEN  2    /* A few calls go through as probes */
+#define NGX_AKITA_HEALTH_OPENING    3    /* Being opened by one worker; calls
+                                            are blocked */
+
+/* Shared state of one agent. Only a worker that wins a compare-and-swap
+ * of state updates retry_time and backoff. */
+struct ngx_akita_health_s {
+  ngx_atomic_t state;          /* NGX_AKITA_HEALTH_* */
+  ngx_atomic_t retry_time;     /* Epoch seconds when an open breaker goes half-open */
+  ngx_atomic_t backoff;        /* Seconds to stay open for on the next failure */
+  ngx_atomic_t successes;      /* Consecutive successful probes while half-open */
+  ngx_atomic_t probe_time;     /* The second that probes counts calls in */
+  ngx_atomic_t probes;         /* Probes let through during probe_time */
+
+  /* Copied from the configuration */
+  ngx_atomic_t probe_rate;     /* Probes per second while half-open */
+  ngx_atomic_t probe_successes;  /* Consecutive successes needed to close */
+
+  /* Set by the agent's control headers */
+  ngx_atomic_t paused_until;   /* Epoch seconds until which calls are blocked */
+  ngx_atomic_t sample_rate;    /* Capture rate asked for, in NGX_HTTP_AKITA_RATE_SCALE */
+  ngx_atomic_t max_body_size;  /* Body size limit asked for, plus one; 0 for none */
+};
+
+static ngx_int_t ngx_akita_health_init_zone(ngx_shm_zone_t *shm_zone, void *data);
+static void ngx_akita_health_free_unused(ngx_slab_pool_t *shpool,
+                                         ngx_http_akita_main_conf_t *amcf,
+                                         ngx_http_akita_main_conf_t *old);
+static void ngx_akita_health_open(ngx_http_akita_agent_t *agent, ngx_atomic_uint_t from,
+                                  ngx_log_t *log);
+
+/* Minimum and maximum backoff period, in seconds */
+static const ngx_uint_t ngx_akita_health_initial_backoff = 30;
+static const ngx_uint_t ngx_akita_health_max_backoff = 240;
+
+/* Longest pause an agent may ask for, in seconds */
+static const time_t ngx_akita_health_max_pause = 3600;
+
+static ngx_str_t ngx_akita_health_zone_name = ngx_string("akita_health");
+
+ngx_int_t
+ngx_akita_health_add_zone(ngx_conf_t *cf, ngx_http_akita_main_conf_t *amcf) {
+  ngx_shm_zone_t *shm_zone;
+
+  shm_zone = ngx_shared_memory_add(cf, &ngx_akita_health_zone_name,
+                                   8 * ngx_pagesize, &ngx_http_akita_module);
+  if (shm_zone == NULL) {
+    return NGX_ERROR;
+  }
+
+  /* The agents are all known by the time the zone is initialized. */
+  shm_zone->init = ngx_akita_health_init_zone;
+  shm_zone->data = amcf;
+  amcf->health_zone = shm_zone;
+  return NGX_OK;
+}
+
+/* Give each agent its shared state. After a reload, an agent with the
+ * same address as before keeps its state. */
+static ngx_int_t
+ngx_akita_health_init_zone(ngx_shm_zone_t *shm_zone, void *data) {
+  ngx_http_akita_main_conf_t *amcf = shm_zone->data;
+  ngx_http_akita_main_conf_t *old = data;
+  ngx_http_akita_agent_t **agents, **old_agents;
+  ngx_slab_pool_t *shpool;
+  ngx_uint_t i, j;
+
+  shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+  agents = amcf->agents.elts;
+
+  for (i = 0; i < amcf->agents.nelts; i++) {
+    if (old != NULL) {
+      old_agents = old->agents.elts;
+      for (j = 0; j < old->agents.nelts; j++) {
+        if (old_agents[j]->address.len == agents[i]->address.len
+            && ngx_strncmp(old_agents[j]->address.data, agents[i]->address.data,
+                           agents[i]->address.len) == 0) {
+          agents[i]->health = old_agents[j]->health;
+          break;
+        }
+      }
+      if (agents[i]->health != NULL) {
+        continue;
+      }
+    }
+
+    agents[i]->health = ngx_slab_calloc(shpool, sizeof(ngx_akita_health_t));
+    if (agents[i]->health == NULL) {
+      return NGX_ERROR;
+    }
+    agents[i]->health->backoff = ngx_akita_health_initial_backoff;
+    agents[i]->health->sample_rate = NGX_HTTP_AKITA_RATE_SCALE;
+  }
+
+  /* The configuration may have changed since the state was created. */
+  for (i = 0; i < amcf->agents.nelts; i++) {
+    agents[i]->health->probe_rate = amcf->probe_rate;
+    agents[i]->health->probe_successes = amcf->probe_successes;
+  }
+
+  if (old != NULL) {
+    ngx_akita_health_free_unused(shpool, amcf, old);
+  }
+
+  return NGX_OK;
+}
+
+/* Free the state of agents that are no longer configured, so that reloads
+ * that change addresses don't use up the zone. Agents of the old
+ * configuration may share their state, so each is freed only once. */
+static void
+ngx_akita_health_free_unused(ngx_slab_pool_t *shpool, ngx_http_akita_main_conf_t *amcf,
+                             ngx_http_akita_main_conf_t *old) {
+  ngx_http_akita_agent_t **agents, **old_agents;
+  ngx_akita_health_t *h;
+  ngx_uint_t i, j;
+
+  agents = amcf->agents.elts;
+  old_agents = old->agents.elts;
+
+  for (j = 0; j < old->agents.nelts; j++) {
+    h = old_agents[j]->health;
+    if (h == NULL) {
+      continue;
+    }
+
+    for (i = 0; i < amcf->agents.nelts; i++) {
+      if (agents[i]->health == h) {
+        break;
+      }
+    }
+    if (i < amcf->agents.nelts) {
+      continue;
+    }
+
+    for (i = 0; i < j; i++) {
+      if (old_agents[i]->health == h) {
+        break;
+      }
+    }
+    if (i < j) {
+      continue;
+    }
+
+    ngx_slab_free(shpool, h);
+  }
+}
+
+/* Return true if calls to the agent are blocked outright. */
+ngx_flag_t
+ngx_http_akita_agent_blocked(ngx_http_akita_agent_t *agent) {
+  ngx_akita_health_t *h = agent->health;
+
+  if (ngx_time() < (time_t) h->paused_until) {
+    return 1;
+  }
+  if (h->state == NGX_AKITA_HEALTH_OPENING) {
+    return 1;
+  }
+  return h->state == NGX_AKITA_HEALTH_OPEN && ngx_time() < (time_t) h->retry_time;
+}
+
+/* Return true if a call can be sent to the agent now. While the breaker
+ * is half-open, this lets through probe_rate calls a second in total. */
+ngx_flag_t
+ngx_http_akita_agent_allowed(ngx_http_akita_agent_t *agent) {
+  ngx_akita_health_t *h = agent->health;
+  ngx_atomic_uint_t state, second;
+  time_t now;
+
+  now = ngx_time();
+  if (now < (time_t) h->paused_until) {
+    return 0;
+  }
+
+  state = h->state;
+  if (state == NGX_AKITA_HEALTH_CLOSED) {
+    return 1;
+  }
+  if (state == NGX_AKITA_HEALTH_OPENING) {
+    return 0;
+  }
+
+  if (state == NGX_AKITA_HEALTH_OPEN) {
+    if (now < (time_t) h->retry_time) {
+      return 0;
+    }
+
+    /* Time to start probing */
+    if (ngx_atomic_cmp_set(&h->state, NGX_AKITA_HEALTH_OPEN, NGX_AKITA_HEALTH_HALF_OPEN)) {
+      ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                    "Probing Akita agent \"%V\"", &agent->address);
+      h->successes = 0;
+    }
+  }
+
+  second = h->probe_time;
+  if (second != (ngx_atomic_uint_t) now
+      && ngx_atomic_cmp_set(&h->probe_time, second, now)) {
+    h->probes = 0;
+  }
+
+  return ngx_atomic_fetch_add(&h->probes, 1) < h->probe_rate;
+}
+
+/* Handle a successful request. While half-open, enough of them in a row
+ * close the breaker again; either way, reset the backoff to its initial
+ * (minimum) value. */
+void
+ngx_http_akita_agent_succeeded(ngx_http_akita_agent_t *agent) {
+  ngx_akita_health_t *h = agent->health;
+
+  if (h->state == NGX_AKITA_HEALTH_HALF_OPEN) {
+    if (ngx_atomic_fetch_add(&h->successes, 1) + 1 < h->probe_successes) {
+      return;
+    }
+
+    if (ngx_atomic_cmp_set(&h->state, NGX_AKITA_HEALTH_HALF_OPEN, NGX_AKITA_HEALTH_CLOSED)) {
+      ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                    "Mirroring to Akita agent \"%V\" resumed", &agent->address);
+      h->backoff = ngx_akita_health_initial_backoff;
+    }
+    return;
+  }
+
+  /* Avoid writing to the shared line on every call. */
+  if (h->state == NGX_AKITA_HEALTH_CLOSED
+      && h->backoff != ngx_akita_health_initial_backoff) {
+    h->backoff = ngx_akita_health_initial_backoff;
+  }
+}
+
+/* Handle an unsuccessful request by opening the breaker for every
+ * worker. A failure while it is already open, or being opened, doesn't
+ * count. */
+void
+ngx_http_akita_agent_failed(ngx_http_akita_agent_t *agent, ngx_log_t *log) {
+  ngx_atomic_uint_t state;
+
+  state = agent->health->state;
+  if (state == NGX_AKITA_HEALTH_CLOSED || state == NGX_AKITA_HEALTH_HALF_OPEN) {
+    ngx_akita_health_open(agent, state, log);
+  }
+}
+
+/* Open the breaker, if it is still in the given state, and double the
+ * backoff for the next failure. */
+static void
+ngx_akita_health_open(ngx_http_akita_agent_t *agent, ngx_atomic_uint_t from,
+                      ngx_log_t *log) {
+  ngx_akita_health_t *h = agent->health;
+  ngx_atomic_uint_t backoff;
+
+  /* Only the worker that wins this sets the retry time. Calls are blocked
+   * meanwhile, so no worker sees the breaker open with the retry time
+   * from last time. */
+  if (!ngx_atomic_cmp_set(&h->state, from, NGX_AKITA_HEALTH_OPENING)) {
+    /* Another worker got there first. */
+    return;
+  }
+
+  backoff = h->backoff;
+  h->retry_time = ngx_time() + backoff;
+  ngx_memory_barrier();
+  h->state = NGX_AKITA_HEALTH_OPEN;
+
+  ngx_log_error(NGX_LOG_WARN, log, 0,
+                "Mirroring to Akita agent \"%V\" blocked for %uA seconds",
+                &agent->address, backoff);
+
+  if (backoff < ngx_akita_health_max_backoff) {
+    h->backoff = backoff * 2;
+  }
+}
+
+void
+ngx_http_akita_agent_hints_init(ngx_http_akita_agent_hints_t *hints) {
+  hints->sample_rate = -1;
+  hints->max_body_size = -1;
+  hints->pause = -1;
+}
+
+/* Parse one header from the agent into hints. Returns true if it was one
+ * of the control headers. A rate or size that doesn't parse leaves the
+ * one in force alone; a pause that doesn't parse is ignored. */
+ngx_flag_t
+ngx_http_akita_agent_parse_hint(ngx_http_akita_agent_hints_t *hints,
+                                u_char *name, size_t name_len,
+                                u_char *value, size_t value_len) {
+  ngx_str_t s;
+  ngx_int_t n;
+  ssize_t size;
+
+  static ngx_str_t sample_rate_lc = ngx_string("akita-sample-rate");
+  static ngx_str_t max_body_size_lc = ngx_string("akita-max-body-size");
+  static ngx_str_t pause_lc = ngx_string("akita-pause");
+
+  if (name_len == sample_rate_lc.len
+      && ngx_strncasecmp(name, sample_rate_lc.data, name_len) == 0) {
+    /* A percentage, with up to two decimal places */
+    n = ngx_atofp(value, value_len, 2);
+    hints->sample_rate = (n != NGX_ERROR && n <= NGX_HTTP_AKITA_RATE_SCALE)
+                         ? n : NGX_HTTP_AKITA_HINT_INVALID;
+    return 1;
+  }
+
+  if (name_len == max_body_size_lc.len
+      && ngx_strncasecmp(name, max_body_size_lc.data, name_len) == 0) {
+    s.len = value_len;
+    s.data = value;
+    size = ngx_parse_size(&s);
+    hints->max_body_size = size != NGX_ERROR ? size : NGX_HTTP_AKITA_HINT_INVALID;
+    return 1;
+  }
+
+  if (name_len == pause_lc.len
+      && ngx_strncasecmp(name, pause_lc.data, name_len) == 0) {
+    n = ngx_atoi(value, value_len);
+    if (n != NGX_ERROR) {
+      hints->pause = ngx_min(n, ngx_akita_health_max_pause);
+    }
+    return 1;
+  }
+
+  return 0;
+}
+
+/* Share the hints from an answer with every worker. Each answer stands on
+ * its own: a rate or size limit the agent no longer sends is lifted, but
+ * one it sends malformed is kept. A pause only ever extends the current
+ * one. */
+void
+ngx_http_akita_agent_apply_hints(ngx_http_akita_agent_t *agent,
+                                 ngx_http_akita_agent_hints_t *hints, ngx_log_t *log) {
+  ngx_akita_health_t *h = agent->health;
+  ngx_atomic_uint_t rate, size;
+  time_t until;
+
+  rate = hints->sample_rate >= 0 ? (ngx_atomic_uint_t) hints->sample_rate
+                                 : NGX_HTTP_AKITA_RATE_SCALE;
+  if (hints->sample_rate != NGX_HTTP_AKITA_HINT_INVALID && h->sample_rate != rate) {
+    h->sample_rate = rate;
+    ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                  "Akita agent \"%V\" set the capture rate to %uA.%02uA%%",
+                  &agent->address, rate / 100, rate % 100);
+  }
+
+  size = hints->max_body_size >= 0 ? (ngx_atomic_uint_t) hints->max_body_size + 1 : 0;
+  if (hints->max_body_size != NGX_HTTP_AKITA_HINT_INVALID && h->max_body_size != size) {
+    h->max_body_size = size;
+    if (size) {
+      ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                    "Akita agent \"%V\" limited bodies to %uA bytes",
+                    &agent->address, size - 1);
+    } else {
+      ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                    "Akita agent \"%V\" lifted its body size limit", &agent->address);
+    }
+  }
+
+  if (hints->pause > 0) {
+    until = ngx_time() + hints->pause;
+    if (until > (time_t) h->paused_until) {
+      h->paused_until = until;
+      ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                    "Akita agent \"%V\" paused mirroring for %T seconds",
+                    &agent->address, hints->pause);
+    }
+  }
+}
+
+/* The lowest capture rate asked for by any of the agents. */
+ngx_uint_t
+ngx_http_akita_agents_sample_rate(ngx_http_akita_agent_set_t *set) {
+  ngx_uint_t i, rate;
+
+  rate = NGX_HTTP_AKITA_RATE_SCALE;
+  for (i = 0; i < set->nagents; i++) {
+    rate = ngx_min(rate, set->agents[i]->health->sample_rate);
+  }
+  return rate;
+}
+
+/* The smallest body size limit asked for by any of the agents. */
+size_t
+ngx_http_akita_agents_max_body_size(ngx_http_akita_agent_set_t *set) {
+  ngx_uint_t i;
+  size_t size;
+
+  size = NGX_MAX_SIZE_T_VALUE;
+  for (i = 0; i < set->nagents; i++) {
+    if (set->agents[i]->health->max_body_size) {
+      size = ngx_min(size, set->agents[i]->health->max_body_size - 1);
+    }
+  }
+  return size;
+}
@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2023 Akita Software
+ */
+
+#ifndef _AKITA_NGX_MODULE_AKITA_HEALTH_H_INCLUDED
+#define _AKITA_NGX_MODULE_AKITA_HEALTH_H_INCLUDED
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+/*
+ * The health of each agent, kept in a shared memory zone so that all
+ * workers back off from an agent together. Each agent has a circuit
+ * breaker:
+ *
+ *   closed     Calls go through. The first failed call opens the breaker
+ *              for every worker.
+ *   open       Calls are blocked for the backoff period, which doubles
+ *              (up to a limit) each time the breaker opens.
+ *   half-open  Once the period is over, a trickle of calls (probe_rate a
+ *              second across all workers) goes through as probes. The
+ *              breaker closes after probe_successes of them succeed in a
+ *              row, and opens again on the first failure.
+ *
+ * The agent can also answer any call with control headers, which apply
+ * to every worker:
+ *
+ *   Akita-Sample-Rate    Percentage of requests to capture
+ *   Akita-Max-Body-Size  Largest body to capture, as for akita_max_body_size
+ *   Akita-Pause          Send nothing at all for this many seconds
+ *
+ * The functions that query and update the state are declared in
+ * ngx_http_akita_module.h.
+ */
+
+typedef struct ngx_akita_health_s ngx_akita_health_t;
+
+/* Add the shared memory zone for agent health to the configuration. */
+ngx_int_t
+ngx_akita_health_add_zone(ngx_conf_t *cf, ngx_http_akita_main_conf_t *amcf);
+
+#endif /* _AKITA_NGX_MODULE_AKITA_HEALTH_H_INCLUDED */
@@ -0,0 +1,389 @@
+/*
+ * Copyright (C) 2023 Akita Software
+ */
+
+#include "ngx_http_akita_module.h"
+#include "akita_json.h"
+#include "akita_escape.h"
+
+/* Validator states */
+enum {
+  json_value = 0,              /* Before a value */
+  json_array_start,            /* After '[': a value or ']' */
+  json_object_start,           /* After '{': a key or '}' */
+  json_key,                    /* After ',' in an object */
+  json_colon,                  /* After a key */
+  json_after_value,            /* After a value: ',', a close or the end */
+  json_string,                 /* Inside a string value */
+  json_key_string,             /* Inside a key */
+  json_escape,                 /* After '\' in a string */
+  json_unicode,                /* In the hex digits of \u */
+  json_literal,                /* In true, false or null */
+  json_minus,                  /* After a leading '-' */
+  json_zero,                   /* After a leading '0' */
+  json_int,                    /* In the integer part */
+  json_point,                  /* After '.' */
+  json_frac,                   /* In the fraction */
+  json_exp,                    /* After 'e' */
+  json_exp_sign,               /* After the exponent's sign */
+  json_exp_digits,             /* In the exponent */
+  json_invalid
+};
+
+static ngx_int_t ngx_akita_json_open(ngx_akita_json_validator_t *v, ngx_uint_t object);
+static ngx_int_t ngx_akita_json_close(ngx_akita_json_validator_t *v, ngx_uint_t object);
+static ngx_uint_t ngx_akita_json_in_object(ngx_akita_json_validator_t *v);
+
+static const u_char json_true[] = "rue";
+static const u_char json_false[] = "alse";
+static const u_char json_null[] = "ull";
+
+#define json_space(c)  ((c) == ' ' || (c) == '\t' || (c) == '\n' || (c) == '\r')
+#define json_digit(c)  ((c) >= '0' && (c) <= '9')
+
+void
+ngx_akita_json_validate_init(ngx_akita_json_validator_t *v) {
+  ngx_memzero(v, sizeof(ngx_akita_json_validator_t));
+  v->state = json_value;
+}
+
+ngx_int_t
+ngx_akita_json_validate(ngx_akita_json_validator_t *v, u_char *p, size_t len) {
+  u_char *last, c;
+  ngx_uint_t key;
+
+  last = p + len;
+
+  while (p < last) {
+    c = *p;
+
+    switch (v->state) {
+
+    case json_string:
+    case json_key_string:
+      /* Skip to the end of the string, or the next escape. */
+      p += ngx_akita_escape_scan(p, last - p);
+      if (p == last) {
+        return NGX_OK;
+      }
+      c = *p++;
+      if (c == '\\') {
+        v->pending = (v->state == json_key_string);
+        v->state = json_escape;
+      } else if (c == '"') {
+        v->state = (v->state == json_key_string) ? json_colon : json_after_value;
+      } else {
+        goto invalid;
+      }
+      continue;
+
+    case json_escape:
+      key = v->pending;
+      switch (c) {
+      case '"': case '\\': case '/': case 'b': case 'f': case 'n': case 'r': case 't':
+        v->state = key ? json_key_string : json_string;
+        break;
+      case 'u':
+        v->state = json_unicode;
+        v->pending = 4 | (key << 3);
+        break;
+      default:
+        goto invalid;
+      }
+      p++;
+      continue;
+
+    case json_unicode:
+      if (!json_digit(c) && !((c | 0x20) >= 'a' && (c | 0x20) <= 'f')) {
+        goto invalid;
+      }
+      v->pending--;
+      if ((v->pending & 7) == 0) {
+        v->state = (v->pending & 8) ? json_key_string : json_string;
+      }
+      p++;
+      continue;
+
+    case json_literal:
+      if (c != *v->literal) {
+        goto invalid;
+      }
+      v->literal++;
+      if (*v->literal == '\0') {
+        v->state = json_after_value;
+      }
+      p++;
+      continue;
+
+    /* Numbers end at the first byte that can't continue them, which is
+     * then looked at again after the value. */
+    case json_minus:
+      if (c == '0') {
+        v->state = json_zero;
+      } else if (json_digit(c)) {
+        v->state = json_int;
+      } else {
+        goto invalid;
+      }
+      p++;
+      continue;
+
+    case json_int:
+      if (json_digit(c)) {
+        p++;
+        continue;
+      }
+      /* fall through */
+
+    case json_zero:
+      if (c == '.') {
+        v->state = json_point;
+        p++;
+      } else if (c == 'e' || c == 'E') {
+        v->state = json_exp;
+        p++;
+      } else {
+        v->state = json_after_value;
+      }
+      continue;
+
+    case json_point:
+      if (!json_digit(c)) {
+        goto invalid;
+      }
+      v->state = json_frac;
+      p++;
+      continue;
+
+    case json_frac:
+      if (json_digit(c)) {
+        p++;
+      } else if (c == 'e' || c == 'E') {
+        v->state = json_exp;
+        p++;
+      } else {
+        v->state = json_after_value;
+      }
+      continue;
+
+    case json_exp:
+      if (c == '+' || c == '-') {
+        v->state = json_exp_sign;
+        p++;
+        continue;
+      }
+      /* fall through */
+
+    case json_exp_sign:
+      if (!json_digit(c)) {
+        goto invalid;
+      }
+      v->state = json_exp_digits;
+      p++;
+      continue;
+
+    case json_exp_digits:
+      if (json_digit(c)) {
+        p++;
+      } else {
+        v->state = json_after_value;
+      }
+      continue;
+
+    case json_invalid:
+      return NGX_ERROR;
+    }
+
+    /* The rest of the states are between tokens. */
+    p++;
+    if (json_space(c)) {
+      continue;
+    }
+
+    switch (v->state) {
+
+    case json_array_start:
+      if (c == ']') {
+        if (ngx_akita_json_close(v, 0) != NGX_OK) {
+          goto invalid;
+        }
+        break;
+      }
+      /* fall through */
+
+    case json_value:
+      switch (c) {
+      case '{':
+        if (ngx_akita_json_open(v, 1) != NGX_OK) {
+          goto invalid;
+        }
+        v->state = json_object_start;
+        break;
+      case '[':
+        if (ngx_akita_json_open(v, 0) != NGX_OK) {
+          goto invalid;
+        }
+        v->state = json_array_start;
+        break;
+      case '"':
+        v->state = json_string;
+        break;
+      case 't':
+        v->literal = json_true;
+        v->state = json_literal;
+        break;
+      case 'f':
+        v->literal = json_false;
+        v->state = json_literal;
+        break;
+      case 'n':
+        v->literal = json_null;
+        v->state = json_literal;
+        break;
+      case '-':
+        v->state = json_minus;
+        break;
+      case '0':
+        v->state = json_zero;
+        break;
+      default:
+        if (!json_digit(c)) {
+          goto invalid;
+        }
+        v->state = json_int;
+      }
+      break;
+
+    case json_object_start:
+      if (c == '}') {
+        if (ngx_akita_json_close(v, 1) != NGX_OK) {
+          goto invalid;
+        }
+        break;
+      }
+      /* fall through */
+
+    case json_key:
+      if (c != '"') {
+        goto invalid;
+      }
+      v->state = json_key_string;
+      break;
+
+    case json_colon:
+      if (c != ':') {
+        goto invalid;
+      }
+      v->state = json_value;
+      break;
+
+    case json_after_value:
+      if (v->depth == 0) {
+        /* Only whitespace after the document */
+        goto invalid;
+      }
+      if (c == ',') {
+        v->state = ngx_akita_json_in_object(v) ? json_key : json_value;
+      } else if (c == '}' || c == ']') {
+        if (ngx_akita_json_close(v, c == '}') != NGX_OK) {
+          goto invalid;
+        }
+      } else {
+        goto invalid;
+      }
+      break;
+    }
+  }
+
+  return NGX_OK;
+
+invalid:
+
+  v->state = json_invalid;
+  return NGX_ERROR;
+}
+
+ngx_int_t
+ngx_akita_json_validate_finish(ngx_akita_json_validator_t *v) {
+  if (v->depth != 0) {
+    return NGX_ERROR;
+  }
+
+  /* A document may be a bare number. */
+  switch (v->state) {
+  case json_after_value:
+  case json_zero:
+  case json_int:
+  case json_frac:
+  case json_exp_digits:
+    return NGX_OK;
+  default:
+    return NGX_ERROR;
+  }
+}
+
+ngx_flag_t
+ngx_akita_json_content_type(ngx_str_t *content_type) {
+  u_char *p, *last;
+  size_t len;
+
+  /* Leave off any parameters */
+  p = content_type->data;
+  last = ngx_strlchr(p, p + content_type->len, ';');
+  if (last == NULL) {
+    last = p + content_type->len;
+  }
+  while (last > p && (last[-1] == ' ' || last[-1] == '\t')) {
+    last--;
+  }
+  len = last - p;
+
+  if (len == sizeof("application/json") - 1
+      && ngx_strncasecmp(p, (u_char *) "application/json", len) == 0)
+  {
+    return 1;
+  }
+
+  /* Structured syntax suffix, as in application/problem+json */
+  return len > sizeof("+json") - 1
+         && ngx_strncasecmp(last - (sizeof("+json") - 1), (u_char *) "+json",
+                            sizeof("+json") - 1) == 0;
+}
+
+/* Enter an object or array. */
+static ngx_int_t
+ngx_akita_json_open(ngx_akita_json_validator_t *v, ngx_uint_t object) {
+  uint64_t bit;
+
+  if (v->depth == NGX_AKITA_JSON_MAX_DEPTH) {
+    return NGX_ERROR;
+  }
+
+  bit = (uint64_t) 1 << (v->depth % 64);
+  if (object) {
+    v->objects[v->depth / 64] |= bit;
+  } else {
+    v->objects[v->depth / 64] &= ~bit;
+  }
+  v->depth++;
+  return NGX_OK;
+}
+
+/* Leave an object or array, which must be the innermost one. */
+static ngx_int_t
+ngx_akita_json_close(ngx_akita_json_validator_t *v, ngx_uint_t object) {
+  if (v->depth == 0 || ngx_akita_json_in_object(v) != object) {
+    return NGX_ERROR;
+  }
+  v->depth--;
+  v->state = json_after_value;
+  return NGX_OK;
+}
+
+static ngx_uint_t
+ngx_akita_json_in_object(ngx_akita_json_validator_t *v) {
+  ngx_uint_t top;
+
+  top = v->depth - 1;
+  return (v->objects[top / 64] >> (top % 64)) & 1;
+}
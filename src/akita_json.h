@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2023 Akita Software
+ */
+
+#ifndef _AKITA_NGX_MODULE_AKITA_JSON_H_INCLUDED
+#define _AKITA_NGX_MODULE_AKITA_JSON_H_INCLUDED
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+/*
+ * A streaming JSON validator, used to decide whether a body can be
+ * embedded in a witness as it is (see akita_embed_json). It checks the
+ * structure of the document against the JSON grammar, fed a buffer at a
+ * time; the insides of strings are skipped with ngx_akita_escape_scan.
+ * Like the escaped bodies, strings are not checked for valid UTF-8.
+ */
+
+/* Deepest nesting of objects and arrays accepted */
+#define NGX_AKITA_JSON_MAX_DEPTH  256
+
+typedef struct ngx_akita_json_validator_s {
+  ngx_uint_t state;
+  ngx_uint_t depth;
+  ngx_uint_t pending;          /* Bytes left of a literal or \u escape */
+  const u_char *literal;       /* Rest of true, false or null */
+  uint64_t objects[NGX_AKITA_JSON_MAX_DEPTH / 64];  /* Set bits are objects */
+} ngx_akita_json_validator_t;
+
+void
+ngx_akita_json_validate_init(ngx_akita_json_validator_t *v);
+
+/* Check the next part of the document. Returns NGX_ERROR once it's
+ * known not to be valid JSON. */
+ngx_int_t
+ngx_akita_json_validate(ngx_akita_json_validator_t *v, u_char *p, size_t len);
+
+/* Returns NGX_OK if what was checked is a complete JSON document. */
+ngx_int_t
+ngx_akita_json_validate_finish(ngx_akita_json_validator_t *v);
+
+/* Is this the media type of a JSON document? */
+ngx_flag_t
+ngx_akita_json_content_type(ngx_str_t *content_type);
+
+#endif /* _AKITA_NGX_MODULE_AKITA_JSON_H_INCLUDED */
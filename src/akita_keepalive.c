@@ -0,0 +1,369 @@
+/*
+ * Copyright (C) 2023 Akita Software
+ */
+
+#include "ngx_http_akita_module.h"
+#include "akita_keepalive.h"
+
+/* The cache of idle connections for one agent. */
+typedef struct ngx_akita_keepalive_s {
+  /* Peer initialization that we wrap. */
+  ngx_http_upstream_init_pt original_init_upstream;
+  ngx_http_upstream_init_peer_pt original_init_peer;
+
+  /* Limits, copied from the main configuration. */
+  ngx_uint_t max_cached;
+  ngx_msec_t timeout;
+
+  /* Cached connections, most recently used first, and unused cache slots. */
+  ngx_queue_t cache;
+  ngx_queue_t free;
+} ngx_akita_keepalive_t;
+
+/* One slot in the cache. */
+typedef struct {
+  ngx_akita_keepalive_t *conf;
+  ngx_queue_t queue;
+  ngx_connection_t *connection;
+
+  /* Address of the peer, to match against the balancer's choice. */
+  socklen_t socklen;
+  ngx_sockaddr_t sockaddr;
+} ngx_akita_keepalive_cache_t;
+
+/* Per-request state; wraps the original balancer's state. */
+typedef struct {
+  ngx_akita_keepalive_t *conf;
+  ngx_http_upstream_t *upstream;
+
+  void *data;
+  ngx_event_get_peer_pt original_get_peer;
+  ngx_event_free_peer_pt original_free_peer;
+} ngx_akita_keepalive_peer_data_t;
+
+static ngx_akita_keepalive_t *ngx_akita_keepalive_find(ngx_http_akita_main_conf_t *amcf,
+                                                       ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_akita_keepalive_init_upstream(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_akita_keepalive_init_peer(ngx_http_request_t *r, ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_akita_keepalive_get_peer(ngx_peer_connection_t *pc, void *data);
+static void ngx_akita_keepalive_free_peer(ngx_peer_connection_t *pc, void *data, ngx_uint_t state);
+static void ngx_akita_keepalive_dummy_handler(ngx_event_t *ev);
+static void ngx_akita_keepalive_close_handler(ngx_event_t *ev);
+static void ngx_akita_keepalive_close(ngx_connection_t *c);
+
+/* Defaults if akita_agent_keepalive and akita_agent_keepalive_timeout are not given. */
+static const ngx_int_t default_keepalive = 16;
+static const ngx_msec_t default_keepalive_timeout = 60000;
+
+void
+ngx_akita_keepalive_init_conf(ngx_http_akita_main_conf_t *amcf) {
+  ngx_conf_init_value(amcf->keepalive, default_keepalive);
+  ngx_conf_init_msec_value(amcf->keepalive_timeout, default_keepalive_timeout);
+}
+
+ngx_int_t
+ngx_akita_keepalive_register(ngx_conf_t *cf, ngx_http_akita_agent_t *agent) {
+  ngx_akita_keepalive_t *kc;
+  ngx_http_upstream_srv_conf_t *us = agent->upstream;
+
+  kc = ngx_pcalloc(cf->pool, sizeof(ngx_akita_keepalive_t));
+  if (kc == NULL) {
+    return NGX_ERROR;
+  }
+
+  /* An explicit upstream{} block may have picked a balancer already. */
+  kc->original_init_upstream = us->peer.init_upstream
+    ? us->peer.init_upstream
+    : ngx_http_upstream_init_round_robin;
+  us->peer.init_upstream = ngx_akita_keepalive_init_upstream;
+
+  agent->keepalive = kc;
+  return NGX_OK;
+}
+
+/* Find the keepalive cache belonging to an upstream. */
+static ngx_akita_keepalive_t *
+ngx_akita_keepalive_find(ngx_http_akita_main_conf_t *amcf,
+                         ngx_http_upstream_srv_conf_t *us) {
+  ngx_http_akita_agent_t **agents;
+  ngx_uint_t i;
+
+  agents = amcf->agents.elts;
+  for (i = 0; i < amcf->agents.nelts; i++) {
+    if (agents[i]->upstream == us) {
+      return agents[i]->keepalive;
+    }
+  }
+  return NULL;
+}
+
+/* Initialize the upstream with the original balancer, then hook its peers. */
+static ngx_int_t
+ngx_akita_keepalive_init_upstream(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us) {
+  ngx_http_akita_main_conf_t *amcf;
+  ngx_akita_keepalive_t *kc;
+  ngx_akita_keepalive_cache_t *cached;
+  ngx_uint_t i;
+
+  amcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_akita_module);
+  kc = ngx_akita_keepalive_find(amcf, us);
+  if (kc == NULL) {
+    return NGX_ERROR;
+  }
+
+  if (kc->original_init_upstream(cf, us) != NGX_OK) {
+    return NGX_ERROR;
+  }
+
+  /* The upstream module initializes upstreams before our main
+   * configuration is initialized, so the defaults may not be set yet. */
+  ngx_akita_keepalive_init_conf(amcf);
+  kc->max_cached = (ngx_uint_t) amcf->keepalive;
+  kc->timeout = amcf->keepalive_timeout;
+
+  if (kc->max_cached == 0) {
+    /* Keepalive disabled; leave the original balancer alone. */
+    return NGX_OK;
+  }
+
+  kc->original_init_peer = us->peer.init;
+  us->peer.init = ngx_akita_keepalive_init_peer;
+
+  cached = ngx_pcalloc(cf->pool, sizeof(ngx_akita_keepalive_cache_t) * kc->max_cached);
+  if (cached == NULL) {
+    return NGX_ERROR;
+  }
+
+  ngx_queue_init(&kc->cache);
+  ngx_queue_init(&kc->free);
+  for (i = 0; i < kc->max_cached; i++) {
+    ngx_queue_insert_head(&kc->free, &cached[i].queue);
+    cached[i].conf = kc;
+  }
+
+  return NGX_OK;
+}
+
+/* Set up a single request to the agent to check the cache first. */
+static ngx_int_t
+ngx_akita_keepalive_init_peer(ngx_http_request_t *r, ngx_http_upstream_srv_conf_t *us) {
+  ngx_http_akita_main_conf_t *amcf;
+  ngx_akita_keepalive_peer_data_t *kp;
+  ngx_akita_keepalive_t *kc;
+
+  amcf = ngx_http_get_module_main_conf(r, ngx_http_akita_module);
+  kc = ngx_akita_keepalive_find(amcf, us);
+  if (kc == NULL) {
+    return NGX_ERROR;
+  }
+
+  kp = ngx_palloc(r->pool, sizeof(ngx_akita_keepalive_peer_data_t));
+  if (kp == NULL) {
+    return NGX_ERROR;
+  }
+
+  if (kc->original_init_peer(r, us) != NGX_OK) {
+    return NGX_ERROR;
+  }
+
+  kp->conf = kc;
+  kp->upstream = r->upstream;
+  kp->data = r->upstream->peer.data;
+  kp->original_get_peer = r->upstream->peer.get;
+  kp->original_free_peer = r->upstream->peer.free;
+
+  r->upstream->peer.data = kp;
+  r->upstream->peer.get = ngx_akita_keepalive_get_peer;
+  r->upstream->peer.free = ngx_akita_keepalive_free_peer;
+
+  return NGX_OK;
+}
+
+/* Let the balancer pick a peer, then reuse a cached connection to it if we have one. */
+static ngx_int_t
+ngx_akita_keepalive_get_peer(ngx_peer_connection_t *pc, void *data) {
+  ngx_akita_keepalive_peer_data_t *kp = data;
+  ngx_akita_keepalive_cache_t *item;
+  ngx_queue_t *q, *cache;
+  ngx_connection_t *c;
+  ngx_int_t rc;
+
+  pc->cached = 0;
+  pc->connection = NULL;
+
+  rc = kp->original_get_peer(pc, kp->data);
+  if (rc != NGX_OK) {
+    return rc;
+  }
+
+  cache = &kp->conf->cache;
+  for (q = ngx_queue_head(cache); q != ngx_queue_sentinel(cache); q = ngx_queue_next(q)) {
+    item = ngx_queue_data(q, ngx_akita_keepalive_cache_t, queue);
+    if (ngx_memn2cmp((u_char *) &item->sockaddr, (u_char *) pc->sockaddr,
+                     item->socklen, pc->socklen) != 0) {
+      continue;
+    }
+
+    ngx_queue_remove(q);
+    ngx_queue_insert_head(&kp->conf->free, q);
+
+    c = item->connection;
+    c->idle = 0;
+    c->sent = 0;
+    c->data = NULL;
+    c->log = pc->log;
+    c->read->log = pc->log;
+    c->write->log = pc->log;
+    c->pool->log = pc->log;
+
+    if (c->read->timer_set) {
+      ngx_del_timer(c->read);
+    }
+
+    pc->connection = c;
+    pc->cached = 1;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "akita agent: reusing connection %p", c);
+    return NGX_DONE;
+  }
+
+  return NGX_OK;
+}
+
+/*
+ * Put the connection in the cache if the exchange with the agent
+ * finished cleanly, evicting the least recently used one if full.
+ */
+static void
+ngx_akita_keepalive_free_peer(ngx_peer_connection_t *pc, void *data, ngx_uint_t state) {
+  ngx_akita_keepalive_peer_data_t *kp = data;
+  ngx_akita_keepalive_cache_t *item;
+  ngx_http_upstream_t *u;
+  ngx_connection_t *c;
+  ngx_queue_t *q;
+
+  u = kp->upstream;
+  c = pc->connection;
+
+  if (state & NGX_PEER_FAILED
+      || c == NULL
+      || c->read->eof
+      || c->read->error
+      || c->read->timedout
+      || c->write->error
+      || c->write->timedout) {
+    goto invalid;
+  }
+
+  /* The response was not framed, or the agent asked us to close. */
+  if (!u->keepalive) {
+    goto invalid;
+  }
+
+  if (!u->request_body_sent) {
+    goto invalid;
+  }
+
+  if (ngx_terminate || ngx_exiting) {
+    goto invalid;
+  }
+
+  if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+    goto invalid;
+  }
+
+  if (ngx_queue_empty(&kp->conf->free)) {
+    q = ngx_queue_last(&kp->conf->cache);
+    ngx_queue_remove(q);
+    item = ngx_queue_data(q, ngx_akita_keepalive_cache_t, queue);
+    ngx_akita_keepalive_close(item->connection);
+  } else {
+    q = ngx_queue_head(&kp->conf->free);
+    ngx_queue_remove(q);
+    item = ngx_queue_data(q, ngx_akita_keepalive_cache_t, queue);
+  }
+
+  ngx_queue_insert_head(&kp->conf->cache, q);
+  item->connection = c;
+  pc->connection = NULL;
+
+  c->read->delayed = 0;
+  ngx_add_timer(c->read, kp->conf->timeout);
+
+  if (c->write->timer_set) {
+    ngx_del_timer(c->write);
+  }
+
+  c->write->handler = ngx_akita_keepalive_dummy_handler;
+  c->read->handler = ngx_akita_keepalive_close_handler;
+
+  c->data = item;
+  c->idle = 1;
+  c->log = ngx_cycle->log;
+  c->read->log = ngx_cycle->log;
+  c->write->log = ngx_cycle->log;
+  c->pool->log = ngx_cycle->log;
+
+  item->socklen = pc->socklen;
+  ngx_memcpy(&item->sockaddr, pc->sockaddr, pc->socklen);
+
+  /* The agent may already have closed the connection. */
+  if (c->read->ready) {
+    ngx_akita_keepalive_close_handler(c->read);
+  }
+
+invalid:
+  kp->original_free_peer(pc, kp->data, state);
+}
+
+/* Idle connections have nothing to write. */
+static void
+ngx_akita_keepalive_dummy_handler(ngx_event_t *ev) {
+  ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                 "akita agent: keepalive dummy handler");
+}
+
+/*
+ * Called when an idle connection is readable or its timer expires.
+ * Anything but EAGAIN means the agent closed it (or sent something
+ * unexpected), so drop it from the cache.
+ */
+static void
+ngx_akita_keepalive_close_handler(ngx_event_t *ev) {
+  ngx_akita_keepalive_t *kc;
+  ngx_akita_keepalive_cache_t *item;
+  ngx_connection_t *c;
+  ssize_t n;
+  char buf[1];
+
+  c = ev->data;
+
+  if (c->close || c->read->timedout) {
+    goto close;
+  }
+
+  n = recv(c->fd, buf, 1, MSG_PEEK);
+  if (n == -1 && ngx_socket_errno == NGX_EAGAIN) {
+    ev->ready = 0;
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+      goto close;
+    }
+    return;
+  }
+
+close:
+  item = c->data;
+  kc = item->conf;
+
+  ngx_akita_keepalive_close(c);
+
+  ngx_queue_remove(&item->queue);
+  ngx_queue_insert_head(&kc->free, &item->queue);
+}
+
+static void
+ngx_akita_keepalive_close(ngx_connection_t *c) {
+  ngx_destroy_pool(c->pool);
+  ngx_close_connection(c);
+}
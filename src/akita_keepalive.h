@@ -0,0 +1,31 @@
+/*
+ * Copyright (C) 2023 Akita Software
+ */
+
+#ifndef _AKITA_NGX_MODULE_AKITA_KEEPALIVE_H_INCLUDED
+#define _AKITA_NGX_MODULE_AKITA_KEEPALIVE_H_INCLUDED
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+/*
+ * A per-worker cache of idle connections to the Akita agent, modeled on
+ * ngx_http_upstream_keepalive_module. The agent's upstream is implicit
+ * (there is no upstream{} block to put a "keepalive" directive in), so
+ * we wrap its peer initialization ourselves.
+ */
+
+/* Fill in defaults for the keepalive settings in the main configuration. */
+void
+ngx_akita_keepalive_init_conf(ngx_http_akita_main_conf_t *amcf);
+
+/*
+ * Arrange for connections to the agent's upstream to be kept alive.
+ * Must be called while the configuration is parsed, before the upstream
+ * is initialized.
+ */
+ngx_int_t
+ngx_akita_keepalive_register(ngx_conf_t *cf, ngx_http_akita_agent_t *agent);
+
+#endif /* _AKITA_NGX_MODULE_AKITA_KEEPALIVE_H_INCLUDED */
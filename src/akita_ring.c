@@ -0,0 +1,367 @@
+/*
+ * Copyright (C) 2023 Akita Software
+ */
+
+#include "ngx_http_akita_module.h"
+#include "akita_ring.h"
+
+#if (NGX_LINUX)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+/* Process-local view of the ring */
+struct ngx_akita_ring_s {
+  ngx_str_t path;
+  ngx_akita_ring_header_t *header;    /* NULL until mapped */
+  u_char *data;
+  size_t size;
+  size_t mapped;               /* Size of the whole mapping */
+  ngx_uint_t overflow;         /* NGX_AKITA_RING_DROP_NEWEST or OVERWRITE_OLDEST */
+  ngx_shmtx_t mutex;           /* On the lock in the header */
+};
+
+static ngx_int_t ngx_akita_ring_map(ngx_cycle_t *cycle, ngx_akita_ring_t *ring);
+static void ngx_akita_ring_cleanup(void *data);
+static ngx_int_t ngx_akita_ring_lock(ngx_akita_ring_t *ring);
+static void ngx_akita_ring_publish(ngx_akita_ring_t *ring);
+static void ngx_akita_ring_wake(ngx_akita_ring_header_t *header);
+
+/* Records start on this boundary */
+#define ngx_akita_ring_align(n)  ngx_align((n), 8)
+
+/* Times to try for the lock before dropping a record */
+#define NGX_AKITA_RING_LOCK_TRIES  4096
+
+ngx_akita_ring_t *
+ngx_akita_ring_open(ngx_conf_t *cf, ngx_str_t *path, size_t size, ngx_uint_t overflow) {
+  ngx_akita_ring_t *ring;
+  ngx_pool_cleanup_t *cln;
+
+  ring = ngx_pcalloc(cf->pool, sizeof(ngx_akita_ring_t));
+  if (ring == NULL) {
+    return NULL;
+  }
+  ring->path = *path;
+  ring->size = ngx_akita_ring_align(size);
+  ring->mapped = sizeof(ngx_akita_ring_header_t) + ring->size;
+  ring->overflow = overflow;
+
+  /* Unmap when this configuration is no longer in use. */
+  cln = ngx_pool_cleanup_add(cf->cycle->pool, 0);
+  if (cln == NULL) {
+    return NULL;
+  }
+  cln->handler = ngx_akita_ring_cleanup;
+  cln->data = ring;
+
+  return ring;
+}
+
+ngx_int_t
+ngx_akita_ring_init(ngx_cycle_t *cycle, ngx_akita_ring_t *ring) {
+  /* The running workers and the agent are still using the file. */
+  if (ngx_test_config) {
+    return NGX_OK;
+  }
+  return ngx_akita_ring_map(cycle, ring);
+}
+
+/* Open the file, creating or resizing it if needed, and map it. If it
+ * already holds a ring of the right size (from before a reload), that
+ * ring and any unread records in it are kept. */
+static ngx_int_t
+ngx_akita_ring_map(ngx_cycle_t *cycle, ngx_akita_ring_t *ring) {
+  ngx_str_t *path = &ring->path;
+  ngx_akita_ring_header_t *header;
+  ngx_file_info_t fi;
+  ngx_flag_t fresh;
+  ngx_fd_t fd;
+  u_char *p;
+
+  fd = ngx_open_file(path->data, NGX_FILE_RDWR, NGX_FILE_CREATE_OR_OPEN, 0660);
+  if (fd == NGX_INVALID_FILE) {
+    ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                       ngx_open_file_n " \"%V\" failed", path);
+    return NGX_ERROR;
+  }
+
+  if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+    ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                       ngx_fd_info_n " \"%V\" failed", path);
+    goto failed;
+  }
+
+  fresh = 1;
+  if ((size_t) ngx_file_size(&fi) != ring->mapped) {
+    /* Workers from an earlier configuration may still have the old file
+     * mapped, so don't shrink it under them; start a new one instead. */
+    if (ngx_file_size(&fi) != 0) {
+      ngx_close_file(fd);
+
+      if (ngx_delete_file(path->data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                           ngx_delete_file_n " \"%V\" failed", path);
+        return NGX_ERROR;
+      }
+
+      fd = ngx_open_file(path->data, NGX_FILE_RDWR, NGX_FILE_CREATE_OR_OPEN, 0660);
+      if (fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                           ngx_open_file_n " \"%V\" failed", path);
+        return NGX_ERROR;
+      }
+    }
+
+    if (ftruncate(fd, ring->mapped) == -1) {
+      ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                         "ftruncate() \"%V\" failed", path);
+      goto failed;
+    }
+  }
+
+  p = mmap(NULL, ring->mapped, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED) {
+    ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                       "mmap(%uz) \"%V\" failed", ring->mapped, path);
+    goto failed;
+  }
+
+  if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+    ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                       ngx_close_file_n " \"%V\" failed", path);
+  }
+
+  header = (ngx_akita_ring_header_t *) p;
+  ring->header = header;
+  ring->data = p + sizeof(ngx_akita_ring_header_t);
+
+  /* Only the lock word is used; with spin set to -1, the mutex has no
+   * semaphore and never sleeps. */
+  ring->mutex.spin = (ngx_uint_t) -1;
+  if (ngx_shmtx_create(&ring->mutex, (ngx_shmtx_sh_t *) &header->lock, NULL)
+      != NGX_OK) {
+    goto failed;
+  }
+
+  if (header->magic == NGX_AKITA_RING_MAGIC
+      && header->version == NGX_AKITA_RING_VERSION
+      && header->size == ring->size) {
+    fresh = 0;
+  }
+
+  if (fresh) {
+    ngx_memzero(header, sizeof(ngx_akita_ring_header_t));
+    header->version = NGX_AKITA_RING_VERSION;
+    header->size = ring->size;
+
+    /* Readers look for the magic number to know the ring is ready. */
+    ngx_memory_barrier();
+    header->magic = NGX_AKITA_RING_MAGIC;
+
+  } else if (ngx_is_init_cycle(cycle->old_cycle)) {
+    /* After a restart, no worker can still be writing: let go of the
+     * lock, and of space reserved for records that were never finished. */
+    header->lock = 0;
+    header->reserve_pos = header->write_pos;
+  }
+
+  return NGX_OK;
+
+failed:
+
+  ngx_close_file(fd);
+  return NGX_ERROR;
+}
+
+/* Unmap the ring. The file stays, so the agent can drain it. */
+static void
+ngx_akita_ring_cleanup(void *data) {
+  ngx_akita_ring_t *ring = data;
+
+  if (ring->header == NULL) {
+    return;
+  }
+
+  if (munmap((void *) ring->header, ring->mapped) == -1) {
+    ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                  "munmap(%uz) failed", ring->mapped);
+  }
+}
+
+ngx_int_t
+ngx_akita_ring_write(ngx_akita_ring_t *ring, ngx_uint_t kind,
+                     ngx_chain_t *body, size_t content_length) {
+  ngx_akita_ring_header_t *header = ring->header;
+  ngx_akita_ring_record_t *rec;
+  ngx_atomic_uint_t w, r, next;
+  size_t offset, pad, need;
+  ngx_chain_t *cl;
+  u_char *p;
+
+  need = ngx_akita_ring_align(sizeof(ngx_akita_ring_record_t) + content_length);
+  if (need > ring->size || content_length > NGX_MAX_UINT32_VALUE) {
+    /* It would never fit. */
+    goto dropped;
+  }
+
+  if (ngx_akita_ring_lock(ring) != NGX_OK) {
+    goto dropped;
+  }
+
+  w = header->reserve_pos;
+  offset = w % ring->size;
+
+  /* Pad out the end of the data if the record won't fit there. */
+  pad = ring->size - offset < need ? ring->size - offset : 0;
+
+  if (pad + need > ring->size) {
+    goto dropped_locked;
+  }
+
+  for ( ;; ) {
+    r = header->read_pos;
+    if (w + pad + need - r <= ring->size) {
+      break;
+    }
+
+    /* Records still being copied in can't be evicted. */
+    if (ring->overflow == NGX_AKITA_RING_DROP_NEWEST || r == header->write_pos) {
+      goto dropped_locked;
+    }
+
+    /* Evict the oldest record. If the reader got to it first, the
+     * compare-and-swap fails and we look again. */
+    rec = (ngx_akita_ring_record_t *) (ring->data + r % ring->size);
+    next = r + ngx_akita_ring_align(sizeof(ngx_akita_ring_record_t) + rec->len);
+    if (ngx_atomic_cmp_set(&header->read_pos, r, next)
+        && rec->kind != NGX_AKITA_RING_PADDING) {
+      (void) ngx_atomic_fetch_add(&header->overwritten, 1);
+    }
+  }
+
+  if (pad) {
+    rec = (ngx_akita_ring_record_t *) (ring->data + offset);
+    rec->len = pad - sizeof(ngx_akita_ring_record_t);
+    rec->kind = NGX_AKITA_RING_PADDING;
+    rec->flags = NGX_AKITA_RING_COMMITTED;
+    offset = 0;
+  }
+
+  rec = (ngx_akita_ring_record_t *) (ring->data + offset);
+  rec->len = content_length;
+  rec->kind = kind;
+  rec->flags = 0;
+
+  header->reserve_pos = w + pad + need;
+  ngx_shmtx_unlock(&ring->mutex);
+
+  /* The space is ours; copy into it without holding up other writers. */
+  p = (u_char *) (rec + 1);
+  for (cl = body; cl != NULL; cl = cl->next) {
+    p = ngx_cpymem(p, cl->buf->pos, cl->buf->last - cl->buf->pos);
+  }
+
+  ngx_memory_barrier();
+  rec->flags = NGX_AKITA_RING_COMMITTED;
+
+  ngx_akita_ring_publish(ring);
+  return NGX_OK;
+
+dropped_locked:
+
+  ngx_shmtx_unlock(&ring->mutex);
+
+dropped:
+
+  (void) ngx_atomic_fetch_add(&header->dropped, 1);
+  return NGX_DECLINED;
+}
+
+/*
+ * Move write_pos past every committed record at its head, making them
+ * visible to the reader. If the lock can't be had, the next writer to
+ * publish its own record publishes these as well.
+ */
+static void
+ngx_akita_ring_publish(ngx_akita_ring_t *ring) {
+  ngx_akita_ring_header_t *header = ring->header;
+  ngx_akita_ring_record_t *rec;
+  ngx_atomic_uint_t w;
+
+  if (ngx_akita_ring_lock(ring) != NGX_OK) {
+    return;
+  }
+
+  w = header->write_pos;
+  while (w != header->reserve_pos) {
+    rec = (ngx_akita_ring_record_t *) (ring->data + w % ring->size);
+    if (!(rec->flags & NGX_AKITA_RING_COMMITTED)) {
+      break;
+    }
+    w += ngx_akita_ring_align(sizeof(ngx_akita_ring_record_t) + rec->len);
+  }
+
+  if (w == header->write_pos) {
+    ngx_shmtx_unlock(&ring->mutex);
+    return;
+  }
+
+  ngx_memory_barrier();
+  header->write_pos = w;
+  header->wakeup++;
+
+  ngx_shmtx_unlock(&ring->mutex);
+
+  ngx_akita_ring_wake(header);
+}
+
+/*
+ * Take the writers' lock, taking it over from a process that exited
+ * while holding it. Returns NGX_DECLINED if it stays busy.
+ */
+static ngx_int_t
+ngx_akita_ring_lock(ngx_akita_ring_t *ring) {
+  ngx_atomic_uint_t pid;
+  ngx_uint_t i;
+
+  for (i = 0; i < NGX_AKITA_RING_LOCK_TRIES; i++) {
+    if (ngx_shmtx_trylock(&ring->mutex)) {
+      return NGX_OK;
+    }
+
+    pid = *ring->mutex.lock;
+    if (pid != 0 && kill((ngx_pid_t) pid, 0) == -1 && ngx_errno == NGX_ESRCH) {
+      if (ngx_shmtx_force_unlock(&ring->mutex, (ngx_pid_t) pid)) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                      "akita ring lock was held by exited process %P", (ngx_pid_t) pid);
+      }
+      continue;
+    }
+
+    if (ngx_ncpu > 1) {
+      ngx_cpu_pause();
+    } else {
+      ngx_sched_yield();
+    }
+  }
+
+  return NGX_DECLINED;
+}
+
+/* Wake up a reader waiting for records. */
+static void
+ngx_akita_ring_wake(ngx_akita_ring_header_t *header) {
+#if (NGX_LINUX)
+  ngx_memory_barrier();
+  if (header->waiters == 0) {
+    return;
+  }
+
+  if (syscall(SYS_futex, &header->wakeup, FUTEX_WAKE, NGX_MAX_INT32_VALUE,
+              NULL, NULL, 0) == -1) {
+    ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                  "futex() failed");
+  }
+#endif
+}
@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2023 Akita Software
+ */
+
+#ifndef _AKITA_NGX_MODULE_AKITA_RING_H_INCLUDED
+#define _AKITA_NGX_MODULE_AKITA_RING_H_INCLUDED
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+/*
+ * A ring buffer in a shared, file-backed mapping, which workers write
+ * witnesses into and a co-located Akita agent maps and reads directly.
+ *
+ * The file starts with an ngx_akita_ring_header_t, followed by size bytes
+ * of data. Positions are byte offsets that only ever increase; the offset
+ * into the data is the position modulo size. Each record starts on an
+ * 8-byte boundary with an ngx_akita_ring_record_t, followed by its
+ * payload and padding up to the next 8-byte boundary. A record never
+ * wraps around the end of the data; if one doesn't fit, the rest of the
+ * data is filled with a padding record and it starts again at offset 0.
+ *
+ * A writer reserves space for a record by moving reserve_pos past it,
+ * under the lock in the header, and copies the record in afterwards
+ * without holding the lock. Once copied, it sets NGX_AKITA_RING_COMMITTED
+ * in the record's flags, and moves write_pos past every committed record
+ * that follows it, again under the lock. A record is visible to the
+ * reader once write_pos has moved past it; the reader needn't look at
+ * reserve_pos or the flags.
+ *
+ * A writer that finds the lock held by a process that has exited takes
+ * it over; one that can't get the lock for a while drops its record
+ * rather than wait.
+ * The reader consumes a record by moving read_pos past it with a
+ * compare-and-swap; with overflow=overwrite_oldest a writer may do the
+ * same to evict records before reusing their space, in which case the
+ * reader's compare-and-swap fails and it must discard what it copied.
+ *
+ * On Linux, a reader with nothing to read can increment waiters and
+ * FUTEX_WAIT on wakeup; writers increment wakeup after each record and
+ * FUTEX_WAKE it if there are waiters. Elsewhere the reader has to poll.
+ *
+ * The layout assumes a 64-bit platform, where ngx_atomic_t is 8 bytes.
+ */
+
+#define NGX_AKITA_RING_MAGIC     0x52544b41    /* "AKTR" */
+#define NGX_AKITA_RING_VERSION   2
+
+/* Record kinds; witness kinds match ngx_akita_witness_kind_e. */
+#define NGX_AKITA_RING_REQUEST   0
+#define NGX_AKITA_RING_RESPONSE  1
+#define NGX_AKITA_RING_WITNESS   2    /* Combined request and response */
+#define NGX_AKITA_RING_PADDING   0xffff
+
+/* Record flags */
+#define NGX_AKITA_RING_COMMITTED 0x0001    /* Written in full */
+
+/* What to do when a record doesn't fit */
+#define NGX_AKITA_RING_DROP_NEWEST      0
+#define NGX_AKITA_RING_OVERWRITE_OLDEST 1
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t size;               /* Bytes of data following the header */
+  ngx_atomic_t write_pos;      /* End of the last complete record */
+  ngx_atomic_t read_pos;       /* Start of the oldest unread record */
+  ngx_atomic_t dropped;        /* Records that didn't fit and were dropped */
+  ngx_atomic_t overwritten;    /* Unread records evicted by writers */
+  uint32_t wakeup;             /* Futex word, incremented for each record */
+  uint32_t waiters;            /* Readers sleeping on wakeup */
+  ngx_atomic_t lock;           /* Pid of the writer holding the lock, or 0;
+                                  not used by readers */
+  ngx_atomic_t reserve_pos;    /* End of the last reserved record; not
+                                  used by readers */
+  u_char reserved[56];
+} ngx_akita_ring_header_t;
+
+typedef struct {
+  uint32_t len;                /* Payload length, not including padding */
+  uint16_t kind;               /* NGX_AKITA_RING_* */
+  uint16_t flags;              /* NGX_AKITA_RING_COMMITTED */
+} ngx_akita_ring_record_t;
+
+typedef struct ngx_akita_ring_s ngx_akita_ring_t;
+
+/*
+ * Set up a ring for the configuration being read. The file isn't touched
+ * until ngx_akita_ring_init, since the configuration may only be tested,
+ * or fail to load, while workers and the agent use the file.
+ */
+ngx_akita_ring_t *
+ngx_akita_ring_open(ngx_conf_t *cf, ngx_str_t *path, size_t size, ngx_uint_t overflow);
+
+/*
+ * Create (or reopen) the ring file and map it. Called by the master once
+ * the configuration has loaded, so the mapping is inherited by every
+ * worker; does nothing when the configuration is only being tested.
+ */
+ngx_int_t
+ngx_akita_ring_init(ngx_cycle_t *cycle, ngx_akita_ring_t *ring);
+
+/*
+ * Write one witness, held in body, into the ring. Returns NGX_DECLINED if
+ * it was dropped for lack of space.
+ */
+ngx_int_t
+ngx_akita_ring_write(ngx_akita_ring_t *ring, ngx_uint_t kind,
+                     ngx_chain_t *body, size_t content_length);
+
+#endif /* _AKITA_NGX_MODULE_AKITA_RING_H_INCLUDED */
@@ -0,0 +1,2026 @@
+/*
+ * Copyright (C) 2023 Akita Software
+ */
+
+#include "ngx_http_akita_module.h"
+#include "akita_sender.h"
+#include "akita_admission.h"
+#include "akita_stats.h"
+
+/* An HTTP request to the agent, ready to write to a connection. */
+typedef struct {
+  ngx_queue_t queue;           /* Link in the sender's pending queue */
+  u_char *data;                /* Request line, headers, and body */
+  size_t len;                  /* Total size of data */
+  size_t sent;                 /* Bytes written so far */
+  ngx_str_t path;              /* API path, for HTTP/2 */
+  ngx_str_t content_type;      /* Media type of the body, for HTTP/2 */
+  u_char *body;                /* Body within data, for HTTP/2 */
+  size_t body_len;
+  ngx_flag_t retried;          /* Already requeued once after a failure */
+  ngx_msec_t queued;           /* When the call was handed to the sender */
+} ngx_akita_message_t;
+
+/* Minimal state for reading the agent's response. */
+typedef struct {
+  u_char buf[1024];            /* Response headers, then discarded body */
+  size_t len;                  /* Bytes used in buf */
+  ngx_flag_t headers_done;     /* Have we seen the end of the headers? */
+  ngx_uint_t status;           /* HTTP status code */
+  off_t remaining;             /* Body bytes left to read */
+  ngx_flag_t close;            /* Connection can't be reused afterwards */
+  ngx_http_akita_agent_hints_t hints;  /* Control headers */
+} ngx_akita_response_t;
+
+/* A connection owned by the sender. */
+typedef struct {
+  ngx_queue_t queue;           /* Link in the sender's idle queue */
+  struct ngx_akita_sender_s *sender;
+  ngx_peer_connection_t peer;
+  ngx_akita_message_t *message; /* Call in flight, or NULL if idle */
+  ngx_flag_t reused;           /* Was the connection idle before this call? */
+  ngx_akita_response_t response;
+} ngx_akita_sender_conn_t;
+
+/* Per-worker sender for one agent. */
+typedef struct ngx_akita_sender_s {
+  ngx_http_akita_agent_t *agent;
+  ngx_log_t *log;
+  ngx_akita_stats_t *stats;    /* NULL if the zone isn't available */
+
+  /* Calls dropped since the last warning about them */
+  ngx_uint_t dropped;
+  ngx_msec_t dropped_logged;
+
+  /* Batch being assembled. The JSON array starts at batch_body, and space
+   * is reserved in front of it for the HTTP request headers. */
+  ngx_akita_message_t *batch;
+  u_char *batch_body;
+  size_t batch_len;
+  size_t batch_cap;
+  ngx_uint_t batch_count;
+  size_t batch_size;
+  ngx_msec_t batch_interval;
+  ngx_event_t batch_timer;
+
+  /* Calls waiting for a connection */
+  ngx_queue_t pending;
+  size_t pending_bytes;
+
+  /* Connections with no call in flight */
+  ngx_queue_t idle;
+  ngx_uint_t connections;
+  ngx_uint_t max_connections;
+  ngx_msec_t idle_timeout;
+
+  /* Next address to try, if the agent's name resolved to several */
+  ngx_uint_t next_addr;
+
+  /* Send every call on one HTTP/2 connection instead */
+  ngx_flag_t http2;
+  struct ngx_akita_h2_s *h2;
+} ngx_akita_sender_t;
+
+/* Limits for the HTTP/2 connection */
+#define NGX_AKITA_H2_MAX_STREAMS   128     /* Streams in flight */
+#define NGX_AKITA_H2_FRAME_SIZE    16384   /* Largest frame the agent may send */
+#define NGX_AKITA_H2_OUT_SIZE      65536   /* Output buffer, for data frames */
+#define NGX_AKITA_H2_OUT_RESERVE   1024    /* Extra output space for control frames */
+#define NGX_AKITA_H2_HPACK_SIZE    4096    /* Largest response header block */
+#define NGX_AKITA_H2_TABLE_SIZE    4096    /* Largest encoder table we use */
+#define NGX_AKITA_H2_TABLE_ENTRIES 16
+#define NGX_AKITA_H2_MAX_WINDOW    0x7fffffff
+
+/* A header we added to the agent's HPACK decoder table */
+typedef struct {
+  ngx_uint_t name;             /* Static table index of the name */
+  ngx_str_t value;             /* Points to data that outlives the connection */
+} ngx_akita_h2_entry_t;
+
+/* A stream carrying one call */
+typedef struct {
+  ngx_queue_t queue;           /* Link in the connection's streams */
+  ngx_uint_t id;
+  ngx_akita_message_t *message;
+  size_t sent;                 /* Body bytes sent so far */
+  ssize_t window;              /* Agent's flow-control window for the stream */
+  ngx_uint_t status;
+} ngx_akita_h2_stream_t;
+
+/* An HTTP/2 (h2c, with prior knowledge) connection to the agent */
+typedef struct ngx_akita_h2_s {
+  ngx_akita_sender_t *sender;
+  ngx_peer_connection_t peer;
+  ngx_flag_t goaway;           /* No new streams on this connection */
+  ngx_flag_t stalled;          /* Calls are waiting, but no stream may start */
+
+  ngx_queue_t streams;
+  ngx_uint_t nstreams;
+  ngx_uint_t next_id;
+  ngx_uint_t completed;        /* Streams answered on this connection */
+
+  /* Settings from the agent */
+  ngx_uint_t max_streams;
+  ssize_t initial_window;
+  size_t max_frame;
+
+  ssize_t send_window;         /* Connection flow-control window */
+  size_t recv_unacked;         /* Data received but not yet acknowledged */
+
+  /* Our HPACK encoder's view of the agent's dynamic table. We never
+   * evict, so entries keep their index until the table is reset. */
+  ngx_akita_h2_entry_t table[NGX_AKITA_H2_TABLE_ENTRIES];
+  ngx_uint_t nentries;
+  size_t table_used;
+  size_t table_size;
+  ngx_flag_t table_reset;      /* Tell the agent before the next header block */
+
+  /* Response header block being assembled from HEADERS and CONTINUATION */
+  u_char hpack[NGX_AKITA_H2_HPACK_SIZE];
+  size_t hpack_len;
+  ngx_uint_t hpack_stream;
+  ngx_flag_t hpack_end_stream;
+
+  u_char *out;
+  size_t out_pos;              /* Bytes of out already sent */
+  size_t out_len;
+  u_char *in;
+  size_t in_len;
+} ngx_akita_h2_t;
+
+static ngx_akita_message_t *ngx_akita_sender_batch_start(ngx_akita_sender_t *s, size_t need);
+static void ngx_akita_sender_flush(ngx_akita_sender_t *s);
+static void ngx_akita_sender_batch_timer_handler(ngx_event_t *ev);
+static size_t ngx_akita_sender_write_header(u_char *buf, ngx_http_akita_agent_t *agent,
+                                            ngx_str_t *path, ngx_str_t *content_type,
+                                            size_t content_length);
+static void ngx_akita_sender_enqueue(ngx_akita_sender_t *s, ngx_akita_message_t *msg);
+static void ngx_akita_sender_dispatch(ngx_akita_sender_t *s);
+static ngx_flag_t ngx_akita_sender_backed_off(ngx_akita_sender_t *s);
+static ngx_akita_message_t *ngx_akita_sender_next(ngx_akita_sender_t *s);
+static void ngx_akita_sender_drop(ngx_akita_sender_t *s, ngx_akita_message_t *msg);
+static ngx_int_t ngx_akita_sender_connect_peer(ngx_akita_sender_t *s, ngx_peer_connection_t *pc);
+static ngx_akita_sender_conn_t *ngx_akita_sender_connect(ngx_akita_sender_t *s);
+static void ngx_akita_sender_write_handler(ngx_event_t *wev);
+static void ngx_akita_sender_read_handler(ngx_event_t *rev);
+static ngx_int_t ngx_akita_sender_parse_response(ngx_akita_sender_conn_t *conn, size_t n);
+static ngx_int_t ngx_akita_sender_parse_headers(ngx_akita_response_t *resp, u_char *p, u_char *last);
+static void ngx_akita_sender_finish(ngx_akita_sender_conn_t *conn, ngx_flag_t ok);
+static void ngx_akita_sender_idle(ngx_akita_sender_conn_t *conn);
+static void ngx_akita_sender_idle_handler(ngx_event_t *ev);
+static void ngx_akita_sender_close(ngx_akita_sender_conn_t *conn);
+static void ngx_akita_h2_dispatch(ngx_akita_sender_t *s);
+static ngx_akita_h2_t *ngx_akita_h2_connect(ngx_akita_sender_t *s);
+static void ngx_akita_h2_write_handler(ngx_event_t *wev);
+static void ngx_akita_h2_read_handler(ngx_event_t *rev);
+static ngx_int_t ngx_akita_h2_write(ngx_akita_h2_t *h2);
+static void ngx_akita_h2_fill(ngx_akita_h2_t *h2);
+static u_char *ngx_akita_h2_write_headers(ngx_akita_h2_t *h2, u_char *p, ngx_akita_message_t *msg);
+static u_char *ngx_akita_h2_write_header(ngx_akita_h2_t *h2, u_char *p, ngx_uint_t name,
+                                         size_t name_len, ngx_str_t *value, ngx_flag_t index);
+static ngx_int_t ngx_akita_h2_process(ngx_akita_h2_t *h2);
+static ngx_int_t ngx_akita_h2_process_frame(ngx_akita_h2_t *h2, ngx_uint_t type, ngx_uint_t flags,
+                                            ngx_uint_t sid, u_char *p, size_t len);
+static ngx_int_t ngx_akita_h2_process_settings(ngx_akita_h2_t *h2, u_char *p, size_t len);
+static ngx_int_t ngx_akita_h2_parse_status(u_char *p, u_char *end, ngx_uint_t *status);
+static u_char *ngx_akita_h2_control(ngx_akita_h2_t *h2, size_t len);
+static ngx_akita_h2_stream_t *ngx_akita_h2_find_stream(ngx_akita_h2_t *h2, ngx_uint_t sid);
+static ngx_int_t ngx_akita_h2_end_stream(ngx_akita_h2_t *h2, ngx_akita_h2_stream_t *st);
+static void ngx_akita_h2_finish_stream(ngx_akita_h2_t *h2, ngx_akita_h2_stream_t *st, ngx_flag_t retry);
+static void ngx_akita_h2_close(ngx_akita_h2_t *h2, ngx_flag_t failed);
+
+/* API path for batches of witnesses, which are always JSON */
+static ngx_str_t ngx_akita_batch_location = ngx_string("/trace/v1/batch");
+static ngx_str_t ngx_akita_json_type = ngx_string("application/json");
+
+/* Prefix of each witness in a batch, by kind */
+static ngx_str_t ngx_akita_batch_prefix[] = {
+  ngx_string("{\"request\":"),
+  ngx_string("{\"response\":"),
+  ngx_string("{\"witness\":"),
+};
+
+/* Room reserved for the request line and headers of each call */
+static const size_t ngx_akita_header_reserve = 256;
+
+/* Calls waiting for a connection beyond this size are dropped. */
+static const size_t ngx_akita_max_pending = 16 * 1024 * 1024;
+
+/* Dropped calls are warned about at most this often, in ms. */
+static const ngx_msec_t ngx_akita_dropped_log_interval = 1000;
+
+/* Timeouts for the sender's connections, in ms; the same as for subrequests. */
+static const ngx_msec_t ngx_akita_connect_timeout = 2000;
+static const ngx_msec_t ngx_akita_send_timeout = 2000;
+static const ngx_msec_t ngx_akita_read_timeout = 2000;
+
+ngx_int_t
+ngx_akita_sender_configure(ngx_conf_t *cf, ngx_http_akita_agent_t *agent) {
+  ngx_url_t u;
+
+  ngx_memzero(&u, sizeof(ngx_url_t));
+  u.url = agent->address;
+  /* The upstream records the port actually used, including the default. */
+  u.default_port = agent->upstream->port;
+  u.uri_part = 1;
+
+  if (ngx_parse_url(cf->pool, &u) != NGX_OK) {
+    if (u.err) {
+      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                         "%s in Akita agent address \"%V\"", u.err, &u.url);
+    }
+    return NGX_ERROR;
+  }
+
+  agent->addrs = u.addrs;
+  agent->naddrs = u.naddrs;
+  return NGX_OK;
+}
+
+ngx_int_t
+ngx_akita_sender_init_process(ngx_cycle_t *cycle) {
+  ngx_http_akita_main_conf_t *amcf;
+  ngx_http_akita_agent_t **agents;
+  ngx_akita_sender_t *s;
+  ngx_uint_t i;
+
+  amcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_akita_module);
+  if (amcf == NULL) {
+    return NGX_OK;
+  }
+
+  agents = amcf->agents.elts;
+  for (i = 0; i < amcf->agents.nelts; i++) {
+    if (agents[i]->addrs == NULL) {
+      /* Not configured; nothing is sent to this agent by the sender. */
+      continue;
+    }
+
+    s = ngx_pcalloc(cycle->pool, sizeof(ngx_akita_sender_t));
+    if (s == NULL) {
+      return NGX_ERROR;
+    }
+
+    s->agent = agents[i];
+    s->log = cycle->log;
+    s->stats = amcf->stats_zone != NULL ? amcf->stats_zone->data : NULL;
+    s->batch_size = amcf->batch_size;
+    s->batch_interval = amcf->batch_interval;
+
+    s->batch_timer.handler = ngx_akita_sender_batch_timer_handler;
+    s->batch_timer.data = s;
+    s->batch_timer.log = cycle->log;
+
+    ngx_queue_init(&s->pending);
+    ngx_queue_init(&s->idle);
+
+    /* Use as many connections as we would keep alive for subrequests. */
+    s->max_connections = amcf->keepalive > 0 ? (ngx_uint_t) amcf->keepalive : 1;
+    s->idle_timeout = amcf->keepalive_timeout;
+    s->http2 = amcf->http2;
+
+    agents[i]->sender = s;
+  }
+
+  return NGX_OK;
+}
+
+ngx_int_t
+ngx_akita_sender_send(ngx_http_akita_agent_t *agent,
+                      ngx_str_t *path,
+                      ngx_str_t *content_type,
+                      ngx_chain_t *body,
+                      size_t content_length) {
+  ngx_akita_sender_t *s = agent->sender;
+  ngx_akita_message_t *msg;
+  ngx_chain_t *cl;
+  u_char *p;
+
+  if (s == NULL) {
+    return NGX_ERROR;
+  }
+
+  msg = ngx_alloc(sizeof(ngx_akita_message_t) + ngx_akita_header_reserve + content_length,
+                  s->log);
+  if (msg == NULL) {
+    return NGX_ERROR;
+  }
+  ngx_memzero(msg, sizeof(ngx_akita_message_t));
+
+  msg->data = (u_char *) (msg + 1);
+  p = msg->data + ngx_akita_sender_write_header(msg->data, agent, path, content_type,
+                                                content_length);
+  for (cl = body; cl != NULL; cl = cl->next) {
+    p = ngx_cpymem(p, cl->buf->pos, cl->buf->last - cl->buf->pos);
+  }
+  msg->len = p - msg->data;
+  msg->path = *path;
+  msg->content_type = *content_type;
+  msg->body = p - content_length;
+  msg->body_len = content_length;
+
+  ngx_akita_sender_enqueue(s, msg);
+  return NGX_OK;
+}
+
+ngx_int_t
+ngx_akita_sender_batch(ngx_http_akita_agent_t *agent,
+                       ngx_akita_witness_kind_e kind,
+                       ngx_chain_t *body,
+                       size_t content_length) {
+  ngx_akita_sender_t *s = agent->sender;
+  ngx_str_t *prefix = &ngx_akita_batch_prefix[kind];
+  ngx_chain_t *cl;
+  size_t record_len;
+  u_char *p;
+
+  if (s == NULL) {
+    return NGX_ERROR;
+  }
+
+  /* Comma, prefix, witness, closing brace */
+  record_len = 1 + prefix->len + content_length + 1;
+
+  /* Leave room for the closing bracket. */
+  if (s->batch != NULL && s->batch_len + record_len + 1 > s->batch_cap) {
+    ngx_akita_sender_flush(s);
+  }
+
+  if (s->batch == NULL) {
+    if (ngx_akita_sender_batch_start(s, 1 + record_len + 1) == NULL) {
+      return NGX_ERROR;
+    }
+  }
+
+  p = s->batch_body + s->batch_len;
+  if (s->batch_count > 0) {
+    *p++ = ',';
+  }
+  p = ngx_cpymem(p, prefix->data, prefix->len);
+  for (cl = body; cl != NULL; cl = cl->next) {
+    p = ngx_cpymem(p, cl->buf->pos, cl->buf->last - cl->buf->pos);
+  }
+  *p++ = '}';
+
+  s->batch_len = p - s->batch_body;
+  s->batch_count++;
+
+  if (s->batch_len >= s->batch_size || ngx_exiting) {
+    /* Full, or the worker is shutting down and there won't be more. */
+    ngx_akita_sender_flush(s);
+  } else if (!s->batch_timer.timer_set) {
+    ngx_add_timer(&s->batch_timer, s->batch_interval);
+  }
+
+  return NGX_OK;
+}
+
+ngx_uint_t
+ngx_akita_sender_load(ngx_http_akita_agent_t *agent) {
+  ngx_akita_sender_t *s = agent->sender;
+
+  if (s == NULL) {
+    return 0;
+  }
+  return (s->pending_bytes + s->batch_len) * 100 / ngx_akita_max_pending;
+}
+
+/* Allocate a new batch with room for at least `need` bytes of body. */
+static ngx_akita_message_t *
+ngx_akita_sender_batch_start(ngx_akita_sender_t *s, size_t need) {
+  ngx_akita_message_t *msg;
+  size_t cap;
+
+  /* The batch size, plus the brackets around the array */
+  cap = ngx_max(s->batch_size + 2, need);
+
+  msg = ngx_alloc(sizeof(ngx_akita_message_t) + ngx_akita_header_reserve + cap, s->log);
+  if (msg == NULL) {
+    return NULL;
+  }
+  ngx_memzero(msg, sizeof(ngx_akita_message_t));
+
+  s->batch = msg;
+  s->batch_body = (u_char *) (msg + 1) + ngx_akita_header_reserve;
+  s->batch_cap = cap;
+  s->batch_body[0] = '[';
+  s->batch_len = 1;
+  s->batch_count = 0;
+  return msg;
+}
+
+/* Close off the current batch and queue it to be sent. */
+static void
+ngx_akita_sender_flush(ngx_akita_sender_t *s) {
+  ngx_akita_message_t *msg = s->batch;
+  u_char *header;
+  size_t header_len;
+
+  if (s->batch_timer.timer_set) {
+    ngx_del_timer(&s->batch_timer);
+  }
+
+  if (msg == NULL) {
+    return;
+  }
+  s->batch = NULL;
+
+  s->batch_body[s->batch_len++] = ']';
+
+  /* Write the headers into the space reserved before the body, then move
+   * them up against it. */
+  header = (u_char *) (msg + 1);
+  header_len = ngx_akita_sender_write_header(header, s->agent, &ngx_akita_batch_location,
+                                              &ngx_akita_json_type, s->batch_len);
+  msg->data = s->batch_body - header_len;
+  ngx_memmove(msg->data, header, header_len);
+  msg->len = header_len + s->batch_len;
+  msg->path = ngx_akita_batch_location;
+  msg->content_type = ngx_akita_json_type;
+  msg->body = s->batch_body;
+  msg->body_len = s->batch_len;
+
+  ngx_log_debug2(NGX_LOG_DEBUG_HTTP, s->log, 0,
+                 "akita sender: flushing batch of %ui witnesses, %uz bytes",
+                 s->batch_count, s->batch_len);
+
+  ngx_akita_sender_enqueue(s, msg);
+}
+
+/* Send whatever has been batched once the batch interval expires. The
+ * timer holds up a worker that is shutting down gracefully until then,
+ * so the last batch isn't lost. */
+static void
+ngx_akita_sender_batch_timer_handler(ngx_event_t *ev) {
+  ngx_akita_sender_flush(ev->data);
+}
+
+/* Write the request line and headers of a call; returns their length. */
+static size_t
+ngx_akita_sender_write_header(u_char *buf, ngx_http_akita_agent_t *agent,
+                              ngx_str_t *path, ngx_str_t *content_type,
+                              size_t content_length) {
+  return ngx_snprintf(buf, ngx_akita_header_reserve,
+                      "POST %V HTTP/1.1" CRLF
+                      "Content-Length: %uz" CRLF
+                      "Content-Type: %V" CRLF
+                      "Host: %V" CRLF CRLF,
+                      path, content_length, content_type, &agent->host) - buf;
+}
+
+/* Queue a call, taking ownership of it, and try to send it. */
+static void
+ngx_akita_sender_enqueue(ngx_akita_sender_t *s, ngx_akita_message_t *msg) {
+  if (s->pending_bytes + msg->len > ngx_akita_max_pending) {
+    ngx_akita_sender_drop(s, msg);
+
+    /* Warn once in a while, not for every call. */
+    s->dropped++;
+    if (ngx_current_msec - s->dropped_logged >= ngx_akita_dropped_log_interval) {
+      ngx_log_error(NGX_LOG_WARN, s->log, 0,
+                    "Akita agent is not keeping up; dropped %ui calls",
+                    s->dropped);
+      s->dropped = 0;
+      s->dropped_logged = ngx_current_msec;
+    }
+    return;
+  }
+
+  msg->queued = ngx_current_msec;
+  ngx_queue_insert_tail(&s->pending, &msg->queue);
+  s->pending_bytes += msg->len;
+  ngx_akita_sender_dispatch(s);
+}
+
+/* Start sending pending calls on idle or new connections. */
+static void
+ngx_akita_sender_dispatch(ngx_akita_sender_t *s) {
+  ngx_akita_sender_conn_t *conn;
+  ngx_akita_message_t *msg;
+  ngx_connection_t *c;
+  ngx_queue_t *q;
+
+  if (s->http2) {
+    ngx_akita_h2_dispatch(s);
+    return;
+  }
+
+  while (!ngx_queue_empty(&s->pending)) {
+    if (ngx_akita_sender_backed_off(s)) {
+      return;
+    }
+
+    if (!ngx_queue_empty(&s->idle)) {
+      q = ngx_queue_head(&s->idle);
+      ngx_queue_remove(q);
+      conn = ngx_queue_data(q, ngx_akita_sender_conn_t, queue);
+      conn->reused = 1;
+
+      c = conn->peer.connection;
+      c->idle = 0;
+      if (c->read->timer_set) {
+        ngx_del_timer(c->read);
+      }
+    } else if (s->connections < s->max_connections) {
+      conn = ngx_akita_sender_connect(s);
+      if (conn == NULL) {
+        ngx_http_akita_agent_failed(s->agent, s->log);
+        continue;
+      }
+      conn->reused = 0;
+    } else {
+      /* Wait for a connection to finish its call. */
+      return;
+    }
+
+    msg = ngx_akita_sender_next(s);
+    conn->message = msg;
+    ngx_memzero(&conn->response, sizeof(ngx_akita_response_t));
+
+    c = conn->peer.connection;
+    if (!c->write->timer_set) {
+      /* Connected (or reused) already, so start writing. */
+      ngx_akita_sender_write_handler(c->write);
+    }
+  }
+}
+
+/* While backed off, throw away anything queued. Returns true if so. */
+static ngx_flag_t
+ngx_akita_sender_backed_off(ngx_akita_sender_t *s) {
+  if (!ngx_http_akita_agent_blocked(s->agent)) {
+    return 0;
+  }
+
+  while (!ngx_queue_empty(&s->pending)) {
+    ngx_akita_sender_drop(s, ngx_akita_sender_next(s));
+  }
+  return 1;
+}
+
+/* Throw away a call that won't be sent, and count it. */
+static void
+ngx_akita_sender_drop(ngx_akita_sender_t *s, ngx_akita_message_t *msg) {
+  if (s->stats != NULL) {
+    (void) ngx_atomic_fetch_add(&s->stats->sender_dropped, 1);
+  }
+  ngx_free(msg);
+}
+
+/* Take the oldest call off the pending queue. */
+static ngx_akita_message_t *
+ngx_akita_sender_next(ngx_akita_sender_t *s) {
+  ngx_akita_message_t *msg;
+  ngx_queue_t *q;
+
+  q = ngx_queue_head(&s->pending);
+  ngx_queue_remove(q);
+  msg = ngx_queue_data(q, ngx_akita_message_t, queue);
+  s->pending_bytes -= msg->len;
+  return msg;
+}
+
+/* Start connecting to (one of the addresses of) the agent. Returns
+ * NGX_OK or NGX_AGAIN as ngx_event_connect_peer does, or NGX_ERROR. */
+static ngx_int_t
+ngx_akita_sender_connect_peer(ngx_akita_sender_t *s, ngx_peer_connection_t *pc) {
+  ngx_http_akita_agent_t *agent = s->agent;
+  ngx_addr_t *addr;
+  ngx_int_t rc;
+
+  if (agent->naddrs == 0) {
+    return NGX_ERROR;
+  }
+
+  addr = &agent->addrs[s->next_addr++ % agent->naddrs];
+  pc->sockaddr = addr->sockaddr;
+  pc->socklen = addr->socklen;
+  pc->name = &addr->name;
+  pc->get = ngx_event_get_peer;
+  pc->log = s->log;
+  pc->log_error = NGX_ERROR_ERR;
+
+  rc = ngx_event_connect_peer(pc);
+  if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+    return NGX_ERROR;
+  }
+  return rc;
+}
+
+/* Open a new connection to the agent. Returns NULL if that fails. */
+static ngx_akita_sender_conn_t *
+ngx_akita_sender_connect(ngx_akita_sender_t *s) {
+  ngx_akita_sender_conn_t *conn;
+  ngx_connection_t *c;
+  ngx_int_t rc;
+
+  conn = ngx_calloc(sizeof(ngx_akita_sender_conn_t), s->log);
+  if (conn == NULL) {
+    return NULL;
+  }
+  conn->sender = s;
+
+  rc = ngx_akita_sender_connect_peer(s, &conn->peer);
+  if (rc == NGX_ERROR) {
+    ngx_free(conn);
+    return NULL;
+  }
+
+  c = conn->peer.connection;
+  c->data = conn;
+  c->read->handler = ngx_akita_sender_read_handler;
+  c->write->handler = ngx_akita_sender_write_handler;
+  s->connections++;
+
+  if (rc == NGX_AGAIN) {
+    /* The write handler is called once the connection is established. */
+    ngx_add_timer(c->write, ngx_akita_connect_timeout);
+  }
+
+  return conn;
+}
+
+/* Write the call in flight; once it is all written, wait for the response. */
+static void
+ngx_akita_sender_write_handler(ngx_event_t *wev) {
+  ngx_connection_t *c = wev->data;
+  ngx_akita_sender_conn_t *conn = c->data;
+  ngx_akita_message_t *msg = conn->message;
+  ssize_t n;
+
+  if (wev->timedout) {
+    ngx_log_error(NGX_LOG_WARN, c->log, NGX_ETIMEDOUT,
+                  "Akita agent timed out");
+    ngx_akita_sender_finish(conn, 0);
+    return;
+  }
+
+  if (wev->timer_set) {
+    ngx_del_timer(wev);
+  }
+
+  if (msg == NULL) {
+    return;
+  }
+
+  while (msg->sent < msg->len) {
+    n = c->send(c, msg->data + msg->sent, msg->len - msg->sent);
+
+    if (n == NGX_AGAIN) {
+      if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+        ngx_akita_sender_finish(conn, 0);
+        return;
+      }
+      ngx_add_timer(wev, ngx_akita_send_timeout);
+      return;
+    }
+
+    if (n == NGX_ERROR) {
+      ngx_akita_sender_finish(conn, 0);
+      return;
+    }
+
+    msg->sent += n;
+  }
+
+  ngx_add_timer(c->read, ngx_akita_read_timeout);
+  if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+    ngx_akita_sender_finish(conn, 0);
+    return;
+  }
+
+  if (c->read->ready) {
+    ngx_akita_sender_read_handler(c->read);
+  }
+}
+
+/* Read the agent's response to the call in flight. */
+static void
+ngx_akita_sender_read_handler(ngx_event_t *rev) {
+  ngx_connection_t *c = rev->data;
+  ngx_akita_sender_conn_t *conn = c->data;
+  ngx_akita_response_t *resp = &conn->response;
+  ngx_int_t rc;
+  ssize_t n;
+
+  if (conn->message == NULL) {
+    ngx_akita_sender_idle_handler(rev);
+    return;
+  }
+
+  if (rev->timedout) {
+    ngx_log_error(NGX_LOG_WARN, c->log, NGX_ETIMEDOUT,
+                  "Akita agent timed out");
+    ngx_akita_sender_finish(conn, 0);
+    return;
+  }
+
+  for ( ;; ) {
+    if (resp->headers_done) {
+      /* The body is discarded, so just reuse the buffer. */
+      resp->len = 0;
+    }
+
+    if (resp->len == sizeof(resp->buf)) {
+      ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                    "Akita agent sent too large a response header");
+      ngx_akita_sender_finish(conn, 0);
+      return;
+    }
+
+    n = c->recv(c, resp->buf + resp->len, sizeof(resp->buf) - resp->len);
+
+    if (n == NGX_AGAIN) {
+      if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+        ngx_akita_sender_finish(conn, 0);
+      }
+      return;
+    }
+
+    if (n == NGX_ERROR || n == 0) {
+      /* A response without a length ends when the agent closes. */
+      ngx_akita_sender_finish(conn, resp->headers_done && resp->remaining < 0);
+      return;
+    }
+
+    rc = ngx_akita_sender_parse_response(conn, n);
+    if (rc == NGX_AGAIN) {
+      continue;
+    }
+
+    ngx_akita_sender_finish(conn, rc == NGX_OK);
+    return;
+  }
+}
+
+/*
+ * Account for n more bytes of response in the buffer. Returns NGX_OK
+ * once the whole response has been read (or, if its length is unknown,
+ * as soon as the headers have been), NGX_AGAIN if more is needed, and
+ * NGX_ERROR if the response is malformed.
+ */
+static ngx_int_t
+ngx_akita_sender_parse_response(ngx_akita_sender_conn_t *conn, size_t n) {
+  ngx_akita_response_t *resp = &conn->response;
+  u_char *p, *end;
+
+  if (!resp->headers_done) {
+    resp->len += n;
+
+    /* Look for the blank line that ends the headers. */
+    end = NULL;
+    for (p = resp->buf; p + 3 < resp->buf + resp->len; p++) {
+      if (p[0] == CR && p[1] == LF && p[2] == CR && p[3] == LF) {
+        end = p + 4;
+        break;
+      }
+    }
+    if (end == NULL) {
+      return NGX_AGAIN;
+    }
+
+    if (ngx_akita_sender_parse_headers(resp, resp->buf, end) != NGX_OK) {
+      ngx_log_error(NGX_LOG_ERR, conn->peer.connection->log, 0,
+                    "Akita agent sent an invalid response");
+      return NGX_ERROR;
+    }
+    resp->headers_done = 1;
+    ngx_http_akita_agent_apply_hints(conn->sender->agent, &resp->hints,
+                                     conn->peer.connection->log);
+
+    /* We only need the status; don't wait for a body of unknown length. */
+    if (resp->remaining < 0) {
+      resp->close = 1;
+      return NGX_OK;
+    }
+
+    n = resp->buf + resp->len - end;
+  }
+
+  if ((off_t) n > resp->remaining) {
+    /* More than we asked for; don't trust the connection. */
+    resp->close = 1;
+    resp->remaining = 0;
+  } else {
+    resp->remaining -= n;
+  }
+
+  return resp->remaining == 0 ? NGX_OK : NGX_AGAIN;
+}
+
+/* Parse the status line and the headers we care about. */
+static ngx_int_t
+ngx_akita_sender_parse_headers(ngx_akita_response_t *resp, u_char *p, u_char *last) {
+  u_char *eol, *colon, *value;
+  size_t name_len;
+  ngx_int_t status;
+
+  static ngx_str_t content_length_lc = ngx_string("content-length");
+  static ngx_str_t transfer_encoding_lc = ngx_string("transfer-encoding");
+  static ngx_str_t connection_lc = ngx_string("connection");
+
+  /* "HTTP/1.x NNN ..." */
+  if (last - p < 12 || ngx_strncmp(p, "HTTP/1.", 7) != 0 || p[8] != ' ') {
+    return NGX_ERROR;
+  }
+  if (p[7] == '0') {
+    resp->close = 1;
+  }
+  status = ngx_atoi(p + 9, 3);
+  if (status == NGX_ERROR) {
+    return NGX_ERROR;
+  }
+  resp->status = status;
+  resp->remaining = -1;
+  ngx_http_akita_agent_hints_init(&resp->hints);
+
+  if (resp->status == NGX_HTTP_NO_CONTENT || resp->status == NGX_HTTP_NOT_MODIFIED) {
+    resp->remaining = 0;
+  }
+
+  for ( ;; ) {
+    /* Advance to the next line */
+    for (eol = p; eol < last - 1 && !(eol[0] == CR && eol[1] == LF); eol++) { /* void */ }
+    p = eol + 2;
+    if (p >= last - 2) {
+      /* Reached the blank line */
+      break;
+    }
+
+    for (colon = p; colon < last && *colon != ':' && *colon != CR; colon++) { /* void */ }
+    if (*colon != ':') {
+      return NGX_ERROR;
+    }
+    name_len = colon - p;
+
+    for (value = colon + 1; *value == ' ' || *value == '\t'; value++) { /* void */ }
+    for (eol = value; eol < last - 1 && !(eol[0] == CR && eol[1] == LF); eol++) { /* void */ }
+
+    if (name_len == content_length_lc.len
+        && ngx_strncasecmp(p, content_length_lc.data, name_len) == 0) {
+      if (resp->remaining != 0) {
+        resp->remaining = ngx_atoof(value, eol - value);
+        if (resp->remaining == NGX_ERROR) {
+          return NGX_ERROR;
+        }
+      }
+    } else if (name_len == transfer_encoding_lc.len
+               && ngx_strncasecmp(p, transfer_encoding_lc.data, name_len) == 0) {
+      /* A chunked body has no length we can use. */
+      resp->remaining = -1;
+      resp->close = 1;
+    } else if (name_len == connection_lc.len
+               && ngx_strncasecmp(p, connection_lc.data, name_len) == 0) {
+      if (ngx_strlcasestrn(value, eol, (u_char *) "close", sizeof("close") - 2) != NULL) {
+        resp->close = 1;
+      }
+    } else {
+      (void) ngx_http_akita_agent_parse_hint(&resp->hints, p, name_len, value, eol - value);
+    }
+  }
+
+  return NGX_OK;
+}
+
+/* The call in flight is done, successfully or not. Record the outcome
+ * and either keep the connection for the next call or close it. */
+static void
+ngx_akita_sender_finish(ngx_akita_sender_conn_t *conn, ngx_flag_t ok) {
+  ngx_akita_sender_t *s = conn->sender;
+  ngx_akita_message_t *msg = conn->message;
+  ngx_akita_response_t *resp = &conn->response;
+  ngx_connection_t *c = conn->peer.connection;
+
+  conn->message = NULL;
+
+  if (!ok && conn->reused && resp->len == 0 && !resp->headers_done) {
+    /* The agent probably closed the idle connection before it saw our
+     * call; try again on another connection. */
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "akita sender: cached connection failed, retrying");
+    msg->sent = 0;
+    ngx_queue_insert_head(&s->pending, &msg->queue);
+    s->pending_bytes += msg->len;
+    ngx_akita_sender_close(conn);
+    ngx_akita_sender_dispatch(s);
+    return;
+  }
+
+  ngx_akita_admission_latency(ngx_current_msec - msg->queued);
+  ngx_free(msg);
+
+  if (ok && resp->status == NGX_HTTP_OK) {
+    ngx_http_akita_agent_succeeded(s->agent);
+  } else {
+    ngx_log_error(NGX_LOG_WARN, c->log, 0,
+                  "Call to Akita agent failed, HTTP status code %ui",
+                  resp->status);
+    ngx_http_akita_agent_failed(s->agent, c->log);
+    ok = 0;
+  }
+
+  if (ok && !resp->close) {
+    ngx_akita_sender_idle(conn);
+  } else {
+    ngx_akita_sender_close(conn);
+  }
+
+  ngx_akita_sender_dispatch(s);
+}
+
+/* Keep a connection open for later calls. */
+static void
+ngx_akita_sender_idle(ngx_akita_sender_conn_t *conn) {
+  ngx_akita_sender_t *s = conn->sender;
+  ngx_connection_t *c = conn->peer.connection;
+
+  if (c->write->timer_set) {
+    ngx_del_timer(c->write);
+  }
+  if (c->read->timer_set) {
+    ngx_del_timer(c->read);
+  }
+
+  if (ngx_exiting || ngx_terminate) {
+    /* Don't keep the worker from exiting. */
+    ngx_akita_sender_close(conn);
+    return;
+  }
+
+  ngx_add_timer(c->read, s->idle_timeout);
+
+  /* Lets ngx_close_idle_connections close it on shutdown. */
+  c->idle = 1;
+  ngx_queue_insert_head(&s->idle, &conn->queue);
+
+  if (c->read->ready) {
+    ngx_akita_sender_idle_handler(c->read);
+  }
+}
+
+/* An idle connection became readable, timed out, or is being shut down.
+ * Unless this is a spurious wakeup, the agent is done with it. */
+static void
+ngx_akita_sender_idle_handler(ngx_event_t *ev) {
+  ngx_connection_t *c = ev->data;
+  ngx_akita_sender_conn_t *conn = c->data;
+  ssize_t n;
+  char buf[1];
+
+  if (!c->close && !ev->timedout) {
+    n = recv(c->fd, buf, 1, MSG_PEEK);
+    if (n == -1 && ngx_socket_errno == NGX_EAGAIN) {
+      ev->ready = 0;
+      if (ngx_handle_read_event(ev, 0) == NGX_OK) {
+        return;
+      }
+    }
+  }
+
+  ngx_queue_remove(&conn->queue);
+  ngx_akita_sender_close(conn);
+}
+
+/* Close a connection that has no call in flight. */
+static void
+ngx_akita_sender_close(ngx_akita_sender_conn_t *conn) {
+  conn->sender->connections--;
+  ngx_close_connection(conn->peer.connection);
+  ngx_free(conn);
+}
+
+/*
+ * HTTP/2 transport. Every call to the agent is a stream on one h2c
+ * connection (with prior knowledge), so a worker needs only one
+ * connection however bursty the load. Only what a client needs is
+ * implemented: responses are decoded without a dynamic HPACK table,
+ * since we advertise a size of zero, and their bodies are discarded.
+ */
+
+/* Frame types, flags, and error codes (RFC 7540) */
+#define NGX_AKITA_H2_DATA            0
+#define NGX_AKITA_H2_HEADERS         1
+#define NGX_AKITA_H2_RST_STREAM      3
+#define NGX_AKITA_H2_SETTINGS        4
+#define NGX_AKITA_H2_PING            6
+#define NGX_AKITA_H2_GOAWAY          7
+#define NGX_AKITA_H2_WINDOW_UPDATE   8
+#define NGX_AKITA_H2_CONTINUATION    9
+
+#define NGX_AKITA_H2_END_STREAM      0x01
+#define NGX_AKITA_H2_ACK             0x01
+#define NGX_AKITA_H2_END_HEADERS     0x04
+#define NGX_AKITA_H2_PADDED          0x08
+#define NGX_AKITA_H2_PRIORITY_FLAG   0x20
+
+#define NGX_AKITA_H2_REFUSED_STREAM  0x7
+#define NGX_AKITA_H2_CANCEL          0x8
+
+#define NGX_AKITA_H2_FRAME_HEADER    9
+#define NGX_AKITA_H2_DEFAULT_WINDOW  65535
+
+/* Settings identifiers */
+#define NGX_AKITA_H2_HEADER_TABLE_SIZE       1
+#define NGX_AKITA_H2_ENABLE_PUSH             2
+#define NGX_AKITA_H2_MAX_CONCURRENT_STREAMS  3
+#define NGX_AKITA_H2_INITIAL_WINDOW_SIZE     4
+#define NGX_AKITA_H2_MAX_FRAME_SIZE          5
+
+/* HPACK static table indexes (RFC 7541, appendix A) */
+#define NGX_AKITA_H2_AUTHORITY       1
+#define NGX_AKITA_H2_METHOD_POST     3
+#define NGX_AKITA_H2_PATH            4
+#define NGX_AKITA_H2_SCHEME_HTTP     6
+#define NGX_AKITA_H2_STATUS_FIRST    8
+#define NGX_AKITA_H2_STATUS_LAST     14
+#define NGX_AKITA_H2_CONTENT_LENGTH  28
+#define NGX_AKITA_H2_CONTENT_TYPE    31
+#define NGX_AKITA_H2_STATIC_ENTRIES  61
+
+/* Status codes at NGX_AKITA_H2_STATUS_FIRST onwards in the static table */
+static const ngx_uint_t ngx_akita_h2_static_status[] = {
+  200, 204, 206, 304, 400, 404, 500
+};
+
+static const u_char ngx_akita_h2_preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+#define ngx_akita_h2_get_uint32(p)                                            \
+  (((uint32_t) (p)[0] << 24) | ((p)[1] << 16) | ((p)[2] << 8) | (p)[3])
+
+static u_char *
+ngx_akita_h2_put_uint32(u_char *p, uint32_t v) {
+  *p++ = (u_char) (v >> 24);
+  *p++ = (u_char) (v >> 16);
+  *p++ = (u_char) (v >> 8);
+  *p++ = (u_char) v;
+  return p;
+}
+
+/* Write a frame header. */
+static u_char *
+ngx_akita_h2_frame(u_char *p, size_t len, ngx_uint_t type, ngx_uint_t flags, ngx_uint_t sid) {
+  *p++ = (u_char) (len >> 16);
+  *p++ = (u_char) (len >> 8);
+  *p++ = (u_char) len;
+  *p++ = (u_char) type;
+  *p++ = (u_char) flags;
+  return ngx_akita_h2_put_uint32(p, sid);
+}
+
+/* Write one setting in a SETTINGS frame. */
+static u_char *
+ngx_akita_h2_setting(u_char *p, ngx_uint_t id, uint32_t value) {
+  *p++ = (u_char) (id >> 8);
+  *p++ = (u_char) id;
+  return ngx_akita_h2_put_uint32(p, value);
+}
+
+/* Write an HPACK integer with an N-bit prefix. */
+static u_char *
+ngx_akita_h2_hpack_int(u_char *p, u_char prefix, ngx_uint_t bits, ngx_uint_t value) {
+  ngx_uint_t max = (1 << bits) - 1;
+
+  if (value < max) {
+    *p++ = (u_char) (prefix | value);
+    return p;
+  }
+
+  *p++ = (u_char) (prefix | max);
+  value -= max;
+  while (value >= 128) {
+    *p++ = (u_char) (value % 128 + 128);
+    value /= 128;
+  }
+  *p++ = (u_char) value;
+  return p;
+}
+
+/* Read an HPACK integer with an N-bit prefix. */
+static ngx_int_t
+ngx_akita_h2_parse_int(u_char **pos, u_char *end, ngx_uint_t bits, ngx_uint_t *value) {
+  ngx_uint_t max = (1 << bits) - 1;
+  ngx_uint_t v, shift;
+  u_char *p = *pos;
+
+  if (p == end) {
+    return NGX_ERROR;
+  }
+
+  v = *p++ & max;
+  if (v == max) {
+    shift = 0;
+    do {
+      if (p == end || shift > 21) {
+        return NGX_ERROR;
+      }
+      v += (ngx_uint_t) (*p & 0x7f) << shift;
+      shift += 7;
+    } while (*p++ & 0x80);
+  }
+
+  *pos = p;
+  *value = v;
+  return NGX_OK;
+}
+
+/* Start sending pending calls on the HTTP/2 connection, opening it first
+ * if needed. */
+static void
+ngx_akita_h2_dispatch(ngx_akita_sender_t *s) {
+  ngx_akita_h2_t *h2 = s->h2;
+
+  if (ngx_queue_empty(&s->pending) || ngx_akita_sender_backed_off(s)) {
+    return;
+  }
+
+  if (h2 == NULL) {
+    h2 = ngx_akita_h2_connect(s);
+    if (h2 == NULL) {
+      ngx_http_akita_agent_failed(s->agent, s->log);
+      (void) ngx_akita_sender_backed_off(s);
+      return;
+    }
+  }
+
+  if (h2->goaway || h2->peer.connection->write->timer_set) {
+    /* Draining, still connecting, or waiting to write; the calls will be
+     * picked up later. */
+    return;
+  }
+
+  (void) ngx_akita_h2_write(h2);
+}
+
+/* Open the HTTP/2 connection, and queue the connection preface. */
+static ngx_akita_h2_t *
+ngx_akita_h2_connect(ngx_akita_sender_t *s) {
+  ngx_akita_h2_t *h2;
+  ngx_connection_t *c;
+  ngx_int_t rc;
+  u_char *p;
+
+  h2 = ngx_calloc(sizeof(ngx_akita_h2_t)
+                  + NGX_AKITA_H2_OUT_SIZE + NGX_AKITA_H2_OUT_RESERVE
+                  + NGX_AKITA_H2_FRAME_HEADER + NGX_AKITA_H2_FRAME_SIZE,
+                  s->log);
+  if (h2 == NULL) {
+    return NULL;
+  }
+
+  h2->sender = s;
+  h2->out = (u_char *) (h2 + 1);
+  h2->in = h2->out + NGX_AKITA_H2_OUT_SIZE + NGX_AKITA_H2_OUT_RESERVE;
+  ngx_queue_init(&h2->streams);
+  h2->next_id = 1;
+  h2->max_streams = NGX_AKITA_H2_MAX_STREAMS;
+  h2->initial_window = NGX_AKITA_H2_DEFAULT_WINDOW;
+  h2->max_frame = NGX_AKITA_H2_FRAME_SIZE;
+  h2->send_window = NGX_AKITA_H2_DEFAULT_WINDOW;
+  h2->table_size = NGX_AKITA_H2_TABLE_SIZE;
+
+  rc = ngx_akita_sender_connect_peer(s, &h2->peer);
+  if (rc == NGX_ERROR) {
+    ngx_free(h2);
+    return NULL;
+  }
+
+  c = h2->peer.connection;
+  c->data = h2;
+  c->read->handler = ngx_akita_h2_read_handler;
+  c->write->handler = ngx_akita_h2_write_handler;
+
+  /* Our settings turn off the agent's use of a dynamic table and server
+   * push, and open the flow-control windows for responses all the way,
+   * so we never have to update them for the small responses we get. */
+  p = ngx_cpymem(h2->out, ngx_akita_h2_preface, sizeof(ngx_akita_h2_preface) - 1);
+  p = ngx_akita_h2_frame(p, 3 * 6, NGX_AKITA_H2_SETTINGS, 0, 0);
+  p = ngx_akita_h2_setting(p, NGX_AKITA_H2_HEADER_TABLE_SIZE, 0);
+  p = ngx_akita_h2_setting(p, NGX_AKITA_H2_ENABLE_PUSH, 0);
+  p = ngx_akita_h2_setting(p, NGX_AKITA_H2_INITIAL_WINDOW_SIZE, NGX_AKITA_H2_MAX_WINDOW);
+  p = ngx_akita_h2_frame(p, 4, NGX_AKITA_H2_WINDOW_UPDATE, 0, 0);
+  p = ngx_akita_h2_put_uint32(p, NGX_AKITA_H2_MAX_WINDOW - NGX_AKITA_H2_DEFAULT_WINDOW);
+  h2->out_len = p - h2->out;
+
+  s->h2 = h2;
+
+  if (rc == NGX_AGAIN) {
+    /* The write handler is called once the connection is established. */
+    ngx_add_timer(c->write, ngx_akita_connect_timeout);
+  }
+
+  return h2;
+}
+
+static void
+ngx_akita_h2_write_handler(ngx_event_t *wev) {
+  ngx_connection_t *c = wev->data;
+  ngx_akita_h2_t *h2 = c->data;
+
+  if (wev->timedout) {
+    ngx_log_error(NGX_LOG_WARN, c->log, NGX_ETIMEDOUT,
+                  "Akita agent timed out");
+    ngx_akita_h2_close(h2, 1);
+    return;
+  }
+
+  if (wev->timer_set) {
+    ngx_del_timer(wev);
+  }
+
+  (void) ngx_akita_h2_write(h2);
+}
+
+/* Write out as much as we can: control frames, new streams, and data.
+ * Returns NGX_ERROR if the connection was closed. */
+static ngx_int_t
+ngx_akita_h2_write(ngx_akita_h2_t *h2) {
+  ngx_connection_t *c = h2->peer.connection;
+  ssize_t n;
+
+  for ( ;; ) {
+    ngx_akita_h2_fill(h2);
+    if (h2->out_pos == h2->out_len) {
+      break;
+    }
+
+    n = c->send(c, h2->out + h2->out_pos, h2->out_len - h2->out_pos);
+
+    if (n == NGX_AGAIN) {
+      if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+        ngx_akita_h2_close(h2, 1);
+        return NGX_ERROR;
+      }
+      ngx_add_timer(c->write, ngx_akita_send_timeout);
+      return NGX_OK;
+    }
+
+    if (n == NGX_ERROR) {
+      ngx_akita_h2_close(h2, 1);
+      return NGX_ERROR;
+    }
+
+    /* Only start over at the beginning of the buffer once all of it has
+     * been sent, rather than moving what's left down after every send. */
+    h2->out_pos += n;
+    if (h2->out_pos == h2->out_len) {
+      h2->out_pos = 0;
+      h2->out_len = 0;
+    }
+  }
+
+  if (c->write->timer_set) {
+    ngx_del_timer(c->write);
+  }
+
+  if (h2->nstreams == 0 && !h2->goaway && !ngx_queue_empty(&h2->sender->pending)) {
+    /* The agent lets us start no streams at all (its
+     * SETTINGS_MAX_CONCURRENT_STREAMS is 0). Give it as long as it has
+     * to answer a call to raise the limit, and then give up on it. */
+    c->idle = 0;
+    if (!h2->stalled) {
+      h2->stalled = 1;
+      ngx_add_timer(c->read, ngx_akita_read_timeout);
+    }
+
+  } else if (h2->nstreams == 0 && (ngx_exiting || ngx_terminate)) {
+    /* Don't keep the worker from exiting. */
+    ngx_akita_h2_close(h2, 0);
+    return NGX_ERROR;
+
+  } else {
+    /* Wait for responses, or close the connection once it has been idle
+     * for too long. An idle connection is closed when the worker exits. */
+    h2->stalled = 0;
+    c->idle = h2->nstreams == 0;
+    ngx_add_timer(c->read, h2->nstreams ? ngx_akita_read_timeout : h2->sender->idle_timeout);
+  }
+
+  if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+    ngx_akita_h2_close(h2, 1);
+    return NGX_ERROR;
+  }
+
+  return NGX_OK;
+}
+
+/* Fill the output buffer with new streams for pending calls, and with
+ * as much of their bodies as flow control allows. */
+static void
+ngx_akita_h2_fill(ngx_akita_h2_t *h2) {
+  ngx_akita_sender_t *s = h2->sender;
+  ngx_akita_h2_stream_t *st;
+  ngx_akita_message_t *msg;
+  ngx_queue_t *q;
+  size_t n, need;
+  u_char *p;
+
+  while (!h2->goaway
+         && !ngx_queue_empty(&s->pending)
+         && h2->nstreams < ngx_min(h2->max_streams, NGX_AKITA_H2_MAX_STREAMS)) {
+    if (ngx_akita_sender_backed_off(s)) {
+      break;
+    }
+
+    msg = ngx_queue_data(ngx_queue_head(&s->pending), ngx_akita_message_t, queue);
+    need = NGX_AKITA_H2_FRAME_HEADER + 64 + msg->path.len + s->agent->host.len
+      + msg->content_type.len + NGX_SIZE_T_LEN;
+    if (h2->out_len + need > NGX_AKITA_H2_OUT_SIZE) {
+      break;
+    }
+
+    st = ngx_alloc(sizeof(ngx_akita_h2_stream_t), s->log);
+    if (st == NULL) {
+      break;
+    }
+
+    st->message = ngx_akita_sender_next(s);
+    st->id = h2->next_id;
+    st->sent = 0;
+    st->window = h2->initial_window;
+    st->status = 0;
+    h2->next_id += 2;
+
+    ngx_queue_insert_tail(&h2->streams, &st->queue);
+    h2->nstreams++;
+
+    p = ngx_akita_h2_write_headers(h2, h2->out + h2->out_len, st->message);
+    h2->out_len = p - h2->out;
+
+    if (h2->next_id > NGX_AKITA_H2_MAX_WINDOW) {
+      /* Out of stream identifiers. Let the streams in flight finish; the
+       * connection is then closed, and the next calls go on a new one. */
+      h2->goaway = 1;
+    }
+  }
+
+  for (q = ngx_queue_head(&h2->streams);
+       q != ngx_queue_sentinel(&h2->streams) && h2->send_window > 0;
+       q = ngx_queue_next(q)) {
+    st = ngx_queue_data(q, ngx_akita_h2_stream_t, queue);
+    msg = st->message;
+
+    while (st->sent < msg->body_len
+           && st->window > 0
+           && h2->send_window > 0
+           && h2->out_len + NGX_AKITA_H2_FRAME_HEADER < NGX_AKITA_H2_OUT_SIZE) {
+      n = msg->body_len - st->sent;
+      n = ngx_min(n, (size_t) st->window);
+      n = ngx_min(n, (size_t) h2->send_window);
+      n = ngx_min(n, h2->max_frame);
+      n = ngx_min(n, NGX_AKITA_H2_OUT_SIZE - h2->out_len - NGX_AKITA_H2_FRAME_HEADER);
+
+      p = h2->out + h2->out_len;
+      p = ngx_akita_h2_frame(p, n, NGX_AKITA_H2_DATA,
+                             st->sent + n == msg->body_len ? NGX_AKITA_H2_END_STREAM : 0,
+                             st->id);
+      p = ngx_cpymem(p, msg->body + st->sent, n);
+      h2->out_len = p - h2->out;
+
+      st->sent += n;
+      st->window -= n;
+      h2->send_window -= n;
+    }
+  }
+}
+
+/* Write the HEADERS frame that starts a stream for the stream just added. */
+static u_char *
+ngx_akita_h2_write_headers(ngx_akita_h2_t *h2, u_char *p, ngx_akita_message_t *msg) {
+  ngx_akita_h2_stream_t *st;
+  u_char length[NGX_SIZE_T_LEN];
+  ngx_str_t length_str;
+  u_char *start, *q;
+
+  st = ngx_queue_data(ngx_queue_last(&h2->streams), ngx_akita_h2_stream_t, queue);
+  start = p + NGX_AKITA_H2_FRAME_HEADER;
+  q = start;
+
+  if (h2->table_reset) {
+    /* Empty the agent's table, then set the size it asked for. */
+    q = ngx_akita_h2_hpack_int(q, 0x20, 5, 0);
+    q = ngx_akita_h2_hpack_int(q, 0x20, 5, h2->table_size);
+    h2->table_reset = 0;
+  }
+
+  *q++ = 0x80 | NGX_AKITA_H2_METHOD_POST;
+  *q++ = 0x80 | NGX_AKITA_H2_SCHEME_HTTP;
+  q = ngx_akita_h2_write_header(h2, q, NGX_AKITA_H2_PATH, sizeof(":path") - 1,
+                                &msg->path, 1);
+  q = ngx_akita_h2_write_header(h2, q, NGX_AKITA_H2_AUTHORITY, sizeof(":authority") - 1,
+                                &h2->sender->agent->host, 1);
+  q = ngx_akita_h2_write_header(h2, q, NGX_AKITA_H2_CONTENT_TYPE, sizeof("content-type") - 1,
+                                &msg->content_type, 1);
+
+  length_str.data = length;
+  length_str.len = ngx_sprintf(length, "%uz", msg->body_len) - length;
+  q = ngx_akita_h2_write_header(h2, q, NGX_AKITA_H2_CONTENT_LENGTH, sizeof("content-length") - 1,
+                                &length_str, 0);
+
+  (void) ngx_akita_h2_frame(p, q - start, NGX_AKITA_H2_HEADERS,
+                            NGX_AKITA_H2_END_HEADERS
+                            | (msg->body_len == 0 ? NGX_AKITA_H2_END_STREAM : 0),
+                            st->id);
+  return q;
+}
+
+/* Encode one header, whose name is in the static table. Values that are
+ * the same on every call are added to the agent's dynamic table the first
+ * time, and sent as a single index after that. */
+static u_char *
+ngx_akita_h2_write_header(ngx_akita_h2_t *h2, u_char *p, ngx_uint_t name,
+                          size_t name_len, ngx_str_t *value, ngx_flag_t index) {
+  ngx_akita_h2_entry_t *e;
+  ngx_uint_t i;
+  size_t size;
+
+  for (i = 0; i < h2->nentries; i++) {
+    e = &h2->table[i];
+    if (e->name == name && e->value.len == value->len
+        && ngx_memcmp(e->value.data, value->data, value->len) == 0) {
+      /* The newest entry has the lowest index. */
+      return ngx_akita_h2_hpack_int(p, 0x80, 7,
+                                    NGX_AKITA_H2_STATIC_ENTRIES + h2->nentries - i);
+    }
+  }
+
+  size = name_len + value->len + 32;
+  if (index
+      && h2->nentries < NGX_AKITA_H2_TABLE_ENTRIES
+      && h2->table_used + size <= h2->table_size) {
+    /* Literal with incremental indexing */
+    p = ngx_akita_h2_hpack_int(p, 0x40, 6, name);
+    e = &h2->table[h2->nentries++];
+    e->name = name;
+    e->value = *value;
+    h2->table_used += size;
+  } else {
+    /* Literal without indexing */
+    p = ngx_akita_h2_hpack_int(p, 0x00, 4, name);
+  }
+
+  p = ngx_akita_h2_hpack_int(p, 0x00, 7, value->len);
+  return ngx_cpymem(p, value->data, value->len);
+}
+
+/* Room for a control frame of len bytes at the end of the output buffer.
+ * Returns NULL if there isn't any. */
+static u_char *
+ngx_akita_h2_control(ngx_akita_h2_t *h2, size_t len) {
+  u_char *p;
+
+  if (h2->out_len + len > NGX_AKITA_H2_OUT_SIZE + NGX_AKITA_H2_OUT_RESERVE) {
+    return NULL;
+  }
+
+  p = h2->out + h2->out_len;
+  h2->out_len += len;
+  return p;
+}
+
+static void
+ngx_akita_h2_read_handler(ngx_event_t *rev) {
+  ngx_connection_t *c = rev->data;
+  ngx_akita_h2_t *h2 = c->data;
+  ssize_t n;
+
+  if (rev->timedout) {
+    if (h2->stalled) {
+      ngx_log_error(NGX_LOG_WARN, c->log, 0,
+                    "Akita agent allows no HTTP/2 streams");
+      ngx_http_akita_agent_failed(h2->sender->agent, c->log);
+      ngx_akita_h2_close(h2, 0);
+      return;
+    }
+
+    if (h2->nstreams == 0) {
+      /* Idle for too long */
+      ngx_akita_h2_close(h2, 0);
+      return;
+    }
+
+    ngx_log_error(NGX_LOG_WARN, c->log, NGX_ETIMEDOUT,
+                  "Akita agent timed out");
+    ngx_akita_h2_close(h2, 1);
+    return;
+  }
+
+  if (c->close) {
+    /* The worker is shutting down. */
+    ngx_akita_h2_close(h2, 0);
+    return;
+  }
+
+  for ( ;; ) {
+    n = c->recv(c, h2->in + h2->in_len,
+                NGX_AKITA_H2_FRAME_HEADER + NGX_AKITA_H2_FRAME_SIZE - h2->in_len);
+
+    if (n == NGX_AGAIN) {
+      break;
+    }
+
+    if (n == NGX_ERROR || n == 0) {
+      ngx_akita_h2_close(h2, h2->nstreams > 0);
+      return;
+    }
+
+    h2->in_len += n;
+    if (ngx_akita_h2_process(h2) != NGX_OK) {
+      ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                    "Akita agent sent an invalid HTTP/2 frame");
+      ngx_akita_h2_close(h2, 1);
+      return;
+    }
+
+    if (h2->goaway && h2->nstreams == 0) {
+      ngx_akita_h2_close(h2, 0);
+      return;
+    }
+  }
+
+  /* Send any acknowledgements, and start new streams if some finished. */
+  (void) ngx_akita_h2_write(h2);
+}
+
+/* Process all the complete frames in the input buffer. */
+static ngx_int_t
+ngx_akita_h2_process(ngx_akita_h2_t *h2) {
+  u_char *p = h2->in;
+  u_char *end = h2->in + h2->in_len;
+  size_t len;
+
+  while (end - p >= NGX_AKITA_H2_FRAME_HEADER) {
+    len = (p[0] << 16) | (p[1] << 8) | p[2];
+    if (len > NGX_AKITA_H2_FRAME_SIZE) {
+      return NGX_ERROR;
+    }
+    if ((size_t) (end - p) < NGX_AKITA_H2_FRAME_HEADER + len) {
+      break;
+    }
+
+    if (ngx_akita_h2_process_frame(h2, p[3], p[4],
+                                   ngx_akita_h2_get_uint32(p + 5) & 0x7fffffff,
+                                   p + NGX_AKITA_H2_FRAME_HEADER, len) != NGX_OK) {
+      return NGX_ERROR;
+    }
+    p += NGX_AKITA_H2_FRAME_HEADER + len;
+  }
+
+  ngx_memmove(h2->in, p, end - p);
+  h2->in_len = end - p;
+  return NGX_OK;
+}
+
+static ngx_int_t
+ngx_akita_h2_process_frame(ngx_akita_h2_t *h2, ngx_uint_t type, ngx_uint_t flags,
+                           ngx_uint_t sid, u_char *p, size_t len) {
+  ngx_akita_h2_stream_t *st;
+  ngx_queue_t *q, *next;
+  ngx_uint_t last, code;
+  size_t pad;
+  u_char *w;
+
+  switch (type) {
+
+  case NGX_AKITA_H2_DATA:
+    /* Give back the window once half of it is used up. */
+    h2->recv_unacked += len;
+    if (h2->recv_unacked >= NGX_AKITA_H2_MAX_WINDOW / 2) {
+      w = ngx_akita_h2_control(h2, NGX_AKITA_H2_FRAME_HEADER + 4);
+      if (w == NULL) {
+        return NGX_ERROR;
+      }
+      w = ngx_akita_h2_frame(w, 4, NGX_AKITA_H2_WINDOW_UPDATE, 0, 0);
+      (void) ngx_akita_h2_put_uint32(w, h2->recv_unacked);
+      h2->recv_unacked = 0;
+    }
+
+    if (flags & NGX_AKITA_H2_END_STREAM) {
+      st = ngx_akita_h2_find_stream(h2, sid);
+      if (st != NULL) {
+        return ngx_akita_h2_end_stream(h2, st);
+      }
+    }
+    return NGX_OK;
+
+  case NGX_AKITA_H2_HEADERS:
+    if (flags & NGX_AKITA_H2_PADDED) {
+      if (len < 1) {
+        return NGX_ERROR;
+      }
+      pad = *p++;
+      len--;
+      if (pad > len) {
+        return NGX_ERROR;
+      }
+      len -= pad;
+    }
+
+    if (flags & NGX_AKITA_H2_PRIORITY_FLAG) {
+      if (len < 5) {
+        return NGX_ERROR;
+      }
+      p += 5;
+      len -= 5;
+    }
+
+    h2->hpack_len = 0;
+    h2->hpack_stream = sid;
+    h2->hpack_end_stream = flags & NGX_AKITA_H2_END_STREAM;
+    /* fall through */
+
+  case NGX_AKITA_H2_CONTINUATION:
+    if (sid != h2->hpack_stream || h2->hpack_len + len > NGX_AKITA_H2_HPACK_SIZE) {
+      return NGX_ERROR;
+    }
+    p = ngx_cpymem(h2->hpack + h2->hpack_len, p, len);
+    h2->hpack_len += len;
+
+    if (!(flags & NGX_AKITA_H2_END_HEADERS)) {
+      return NGX_OK;
+    }
+
+    st = ngx_akita_h2_find_stream(h2, sid);
+    if (st == NULL) {
+      return NGX_OK;
+    }
+
+    /* Only the first header block has a status; later ones are trailers.
+     * A status we can't find is treated as a failed call. */
+    if (st->status == 0) {
+      (void) ngx_akita_h2_parse_status(h2->hpack, h2->hpack + h2->hpack_len, &st->status);
+    }
+
+    if (h2->hpack_end_stream) {
+      return ngx_akita_h2_end_stream(h2, st);
+    }
+    return NGX_OK;
+
+  case NGX_AKITA_H2_RST_STREAM:
+    if (len != 4) {
+      return NGX_ERROR;
+    }
+
+    st = ngx_akita_h2_find_stream(h2, sid);
+    if (st != NULL) {
+      code = ngx_akita_h2_get_uint32(p);
+      ngx_log_error(NGX_LOG_INFO, h2->peer.connection->log, 0,
+                    "Akita agent reset stream %ui with error %ui", sid, code);
+      ngx_akita_h2_finish_stream(h2, st, code == NGX_AKITA_H2_REFUSED_STREAM);
+    }
+    return NGX_OK;
+
+  case NGX_AKITA_H2_SETTINGS:
+    if (flags & NGX_AKITA_H2_ACK) {
+      return NGX_OK;
+    }
+
+    if (len % 6 != 0 || ngx_akita_h2_process_settings(h2, p, len) != NGX_OK) {
+      return NGX_ERROR;
+    }
+
+    w = ngx_akita_h2_control(h2, NGX_AKITA_H2_FRAME_HEADER);
+    if (w == NULL) {
+      return NGX_ERROR;
+    }
+    (void) ngx_akita_h2_frame(w, 0, NGX_AKITA_H2_SETTINGS, NGX_AKITA_H2_ACK, 0);
+    return NGX_OK;
+
+  case NGX_AKITA_H2_PING:
+    if (len != 8) {
+      return NGX_ERROR;
+    }
+    if (flags & NGX_AKITA_H2_ACK) {
+      return NGX_OK;
+    }
+
+    w = ngx_akita_h2_control(h2, NGX_AKITA_H2_FRAME_HEADER + 8);
+    if (w == NULL) {
+      return NGX_ERROR;
+    }
+    w = ngx_akita_h2_frame(w, 8, NGX_AKITA_H2_PING, NGX_AKITA_H2_ACK, 0);
+    ngx_memcpy(w, p, 8);
+    return NGX_OK;
+
+  case NGX_AKITA_H2_GOAWAY:
+    if (len < 8) {
+      return NGX_ERROR;
+    }
+
+    /* Streams after the last one the agent saw can be sent again on a
+     * new connection. */
+    last = ngx_akita_h2_get_uint32(p) & 0x7fffffff;
+    h2->goaway = 1;
+
+    for (q = ngx_queue_head(&h2->streams);
+         q != ngx_queue_sentinel(&h2->streams);
+         q = next) {
+      next = ngx_queue_next(q);
+      st = ngx_queue_data(q, ngx_akita_h2_stream_t, queue);
+      if (st->id > last) {
+        ngx_akita_h2_finish_stream(h2, st, 1);
+      }
+    }
+    return NGX_OK;
+
+  case NGX_AKITA_H2_WINDOW_UPDATE:
+    if (len != 4) {
+      return NGX_ERROR;
+    }
+
+    if (sid == 0) {
+      h2->send_window += ngx_akita_h2_get_uint32(p) & 0x7fffffff;
+    } else {
+      st = ngx_akita_h2_find_stream(h2, sid);
+      if (st != NULL) {
+        st->window += ngx_akita_h2_get_uint32(p) & 0x7fffffff;
+      }
+    }
+    return NGX_OK;
+
+  default:
+    /* PRIORITY, and anything we don't know about */
+    return NGX_OK;
+  }
+}
+
+/* Apply the agent's settings. */
+static ngx_int_t
+ngx_akita_h2_process_settings(ngx_akita_h2_t *h2, u_char *p, size_t len) {
+  ngx_akita_h2_stream_t *st;
+  ngx_uint_t id;
+  ngx_queue_t *q;
+  uint32_t value;
+  ssize_t delta;
+
+  for ( ; len > 0; p += 6, len -= 6) {
+    id = (p[0] << 8) | p[1];
+    value = ngx_akita_h2_get_uint32(p + 2);
+
+    switch (id) {
+
+    case NGX_AKITA_H2_HEADER_TABLE_SIZE:
+      value = ngx_min(value, NGX_AKITA_H2_TABLE_SIZE);
+      if (value != h2->table_size) {
+        h2->table_size = value;
+        h2->nentries = 0;
+        h2->table_used = 0;
+        h2->table_reset = 1;
+      }
+      break;
+
+    case NGX_AKITA_H2_MAX_CONCURRENT_STREAMS:
+      h2->max_streams = value;
+      break;
+
+    case NGX_AKITA_H2_INITIAL_WINDOW_SIZE:
+      if (value > NGX_AKITA_H2_MAX_WINDOW) {
+        return NGX_ERROR;
+      }
+
+      delta = (ssize_t) value - h2->initial_window;
+      for (q = ngx_queue_head(&h2->streams);
+           q != ngx_queue_sentinel(&h2->streams);
+           q = ngx_queue_next(q)) {
+        st = ngx_queue_data(q, ngx_akita_h2_stream_t, queue);
+        st->window += delta;
+      }
+      h2->initial_window = value;
+      break;
+
+    case NGX_AKITA_H2_MAX_FRAME_SIZE:
+      if (value < 16384 || value > 16777215) {
+        return NGX_ERROR;
+      }
+      h2->max_frame = value;
+      break;
+    }
+  }
+
+  return NGX_OK;
+}
+
+/*
+ * Decode a :status value of three digits, which may be Huffman coded. In
+ * the HPACK Huffman code, '0' to '2' are the 5-bit codes 00000 to 00010
+ * and '3' to '9' are the 6-bit codes 011001 to 011111.
+ */
+static ngx_int_t
+ngx_akita_h2_parse_status_value(u_char *p, size_t len, ngx_flag_t huffman, ngx_uint_t *status) {
+  ngx_uint_t i, bits, nbits, code, digit;
+  ngx_int_t n;
+
+  if (!huffman) {
+    n = ngx_atoi(p, len);
+    if (len != 3 || n == NGX_ERROR) {
+      return NGX_ERROR;
+    }
+    *status = n;
+    return NGX_OK;
+  }
+
+  bits = 0;
+  nbits = 0;
+  *status = 0;
+
+  for (i = 0; i < 3; i++) {
+    while (nbits < 6 && len > 0) {
+      bits = (bits << 8) | *p++;
+      nbits += 8;
+      len--;
+    }
+
+    if (nbits < 5) {
+      return NGX_ERROR;
+    }
+
+    code = (bits >> (nbits - 5)) & 0x1f;
+    if (code <= 2) {
+      digit = code;
+      nbits -= 5;
+    } else {
+      if (nbits < 6) {
+        return NGX_ERROR;
+      }
+      code = (bits >> (nbits - 6)) & 0x3f;
+      if (code < 0x19 || code > 0x1f) {
+        return NGX_ERROR;
+      }
+      digit = code - 0x19 + 3;
+      nbits -= 6;
+    }
+
+    bits &= (1 << nbits) - 1;
+    *status = *status * 10 + digit;
+  }
+
+  return NGX_OK;
+}
+
+/* Find the :status in a response header block. We told the agent not to
+ * use a dynamic table, so every header is either in the static table or
+ * a literal. */
+static ngx_int_t
+ngx_akita_h2_parse_status(u_char *p, u_char *end, ngx_uint_t *status) {
+  ngx_uint_t index, len;
+  ngx_flag_t huffman;
+
+  while (p < end) {
+    if (*p & 0x80) {
+      /* Indexed header field */
+      if (ngx_akita_h2_parse_int(&p, end, 7, &index) != NGX_OK) {
+        return NGX_ERROR;
+      }
+      if (index >= NGX_AKITA_H2_STATUS_FIRST && index <= NGX_AKITA_H2_STATUS_LAST) {
+        *status = ngx_akita_h2_static_status[index - NGX_AKITA_H2_STATUS_FIRST];
+        return NGX_OK;
+      }
+      continue;
+    }
+
+    if ((*p & 0xe0) == 0x20) {
+      /* Dynamic table size update */
+      if (ngx_akita_h2_parse_int(&p, end, 5, &index) != NGX_OK) {
+        return NGX_ERROR;
+      }
+      continue;
+    }
+
+    /* Literal, with a 6-bit index if it is to be indexed, else 4 bits */
+    if (ngx_akita_h2_parse_int(&p, end, (*p & 0xc0) == 0x40 ? 6 : 4, &index) != NGX_OK) {
+      return NGX_ERROR;
+    }
+
+    if (index == 0) {
+      /* Skip a literal name. */
+      if (ngx_akita_h2_parse_int(&p, end, 7, &len) != NGX_OK
+          || len > (ngx_uint_t) (end - p)) {
+        return NGX_ERROR;
+      }
+      p += len;
+    }
+
+    if (p == end) {
+      return NGX_ERROR;
+    }
+    huffman = *p & 0x80;
+    if (ngx_akita_h2_parse_int(&p, end, 7, &len) != NGX_OK
+        || len > (ngx_uint_t) (end - p)) {
+      return NGX_ERROR;
+    }
+
+    if (index >= NGX_AKITA_H2_STATUS_FIRST && index <= NGX_AKITA_H2_STATUS_LAST) {
+      return ngx_akita_h2_parse_status_value(p, len, huffman, status);
+    }
+    p += len;
+  }
+
+  return NGX_ERROR;
+}
+
+static ngx_akita_h2_stream_t *
+ngx_akita_h2_find_stream(ngx_akita_h2_t *h2, ngx_uint_t sid) {
+  ngx_akita_h2_stream_t *st;
+  ngx_queue_t *q;
+
+  for (q = ngx_queue_head(&h2->streams);
+       q != ngx_queue_sentinel(&h2->streams);
+       q = ngx_queue_next(q)) {
+    st = ngx_queue_data(q, ngx_akita_h2_stream_t, queue);
+    if (st->id == sid) {
+      return st;
+    }
+  }
+
+  return NULL;
+}
+
+/* The agent has answered the call on a stream. If it did so before we
+ * sent all of the body, tell it we won't send the rest. */
+static ngx_int_t
+ngx_akita_h2_end_stream(ngx_akita_h2_t *h2, ngx_akita_h2_stream_t *st) {
+  u_char *w;
+
+  if (st->sent < st->message->body_len) {
+    w = ngx_akita_h2_control(h2, NGX_AKITA_H2_FRAME_HEADER + 4);
+    if (w == NULL) {
+      return NGX_ERROR;
+    }
+    w = ngx_akita_h2_frame(w, 4, NGX_AKITA_H2_RST_STREAM, 0, st->id);
+    (void) ngx_akita_h2_put_uint32(w, NGX_AKITA_H2_CANCEL);
+  }
+
+  ngx_akita_h2_finish_stream(h2, st, 0);
+  return NGX_OK;
+}
+
+/* A stream is done. Record the outcome of its call, or if retry is set
+ * (and the call hasn't been retried already), queue it to be sent again. */
+static void
+ngx_akita_h2_finish_stream(ngx_akita_h2_t *h2, ngx_akita_h2_stream_t *st, ngx_flag_t retry) {
+  ngx_akita_sender_t *s = h2->sender;
+  ngx_akita_message_t *msg = st->message;
+
+  ngx_queue_remove(&st->queue);
+  h2->nstreams--;
+
+  if (retry && !msg->retried) {
+    msg->retried = 1;
+    ngx_queue_insert_head(&s->pending, &msg->queue);
+    s->pending_bytes += msg->len;
+  } else {
+    ngx_akita_admission_latency(ngx_current_msec - msg->queued);
+    if (st->status == NGX_HTTP_OK) {
+      ngx_http_akita_agent_succeeded(s->agent);
+    } else {
+      ngx_log_error(NGX_LOG_WARN, h2->peer.connection->log, 0,
+                    "Call to Akita agent failed, HTTP status code %ui",
+                    st->status);
+      ngx_http_akita_agent_failed(s->agent, h2->peer.connection->log);
+    }
+    h2->completed++;
+    ngx_free(msg);
+  }
+
+  ngx_free(st);
+}
+
+/* Close the connection. Calls still in flight are sent again on a new
+ * connection if this one had been working, or else dropped; if failed
+ * is set, dropping them counts as a failure of the agent. */
+static void
+ngx_akita_h2_close(ngx_akita_h2_t *h2, ngx_flag_t failed) {
+  ngx_akita_sender_t *s = h2->sender;
+  ngx_akita_h2_stream_t *st;
+  ngx_akita_message_t *msg;
+  ngx_uint_t dropped;
+  ngx_queue_t *q;
+
+  dropped = 0;
+  while (!ngx_queue_empty(&h2->streams)) {
+    /* Requeue from the back, so the calls keep their order. */
+    q = ngx_queue_last(&h2->streams);
+    ngx_queue_remove(q);
+    st = ngx_queue_data(q, ngx_akita_h2_stream_t, queue);
+    msg = st->message;
+
+    if (h2->completed > 0 && !msg->retried) {
+      msg->retried = 1;
+      ngx_queue_insert_head(&s->pending, &msg->queue);
+      s->pending_bytes += msg->len;
+    } else {
+      ngx_akita_sender_drop(s, msg);
+      dropped++;
+    }
+    ngx_free(st);
+  }
+
+  if (failed && (dropped > 0 || h2->completed == 0)) {
+    ngx_http_akita_agent_failed(s->agent, s->log);
+  }
+
+  ngx_close_connection(h2->peer.connection);
+  s->h2 = NULL;
+  ngx_free(h2);
+
+  ngx_akita_h2_dispatch(s);
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2023 Akita Software
+ */
+
+#ifndef _AKITA_NGX_MODULE_AKITA_SENDER_H_INCLUDED
+#define _AKITA_NGX_MODULE_AKITA_SENDER_H_INCLUDED
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+/*
+ * A per-worker sender that delivers calls to the Akita agent over its own
+ * connections, instead of as subrequests of the request being mirrored.
+ * Witnesses can be collected into batches, which are sent as a single call
+ * once they reach akita_batch_size or when akita_batch_interval expires.
+ */
+
+/* The kinds of witness sent to the agent. */
+typedef enum {
+  ngx_akita_witness_request = 0,
+  ngx_akita_witness_response,
+  ngx_akita_witness_combined      /* A request and its response together */
+} ngx_akita_witness_kind_e;
+
+/* Resolve the agent's address so the sender can connect to it. */
+ngx_int_t
+ngx_akita_sender_configure(ngx_conf_t *cf, ngx_http_akita_agent_t *agent);
+
+/* Set up a sender for each agent in a newly started worker. */
+ngx_int_t
+ngx_akita_sender_init_process(ngx_cycle_t *cycle);
+
+/*
+ * Send a single call to the agent at the given path, with a body of the
+ * given media type. The body is copied, so it may be freed once this
+ * returns.
+ */
+ngx_int_t
+ngx_akita_sender_send(ngx_http_akita_agent_t *agent,
+                      ngx_str_t *path,
+                      ngx_str_t *content_type,
+                      ngx_chain_t *body,
+                      size_t content_length);
+
+/*
+ * Add a witness (a JSON object held in body) to the agent's current batch.
+ * The data is copied, so body may be freed once this returns.
+ */
+ngx_int_t
+ngx_akita_sender_batch(ngx_http_akita_agent_t *agent,
+                       ngx_akita_witness_kind_e kind,
+                       ngx_chain_t *body,
+                       size_t content_length);
+
+/*
+ * How full the agent's queue of calls waiting to be sent is, as a
+ * percentage of the most this worker will hold.
+ */
+ngx_uint_t
+ngx_akita_sender_load(ngx_http_akita_agent_t *agent);
+
+#endif /* _AKITA_NGX_MODULE_AKITA_SENDER_H_INCLUDED */
@@ -0,0 +1,151 @@
+/*
+ * Copyright (C) 2023 Akita Software
+ */
+
+#include "ngx_http_akita_module.h"
+#include "akita_stats.h"
+
+static ngx_int_t ngx_akita_stats_init_zone(ngx_shm_zone_t *shm_zone, void *data);
+static ngx_int_t ngx_akita_stats_handler(ngx_http_request_t *r);
+
+/* A counter reported by akita_status */
+typedef struct {
+  ngx_str_t name;
+  size_t offset;
+} ngx_akita_stats_field_t;
+
+static ngx_akita_stats_field_t ngx_akita_stats_fields[] = {
+  { ngx_string("datagram_sent"), offsetof(ngx_akita_stats_t, datagram_sent) },
+  { ngx_string("datagram_truncated"), offsetof(ngx_akita_stats_t, datagram_truncated) },
+  { ngx_string("datagram_fragmented"), offsetof(ngx_akita_stats_t, datagram_fragmented) },
+  { ngx_string("datagram_dropped"), offsetof(ngx_akita_stats_t, datagram_dropped) },
+  { ngx_string("sender_dropped"), offsetof(ngx_akita_stats_t, sender_dropped) },
+  { ngx_string("shed"), offsetof(ngx_akita_stats_t, shed) },
+  { ngx_string("degraded"), offsetof(ngx_akita_stats_t, degraded) },
+  { ngx_string("unsampled"), offsetof(ngx_akita_stats_t, unsampled) },
+  { ngx_string("over_budget"), offsetof(ngx_akita_stats_t, over_budget) },
+  { ngx_null_string, 0 }
+};
+
+static ngx_str_t ngx_akita_stats_zone_name = ngx_string("akita_stats");
+
+ngx_int_t
+ngx_akita_stats_add_zone(ngx_conf_t *cf, ngx_http_akita_main_conf_t *amcf) {
+  ngx_shm_zone_t *shm_zone;
+
+  shm_zone = ngx_shared_memory_add(cf, &ngx_akita_stats_zone_name,
+                                   8 * ngx_pagesize, &ngx_http_akita_module);
+  if (shm_zone == NULL) {
+    return NGX_ERROR;
+  }
+
+  shm_zone->init = ngx_akita_stats_init_zone;
+  amcf->stats_zone = shm_zone;
+  return NGX_OK;
+}
+
+/* Allocate the counters, or keep the ones from before a reload. */
+static ngx_int_t
+ngx_akita_stats_init_zone(ngx_shm_zone_t *shm_zone, void *data) {
+  ngx_slab_pool_t *shpool;
+
+  if (data) {
+    shm_zone->data = data;
+    return NGX_OK;
+  }
+
+  shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+  if (shm_zone->shm.exists) {
+    shm_zone->data = shpool->data;
+    return NGX_OK;
+  }
+
+  shm_zone->data = ngx_slab_calloc(shpool, sizeof(ngx_akita_stats_t));
+  if (shm_zone->data == NULL) {
+    return NGX_ERROR;
+  }
+  shpool->data = shm_zone->data;
+
+  return NGX_OK;
+}
+
+ngx_akita_stats_t *
+ngx_akita_stats_get(ngx_http_request_t *r) {
+  ngx_http_akita_main_conf_t *amcf;
+
+  amcf = ngx_http_get_module_main_conf(r, ngx_http_akita_module);
+  if (amcf->stats_zone == NULL) {
+    return NULL;
+  }
+  return amcf->stats_zone->data;
+}
+
+char *
+ngx_akita_stats_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+  ngx_http_core_loc_conf_t *clcf;
+
+  clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+  clcf->handler = ngx_akita_stats_handler;
+  return NGX_CONF_OK;
+}
+
+/* Report the counters as a JSON object. */
+static ngx_int_t
+ngx_akita_stats_handler(ngx_http_request_t *r) {
+  ngx_akita_stats_field_t *field;
+  ngx_akita_stats_t *stats;
+  ngx_chain_t out;
+  ngx_buf_t *b;
+  size_t len;
+  ngx_int_t rc;
+
+  if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+    return NGX_HTTP_NOT_ALLOWED;
+  }
+
+  rc = ngx_http_discard_request_body(r);
+  if (rc != NGX_OK) {
+    return rc;
+  }
+
+  stats = ngx_akita_stats_get(r);
+  if (stats == NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  len = sizeof("{}\n") - 1;
+  for (field = ngx_akita_stats_fields; field->name.len; field++) {
+    len += sizeof("\"\":,") - 1 + field->name.len + NGX_ATOMIC_T_LEN;
+  }
+
+  b = ngx_create_temp_buf(r->pool, len);
+  if (b == NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  *b->last++ = '{';
+  for (field = ngx_akita_stats_fields; field->name.len; field++) {
+    b->last = ngx_sprintf(b->last, "%s\"%V\":%uA",
+                          field == ngx_akita_stats_fields ? "" : ",",
+                          &field->name,
+                          *(ngx_atomic_t *) ((u_char *) stats + field->offset));
+  }
+  *b->last++ = '}';
+  *b->last++ = LF;
+  b->last_buf = (r == r->main) ? 1 : 0;
+  b->last_in_chain = 1;
+
+  r->headers_out.status = NGX_HTTP_OK;
+  r->headers_out.content_length_n = b->last - b->pos;
+  ngx_str_set(&r->headers_out.content_type, "application/json");
+  r->headers_out.content_type_len = r->headers_out.content_type.len;
+
+  rc = ngx_http_send_header(r);
+  if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+    return rc;
+  }
+
+  out.buf = b;
+  out.next = NULL;
+  return ngx_http_output_filter(r, &out);
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2023 Akita Software
+ */
+
+#ifndef _AKITA_NGX_MODULE_AKITA_STATS_H_INCLUDED
+#define _AKITA_NGX_MODULE_AKITA_STATS_H_INCLUDED
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+/*
+ * Counters shared by all workers, kept in a shared memory zone so they
+ * survive configuration reloads. They are reported by the akita_status
+ * handler.
+ */
+typedef struct {
+  /* Datagram transport (see akita_datagram.c) */
+  ngx_atomic_t datagram_sent;        /* Witnesses sent */
+  ngx_atomic_t datagram_truncated;   /* Witnesses cut short to fit a datagram */
+  ngx_atomic_t datagram_fragmented;  /* Witnesses split over several datagrams */
+  ngx_atomic_t datagram_dropped;     /* Witnesses not sent at all */
+
+  /* Detached delivery (see akita_sender.c) */
+  ngx_atomic_t sender_dropped;       /* Calls thrown away without being sent */
+
+  /* Admission control (see akita_admission.c) */
+  ngx_atomic_t shed;                 /* Captures not started, for lack of room */
+  ngx_atomic_t degraded;             /* Captures at less than full fidelity */
+  ngx_atomic_t unsampled;            /* Requests left out by akita_adaptive_rate */
+  ngx_atomic_t over_budget;          /* Requests left out by akita_cpu_budget */
+} ngx_akita_stats_t;
+
+/* Add the shared memory zone for the counters to the configuration. */
+ngx_int_t
+ngx_akita_stats_add_zone(ngx_conf_t *cf, ngx_http_akita_main_conf_t *amcf);
+
+/* Get the counters for a request. NULL if the zone isn't available. */
+ngx_akita_stats_t *
+ngx_akita_stats_get(ngx_http_request_t *r);
+
+/* Implements the 'akita_status' directive. */
+char *
+ngx_akita_stats_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+#endif /* _AKITA_NGX_MODULE_AKITA_STATS_H_INCLUDED */
@@ -4,14 +4,38 @@
 #include "ngx_http_akita_module.h"
 #include <ngx_http_request.h>
 #include "akita_client.h"
+#include "akita_keepalive.h"
+#include "akita_sender.h"
+#include "akita_ring.h"
+#include "akita_datagram.h"
+#include "akita_stats.h"
+#include "akita_health.h"
+#include "akita_admission.h"
+#include "akita_budget.h"
+#include "akita_escape.h"
+#include "akita_base64.h"
 
 static ngx_int_t ngx_http_akita_subrequest_callback(ngx_http_request_t *r, void * data, ngx_int_t rc );
+static void * ngx_http_akita_create_main_conf(ngx_conf_t *cf);
+static char * ngx_http_akita_init_main_conf(ngx_conf_t *cf, void *conf);
 static void * ngx_http_akita_create_loc_conf(ngx_conf_t *cf);
 static char * ngx_http_akita_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child);
-static char * ngx_http_akita_create_upstream(ngx_conf_t *cf, ngx_http_akita_loc_conf_t *akita_conf, ngx_str_t host);
+static char * ngx_http_akita_create_agents(ngx_conf_t *cf, ngx_http_akita_loc_conf_t *akita_conf,
+                                          ngx_str_t *addresses, ngx_uint_t n);
+static ngx_http_akita_agent_t * ngx_http_akita_add_agent(ngx_conf_t *cf, ngx_str_t host);
+static char * ngx_http_akita_agent_probe(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static int ngx_libc_cdecl ngx_http_akita_cmp_points(const void *one, const void *two);
 static ngx_int_t ngx_http_akita_precontent_handler(ngx_http_request_t *r);
 static ngx_int_t ngx_http_akita_response_header_filter(ngx_http_request_t *r);
 static ngx_int_t ngx_http_akita_response_body_filter(ngx_http_request_t *r, ngx_chain_t *chain);
+static ngx_int_t ngx_http_akita_request_body_filter(ngx_http_request_t *r, ngx_chain_t *in);
+static ngx_int_t ngx_http_akita_log_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_akita_log_response(ngx_http_request_t *r, ngx_http_akita_ctx_t *ctx,
+                                             ngx_http_akita_loc_conf_t *akita_config);
+static void ngx_http_akita_check_budget(ngx_http_akita_ctx_t *ctx, size_t copied);
+static ngx_http_akita_ctx_t * ngx_http_akita_log_ctx(ngx_http_request_t *r);
+static ngx_int_t ngx_http_akita_copy_response_body(ngx_http_request_t *r, ngx_http_akita_ctx_t *ctx,
+                                                   ngx_http_akita_loc_conf_t *akita_config, ngx_buf_t *buf);
 static void ngx_http_akita_response_complete(ngx_http_request_t *t, ngx_http_akita_ctx_t *ctx,
                                              ngx_http_akita_loc_conf_t *akita_config);
 static ngx_int_t ngx_http_akita_init(ngx_conf_t *cf);
@@ -20,18 +44,117 @@ static ngx_int_t ngx_http_akita_agent_create_request(ngx_http_request_t *r);
 static ngx_int_t ngx_http_akita_agent_reinit_request(ngx_http_request_t *r);
 static ngx_int_t ngx_http_akita_agent_process_status_line(ngx_http_request_t *r);
 static ngx_int_t ngx_http_akita_agent_process_headers(ngx_http_request_t *r);
+static ngx_flag_t ngx_http_akita_agent_header_is(ngx_http_request_t *r, ngx_str_t *lowcase_name);
+static ngx_table_elt_t * ngx_http_akita_agent_copy_header(ngx_http_request_t *r, ngx_str_t *lowcase_name);
+static ngx_int_t ngx_http_akita_agent_input_filter_init(void *data);
+static ngx_int_t ngx_http_akita_agent_input_filter(void *data, ssize_t bytes);
 static void ngx_http_akita_agent_abort_request(ngx_http_request_t *r);
 static void ngx_http_akita_agent_finalize_request(ngx_http_request_t *r, ngx_int_t rc);
-static ngx_int_t ngx_http_akita_init_backoff(ngx_cycle_t *cycle);
-static ngx_flag_t ngx_http_akita_agent_allowed(void);
-static void ngx_http_akita_agent_succeeded(void);
-static void ngx_http_akita_agent_failed(ngx_log_t *);
+static ngx_int_t ngx_http_akita_init_module(ngx_cycle_t *cycle);
+static ngx_int_t ngx_http_akita_init_process(ngx_cycle_t *cycle);
 
 
 static const ngx_uint_t default_max_body = 1 * 1024 * 1024;
 static const char default_agent_address[] = "localhost:50800";
 static const char *upstream_module_name = "akita";
 static const in_port_t akita_agent_default_port = 50080;
+static const ngx_msec_t default_batch_interval = 100;
+static const size_t default_ring_size = 64 * 1024 * 1024;
+static const ngx_int_t default_probe_rate = 1;
+static const ngx_int_t default_probe_successes = 3;
+
+/* Points on the consistent-hash ring for each agent */
+#define NGX_HTTP_AKITA_AGENT_POINTS  160
+
+/* Host headers for calls to the agent over TCP and over a Unix socket */
+static ngx_str_t agent_inet_host = ngx_string("api.akitasoftware.com");
+static ngx_str_t agent_unix_host = ngx_string("localhost");
+
+/* Values for the akita_body_encoding directive */
+static ngx_conf_enum_t ngx_http_akita_body_encodings[] = {
+  { ngx_string("string"), NGX_HTTP_AKITA_BODY_STRING },
+  { ngx_string("base64"), NGX_HTTP_AKITA_BODY_BASE64 },
+  { ngx_string("auto"), NGX_HTTP_AKITA_BODY_AUTO },
+  { ngx_null_string, 0 }
+};
+
+/* Values for the akita_format directive */
+static ngx_conf_enum_t ngx_http_akita_formats[] = {
+  { ngx_string("json"), NGX_HTTP_AKITA_FORMAT_JSON },
+  { ngx_string("binary"), NGX_HTTP_AKITA_FORMAT_BINARY },
+  { ngx_null_string, 0 }
+};
+
+/* Values for the akita_delivery directive */
+static ngx_conf_enum_t ngx_http_akita_delivery_modes[] = {
+  { ngx_string("subrequest"), NGX_HTTP_AKITA_DELIVERY_SUBREQUEST },
+  { ngx_string("detached"), NGX_HTTP_AKITA_DELIVERY_DETACHED },
+  { ngx_string("ring"), NGX_HTTP_AKITA_DELIVERY_RING },
+  { ngx_string("datagram"), NGX_HTTP_AKITA_DELIVERY_DATAGRAM },
+  { ngx_null_string, 0 }
+};
+
+/* Create the http-wide Akita configuration.
+ *
+ * Returns the configuration on success; NULL otherwise.
+ */
+static void *
+ngx_http_akita_create_main_conf(ngx_conf_t *cf) {
+  ngx_http_akita_main_conf_t *conf;
+
+  conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_akita_main_conf_t));
+  if (conf == NULL) {
+    return NULL;
+  }
+
+  if (ngx_array_init(&conf->agents, cf->pool, 4, sizeof(ngx_http_akita_agent_t *)) != NGX_OK) {
+    return NULL;
+  }
+
+  conf->keepalive = NGX_CONF_UNSET;
+  conf->keepalive_timeout = NGX_CONF_UNSET_MSEC;
+  conf->batch_size = NGX_CONF_UNSET_SIZE;
+  conf->batch_interval = NGX_CONF_UNSET_MSEC;
+  conf->http2 = NGX_CONF_UNSET;
+  conf->probe_rate = NGX_CONF_UNSET;
+  conf->probe_successes = NGX_CONF_UNSET;
+  conf->max_in_flight = NGX_CONF_UNSET_UINT;
+  conf->max_in_flight_size = NGX_CONF_UNSET_SIZE;
+  conf->ring_size = NGX_CONF_UNSET_SIZE;
+  conf->ring_overflow = NGX_CONF_UNSET_UINT;
+
+  return conf;
+}
+
+/* Fill in defaults for the http-wide configuration. This runs after the
+ * upstream module has initialized every upstream defined so far, but before
+ * any locations are merged. */
+static char *
+ngx_http_akita_init_main_conf(ngx_conf_t *cf, void *conf) {
+  ngx_http_akita_main_conf_t *amcf = conf;
+
+  ngx_akita_keepalive_init_conf(amcf);
+  ngx_conf_init_size_value(amcf->batch_size, 0);
+  ngx_conf_init_msec_value(amcf->batch_interval, default_batch_interval);
+  ngx_conf_init_value(amcf->http2, 0);
+  ngx_conf_init_value(amcf->probe_rate, default_probe_rate);
+  ngx_conf_init_value(amcf->probe_successes, default_probe_successes);
+  ngx_conf_init_uint_value(amcf->max_in_flight, 0);
+  ngx_conf_init_size_value(amcf->max_in_flight_size, 0);
+  ngx_conf_init_size_value(amcf->ring_size, default_ring_size);
+  ngx_conf_init_uint_value(amcf->ring_overflow, NGX_AKITA_RING_DROP_NEWEST);
+  amcf->upstreams_initialized = 1;
+
+  if (ngx_akita_stats_add_zone(cf, amcf) != NGX_OK) {
+    return NGX_CONF_ERROR;
+  }
+
+  if (ngx_akita_health_add_zone(cf, amcf) != NGX_OK) {
+    return NGX_CONF_ERROR;
+  }
+
+  return NGX_CONF_OK;
+}
 
 /* Create the Akita configuration.
  *
@@ -48,6 +171,13 @@ ngx_http_akita_create_loc_conf(ngx_conf_t *cf) {
 
   conf->max_body_size = NGX_CONF_UNSET_SIZE;
   conf->enabled = NGX_CONF_UNSET;
+  conf->delivery = NGX_CONF_UNSET_UINT;
+  conf->combined = NGX_CONF_UNSET;
+  conf->stream_request_body = NGX_CONF_UNSET;
+  conf->log_phase = NGX_CONF_UNSET;
+  conf->embed_json = NGX_CONF_UNSET;
+  conf->body_encoding = NGX_CONF_UNSET_UINT;
+  conf->format = NGX_CONF_UNSET_UINT;
   ngx_str_set(&conf->upstream.module, upstream_module_name);
   
   conf->upstream.hide_headers = NGX_CONF_UNSET_PTR;
@@ -62,10 +192,53 @@ ngx_http_akita_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child) {
   ngx_hash_init_t hash;
   ngx_http_akita_loc_conf_t *prev = parent;
   ngx_http_akita_loc_conf_t *conf = child;
+  ngx_http_akita_main_conf_t *amcf;
+  ngx_uint_t i;
+  char *rv;
   
+  /* Batches can only be sent detached, so that is the default with batching.
+   * Nor can a subrequest be made from the log phase. */
+  amcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_akita_module);
+  ngx_conf_merge_value(conf->log_phase, prev->log_phase, 0);
+  ngx_conf_merge_uint_value(conf->delivery, prev->delivery,
+                            amcf->batch_size > 0 || conf->log_phase
+                            ? NGX_HTTP_AKITA_DELIVERY_DETACHED
+                            : NGX_HTTP_AKITA_DELIVERY_SUBREQUEST);
+  if (amcf->batch_size > 0 && conf->delivery != NGX_HTTP_AKITA_DELIVERY_DETACHED) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "\"akita_batch_size\" requires \"akita_delivery detached\"");
+    return NGX_CONF_ERROR;
+  }
+  ngx_conf_merge_uint_value(conf->format, prev->format, NGX_HTTP_AKITA_FORMAT_JSON);
+  if (amcf->batch_size > 0 && conf->format != NGX_HTTP_AKITA_FORMAT_JSON) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "\"akita_batch_size\" requires \"akita_format json\"");
+    return NGX_CONF_ERROR;
+  }
+  if (conf->log_phase && conf->delivery == NGX_HTTP_AKITA_DELIVERY_SUBREQUEST) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "\"akita_log_phase\" cannot be used with \"akita_delivery subrequest\"");
+    return NGX_CONF_ERROR;
+  }
+  if (conf->delivery == NGX_HTTP_AKITA_DELIVERY_RING && amcf->ring_path.len == 0) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "\"akita_delivery ring\" requires \"akita_ring\"");
+    return NGX_CONF_ERROR;
+  }
+  if (conf->delivery == NGX_HTTP_AKITA_DELIVERY_DATAGRAM && amcf->datagram == NULL) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "\"akita_delivery datagram\" requires \"akita_datagram\"");
+    return NGX_CONF_ERROR;
+  }
+
   ngx_conf_merge_str_value(conf->agent_address, prev->agent_address, default_agent_address);
   ngx_conf_merge_size_value(conf->max_body_size, prev->max_body_size, default_max_body);
   ngx_conf_merge_value(conf->enabled, prev->enabled, 0);
+  ngx_conf_merge_value(conf->combined, prev->combined, 0);
+  ngx_conf_merge_value(conf->stream_request_body, prev->stream_request_body, 0);
+  ngx_conf_merge_value(conf->embed_json, prev->embed_json, 0);
+  ngx_conf_merge_uint_value(conf->body_encoding, prev->body_encoding,
+                            NGX_HTTP_AKITA_BODY_STRING);
 
   /* 
    * There are a whole pile of configuration options available for
@@ -133,26 +306,137 @@ ngx_http_akita_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child) {
   
   if (conf->upstream.upstream == NULL) {
     if (prev->upstream.upstream != NULL) {
-      /* Copy the pointer to the server that was registered earlier! */
+      /* Copy the pointer to the servers that were registered earlier! */
       conf->upstream.upstream = prev->upstream.upstream;
+      conf->agents = prev->agents;
     } else if (conf->enabled) {
       /* Create a new upstream server using the configured address. */
-      return ngx_http_akita_create_upstream(cf, conf, conf->agent_address);
+      rv = ngx_http_akita_create_agents(cf, conf, &conf->agent_address, 1);
+      if (rv != NGX_CONF_OK) {
+        return rv;
+      }
+    }
+  }
+
+  /* Subrequests to each agent need an upstream configuration naming it;
+   * otherwise they are all the same. */
+  if (conf->agents != NULL) {
+    conf->agent_upstreams = ngx_palloc(cf->pool,
+                                       conf->agents->nagents * sizeof(ngx_http_upstream_conf_t));
+    if (conf->agent_upstreams == NULL) {
+      return NGX_CONF_ERROR;
+    }
+
+    for (i = 0; i < conf->agents->nagents; i++) {
+      conf->agent_upstreams[i] = conf->upstream;
+      conf->agent_upstreams[i].upstream = conf->agents->agents[i]->upstream;
+    }
+  }
+
+  return NGX_CONF_OK;
+}
+
+/*
+ * Create the set of agents a location sends to, one for each address, and
+ * the consistent-hash ring used to choose between them.
+ */
+static char *
+ngx_http_akita_create_agents(ngx_conf_t *cf, ngx_http_akita_loc_conf_t *akita_conf,
+                             ngx_str_t *addresses, ngx_uint_t n) {
+  ngx_http_akita_agent_set_t *set;
+  ngx_http_akita_agent_t *agent;
+  ngx_http_akita_point_t *point;
+  ngx_uint_t i, j;
+  u_char buf[NGX_INT_T_LEN];
+  uint32_t hash;
+  size_t len;
+
+  set = ngx_pcalloc(cf->pool, sizeof(ngx_http_akita_agent_set_t));
+  if (set == NULL) {
+    return NGX_CONF_ERROR;
+  }
+
+  set->agents = ngx_palloc(cf->pool, n * sizeof(ngx_http_akita_agent_t *));
+  if (set->agents == NULL) {
+    return NGX_CONF_ERROR;
+  }
+
+  for (i = 0; i < n; i++) {
+    agent = ngx_http_akita_add_agent(cf, addresses[i]);
+    if (agent == NULL) {
+      return NGX_CONF_ERROR;
+    }
+
+    for (j = 0; j < set->nagents; j++) {
+      if (set->agents[j] == agent) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate agent \"%V\"", &addresses[i]);
+        return NGX_CONF_ERROR;
+      }
+    }
+
+    set->agents[set->nagents++] = agent;
+  }
+
+  /* Place each agent at many points on the ring, so that each gets about
+   * the same share, and losing one spreads its share over the rest. */
+  set->points = ngx_palloc(cf->pool,
+                           n * NGX_HTTP_AKITA_AGENT_POINTS * sizeof(ngx_http_akita_point_t));
+  if (set->points == NULL) {
+    return NGX_CONF_ERROR;
+  }
+
+  for (i = 0; i < n; i++) {
+    for (j = 0; j < NGX_HTTP_AKITA_AGENT_POINTS; j++) {
+      len = ngx_sprintf(buf, "-%ui", j) - buf;
+
+      ngx_crc32_init(hash);
+      ngx_crc32_update(&hash, set->agents[i]->address.data, set->agents[i]->address.len);
+      ngx_crc32_update(&hash, buf, len);
+      ngx_crc32_final(hash);
+
+      point = &set->points[set->npoints++];
+      point->hash = hash;
+      point->agent = i;
     }
   }
 
+  ngx_qsort(set->points, set->npoints, sizeof(ngx_http_akita_point_t),
+            ngx_http_akita_cmp_points);
+
+  akita_conf->agents = set;
+  akita_conf->upstream.upstream = set->agents[0]->upstream;
   return NGX_CONF_OK;
 }
 
+static int ngx_libc_cdecl
+ngx_http_akita_cmp_points(const void *one, const void *two) {
+  const ngx_http_akita_point_t *first = one;
+  const ngx_http_akita_point_t *second = two;
+
+  if (first->hash < second->hash) {
+    return -1;
+  }
+  if (first->hash > second->hash) {
+    return 1;
+  }
+  return 0;
+}
+
 /* 
- * Create an upstream destination for communicating with the Akita agent.
+ * Create an upstream destination for communicating with an Akita agent.
  * The host name may include a port number; if not the default port 50080
- * will be used.
+ * will be used. It may also be the path of a Unix domain socket, prefixed
+ * with "unix:". Returns the agent, which is shared with any other location
+ * that names the same address, or NULL on error.
  */
-static char *
-ngx_http_akita_create_upstream(ngx_conf_t *cf,
-                               ngx_http_akita_loc_conf_t *akita_conf, ngx_str_t host) {
+static ngx_http_akita_agent_t *
+ngx_http_akita_add_agent(ngx_conf_t *cf, ngx_str_t host) {
   ngx_url_t u;
+  ngx_http_upstream_srv_conf_t *uscf;
+  ngx_http_akita_main_conf_t *amcf;
+  ngx_http_akita_agent_t *agent, **agents;
+  ngx_uint_t i;
 
   /* Construct a URL to hold the agent address. */
   /* TODO: check for unnecessary http? Or trailing value? */
@@ -165,21 +449,61 @@ ngx_http_akita_create_upstream(ngx_conf_t *cf,
 
   /* Create an upstream for the agent.  The rest of the configuration is filled in
      separately, in ngx_http_akita_merge_loc_conf. */
-  akita_conf->upstream.upstream = ngx_http_upstream_add(cf, &u,
-                                                        NGX_HTTP_UPSTREAM_MAX_FAILS|
-                                                        NGX_HTTP_UPSTREAM_FAIL_TIMEOUT);
-  if (akita_conf->upstream.upstream == NULL) {
-    return NGX_CONF_ERROR;
+  uscf = ngx_http_upstream_add(cf, &u,
+                               NGX_HTTP_UPSTREAM_MAX_FAILS|
+                               NGX_HTTP_UPSTREAM_FAIL_TIMEOUT);
+  if (uscf == NULL) {
+    return NULL;
   }
   /* TODO: I tried configuring the server's max_fails and fail_timeout, but
    * the server array is null at this point. Can we populate it? */
+
+  /* The same address gives back the same upstream; if so, share its agent. */
+  amcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_akita_module);
+  agents = amcf->agents.elts;
+  for (i = 0; i < amcf->agents.nelts; i++) {
+    if (agents[i]->upstream == uscf) {
+      return agents[i];
+    }
+  }
+
+  agent = ngx_pcalloc(cf->pool, sizeof(ngx_http_akita_agent_t));
+  if (agent == NULL) {
+    return NULL;
+  }
+  agent->upstream = uscf;
+  agent->address = host;
+  agent->host = agent_inet_host;
+#if (NGX_HAVE_UNIX_DOMAIN)
+  if (u.family == AF_UNIX) {
+    /* There's no host name to give; use the same one as curl does. */
+    agent->host = agent_unix_host;
+  }
+#endif
+
+  agents = ngx_array_push(&amcf->agents);
+  if (agents == NULL) {
+    return NULL;
+  }
+  *agents = agent;
+
+  if (ngx_akita_keepalive_register(cf, agent) != NGX_OK) {
+    return NULL;
+  }
+
+  /* An upstream created while merging (for the default address) is too
+   * late for the upstream module to initialize, so do it here. */
+  if (amcf->upstreams_initialized
+      && uscf->peer.init_upstream(cf, uscf) != NGX_OK) {
+    return NULL;
+  }
   
-  return NGX_CONF_OK;
+  return agent;
 }
 
 /*
  * Implement the 'akita_agent' configuration directive by creating an
- * upstream to the given hostname.
+ * upstream to each of the given hostnames.
  */
 static char *
 ngx_http_akita_agent(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
@@ -192,17 +516,115 @@ ngx_http_akita_agent(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
   }
   
   value = cf->args->elts;
-  value = &value[1]; /* elts[0] is the directive name, elts[1] is the sole argument */
 
-  return ngx_http_akita_create_upstream(cf, akita_conf, *value);
+  /* elts[0] is the directive name, the rest are addresses */
+  return ngx_http_akita_create_agents(cf, akita_conf, &value[1], cf->args->nelts - 1);
+}
+
+/*
+ * Implement the 'akita_ring' configuration directive:
+ *   akita_ring <path> [size=<size>] [overflow=drop_newest|overwrite_oldest];
+ * The ring itself is created once the configuration has been read.
+ */
+static char *
+ngx_http_akita_ring(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+  ngx_http_akita_main_conf_t *amcf = conf;
+  ngx_str_t *value, s;
+  ngx_uint_t i;
+  ssize_t size;
+
+  if (amcf->ring_path.len) {
+    return "is duplicate";
+  }
+
+  value = cf->args->elts;
+  amcf->ring_path = value[1];
+  if (ngx_conf_full_name(cf->cycle, &amcf->ring_path, 0) != NGX_OK) {
+    return NGX_CONF_ERROR;
+  }
+
+  for (i = 2; i < cf->args->nelts; i++) {
+    if (ngx_strncmp(value[i].data, "size=", 5) == 0) {
+      s.len = value[i].len - 5;
+      s.data = value[i].data + 5;
+
+      size = ngx_parse_size(&s);
+      if (size == NGX_ERROR || size < (ssize_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid ring size \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+      }
+      amcf->ring_size = size;
+      continue;
+    }
+
+    if (ngx_strcmp(value[i].data, "overflow=drop_newest") == 0) {
+      amcf->ring_overflow = NGX_AKITA_RING_DROP_NEWEST;
+      continue;
+    }
+
+    if (ngx_strcmp(value[i].data, "overflow=overwrite_oldest") == 0) {
+      amcf->ring_overflow = NGX_AKITA_RING_OVERWRITE_OLDEST;
+      continue;
+    }
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+    return NGX_CONF_ERROR;
+  }
+
+  return NGX_CONF_OK;
 }
 
+/*
+ * Implement the 'akita_agent_probe' configuration directive:
+ *   akita_agent_probe [rate=<number>] [successes=<number>];
+ */
+static char *
+ngx_http_akita_agent_probe(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+  ngx_http_akita_main_conf_t *amcf = conf;
+  ngx_str_t *value;
+  ngx_uint_t i;
+  ngx_int_t n;
+
+  if (amcf->probe_rate != NGX_CONF_UNSET || amcf->probe_successes != NGX_CONF_UNSET) {
+    return "is duplicate";
+  }
+
+  value = cf->args->elts;
+  for (i = 1; i < cf->args->nelts; i++) {
+    if (ngx_strncmp(value[i].data, "rate=", 5) == 0) {
+      n = ngx_atoi(value[i].data + 5, value[i].len - 5);
+      if (n == NGX_ERROR || n < 1) {
+        goto invalid;
+      }
+      amcf->probe_rate = n;
+      continue;
+    }
+
+    if (ngx_strncmp(value[i].data, "successes=", 10) == 0) {
+      n = ngx_atoi(value[i].data + 10, value[i].len - 10);
+      if (n == NGX_ERROR || n < 1) {
+        goto invalid;
+      }
+      amcf->probe_successes = n;
+      continue;
+    }
+
+  invalid:
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+    return NGX_CONF_ERROR;
+  }
+
+  return NGX_CONF_OK;
+}
 
 /* Configuration directives provided by this module. */
 static ngx_command_t ngx_http_akita_commands[] = {
-  /* Specifies the network address of the akita agent. */
+  /* Specifies the network addresses of the akita agents. */
   { ngx_string("akita_agent"),
-    NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+    NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
     ngx_http_akita_agent,
     NGX_HTTP_LOC_CONF_OFFSET,
     0,
@@ -221,6 +643,146 @@ static ngx_command_t ngx_http_akita_commands[] = {
     NGX_HTTP_LOC_CONF_OFFSET,
     offsetof(ngx_http_akita_loc_conf_t, max_body_size),
     NULL },
+  /* Send to the agent as subrequests, or independently of the request */
+  { ngx_string("akita_delivery"),
+    NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+    ngx_conf_set_enum_slot,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof(ngx_http_akita_loc_conf_t, delivery),
+    &ngx_http_akita_delivery_modes },
+  /* Send requests and responses together */
+  { ngx_string("akita_combined"),
+    NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+    ngx_conf_set_flag_slot,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof(ngx_http_akita_loc_conf_t, combined),
+    NULL },
+  /* Copy request bodies as they are read, instead of reading them first */
+  { ngx_string("akita_stream_request_body"),
+    NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+    ngx_conf_set_flag_slot,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof(ngx_http_akita_loc_conf_t, stream_request_body),
+    NULL },
+  /* Send witnesses once responses are complete, from the log phase */
+  { ngx_string("akita_log_phase"),
+    NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+    ngx_conf_set_flag_slot,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof(ngx_http_akita_loc_conf_t, log_phase),
+    NULL },
+  /* Embed JSON bodies as JSON, rather than as strings */
+  { ngx_string("akita_embed_json"),
+    NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+    ngx_conf_set_flag_slot,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof(ngx_http_akita_loc_conf_t, embed_json),
+    NULL },
+  /* Escape bodies into strings, or base64-encode them */
+  { ngx_string("akita_body_encoding"),
+    NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+    ngx_conf_set_enum_slot,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof(ngx_http_akita_loc_conf_t, body_encoding),
+    &ngx_http_akita_body_encodings },
+  /* Send witnesses as JSON, or in binary frames */
+  { ngx_string("akita_format"),
+    NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+    ngx_conf_set_enum_slot,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof(ngx_http_akita_loc_conf_t, format),
+    &ngx_http_akita_formats },
+  /* Shared-memory ring for akita_delivery ring */
+  { ngx_string("akita_ring"),
+    NGX_HTTP_MAIN_CONF|NGX_CONF_1MORE,
+    ngx_http_akita_ring,
+    NGX_HTTP_MAIN_CONF_OFFSET,
+    0,
+    NULL },
+  /* Unix socket for akita_delivery datagram */
+  { ngx_string("akita_datagram"),
+    NGX_HTTP_MAIN_CONF|NGX_CONF_1MORE,
+    ngx_akita_datagram_conf,
+    NGX_HTTP_MAIN_CONF_OFFSET,
+    0,
+    NULL },
+  /* Report the module's counters */
+  { ngx_string("akita_status"),
+    NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+    ngx_akita_stats_status,
+    0,
+    0,
+    NULL },
+  /* Number of idle connections to the agent each worker keeps open */
+  { ngx_string("akita_agent_keepalive"),
+    NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+    ngx_conf_set_num_slot,
+    NGX_HTTP_MAIN_CONF_OFFSET,
+    offsetof(ngx_http_akita_main_conf_t, keepalive),
+    NULL },
+  /* How long an idle connection to the agent is kept open */
+  { ngx_string("akita_agent_keepalive_timeout"),
+    NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+    ngx_conf_set_msec_slot,
+    NGX_HTTP_MAIN_CONF_OFFSET,
+    offsetof(ngx_http_akita_main_conf_t, keepalive_timeout),
+    NULL },
+  /* Collect witnesses into calls of about this many bytes */
+  { ngx_string("akita_batch_size"),
+    NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+    ngx_conf_set_size_slot,
+    NGX_HTTP_MAIN_CONF_OFFSET,
+    offsetof(ngx_http_akita_main_conf_t, batch_size),
+    NULL },
+  /* Longest time to hold a witness in a batch */
+  { ngx_string("akita_batch_interval"),
+    NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+    ngx_conf_set_msec_slot,
+    NGX_HTTP_MAIN_CONF_OFFSET,
+    offsetof(ngx_http_akita_main_conf_t, batch_interval),
+    NULL },
+  /* Calls let through to a recovering agent */
+  { ngx_string("akita_agent_probe"),
+    NGX_HTTP_MAIN_CONF|NGX_CONF_1MORE,
+    ngx_http_akita_agent_probe,
+    NGX_HTTP_MAIN_CONF_OFFSET,
+    0,
+    NULL },
+  /* Send detached calls to the agent over HTTP/2 */
+  { ngx_string("akita_agent_http2"),
+    NGX_HTTP_MAIN_CONF|NGX_CONF_FLAG,
+    ngx_conf_set_flag_slot,
+    NGX_HTTP_MAIN_CONF_OFFSET,
+    offsetof(ngx_http_akita_main_conf_t, http2),
+    NULL },
+  /* Limit the time each worker spends mirroring */
+  { ngx_string("akita_cpu_budget"),
+    NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+    ngx_akita_budget_conf,
+    NGX_HTTP_MAIN_CONF_OFFSET,
+    0,
+    NULL },
+  /* Adjust the fraction of requests captured to the agents' latency */
+  { ngx_string("akita_adaptive_rate"),
+    NGX_HTTP_MAIN_CONF|NGX_CONF_ANY,
+    ngx_akita_admission_rate_conf,
+    NGX_HTTP_MAIN_CONF_OFFSET,
+    0,
+    NULL },
+  /* Capture less of each request as the load grows */
+  { ngx_string("akita_degrade"),
+    NGX_HTTP_MAIN_CONF|NGX_CONF_ANY,
+    ngx_akita_admission_degrade_conf,
+    NGX_HTTP_MAIN_CONF_OFFSET,
+    0,
+    NULL },
+  /* Limit the captures each worker has in flight */
+  { ngx_string("akita_max_in_flight"),
+    NGX_HTTP_MAIN_CONF|NGX_CONF_1MORE,
+    ngx_akita_admission_conf,
+    NGX_HTTP_MAIN_CONF_OFFSET,
+    0,
+    NULL },
   ngx_null_command
 };
 
@@ -233,12 +795,17 @@ static ngx_http_output_header_filter_pt ngx_http_next_header_filter;
  * once it is done its work.
  */
 static ngx_http_output_body_filter_pt ngx_http_next_body_filter;
+/* The next request-body filter in the chain. */
+static ngx_http_request_body_filter_pt ngx_http_next_request_body_filter;
  
 /* Post-configuration handler for initializing the Akita module. */
 static ngx_int_t
 ngx_http_akita_init(ngx_conf_t *cf) {
   ngx_http_handler_pt *h;
   ngx_http_core_main_conf_t *cmcf;
+  ngx_http_akita_main_conf_t *amcf;
+  ngx_http_akita_agent_t **agents;
+  ngx_uint_t i;
   ngx_int_t rc;
   
   /* Initialize the client settings (just variable indexes for now.) */
@@ -246,6 +813,25 @@ ngx_http_akita_init(ngx_conf_t *cf) {
   if (rc != NGX_OK) {
     return NGX_ERROR;
   }
+
+  /* Detached calls are sent on the sender's own connections, which need
+   * the agents' addresses. */
+  amcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_akita_module);
+  agents = amcf->agents.elts;
+  for (i = 0; i < amcf->agents.nelts; i++) {
+    if (ngx_akita_sender_configure(cf, agents[i]) != NGX_OK) {
+      return NGX_ERROR;
+    }
+  }
+
+  /* The ring is mapped once the configuration has loaded. */
+  if (amcf->ring_path.len) {
+    amcf->ring = ngx_akita_ring_open(cf, &amcf->ring_path,
+                                     amcf->ring_size, amcf->ring_overflow);
+    if (amcf->ring == NULL) {
+      return NGX_ERROR;
+    }
+  }
   
   /* Register our observer in the precontent phase. */
   cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);  
@@ -255,6 +841,13 @@ ngx_http_akita_init(ngx_conf_t *cf) {
   }
   *h = ngx_http_akita_precontent_handler;
 
+  /* And, for akita_log_phase, in the log phase. */
+  h = ngx_array_push(&cmcf->phases[NGX_HTTP_LOG_PHASE].handlers);
+  if (h == NULL) {
+    return NGX_ERROR;
+  }
+  *h = ngx_http_akita_log_handler;
+
   /* Install our header filter */
   ngx_http_next_header_filter = ngx_http_top_header_filter;
   ngx_http_top_header_filter = ngx_http_akita_response_header_filter;
@@ -262,6 +855,10 @@ ngx_http_akita_init(ngx_conf_t *cf) {
   /* Install our body filter */
   ngx_http_next_body_filter = ngx_http_top_body_filter;
   ngx_http_top_body_filter = ngx_http_akita_response_body_filter;
+
+  /* Install our request body filter, for akita_stream_request_body */
+  ngx_http_next_request_body_filter = ngx_http_top_request_body_filter;
+  ngx_http_top_request_body_filter = ngx_http_akita_request_body_filter;
   
   return NGX_OK;  
 }
@@ -269,8 +866,8 @@ ngx_http_akita_init(ngx_conf_t *cf) {
 static ngx_http_module_t ngx_http_akita_module_ctx = {
   NULL, /* pre-configuration */
   ngx_http_akita_init, /* post-configuration */
-  NULL, /* create main configuration */
-  NULL, /* init main configuration */
+  ngx_http_akita_create_main_conf, /* create main configuration */
+  ngx_http_akita_init_main_conf, /* init main configuration */
   NULL, /* create server configuration */
   NULL, /* merge server configuration */
   ngx_http_akita_create_loc_conf, /* create location configuration */
@@ -283,8 +880,8 @@ ngx_module_t ngx_http_akita_module = {
   ngx_http_akita_commands,
   NGX_HTTP_MODULE,
   NULL, /* init master */
-  NULL, /* init module */
-  ngx_http_akita_init_backoff, /* init process */
+  ngx_http_akita_init_module, /* init module */
+  ngx_http_akita_init_process, /* init process */
   NULL, /* init thread */
   NULL, /* exit thread */
   NULL, /* exit process */
@@ -296,6 +893,51 @@ ngx_module_t ngx_http_akita_module = {
 /* API paths for agent */
 static ngx_str_t ngx_http_akita_request_location = ngx_string( "/trace/v1/request" );
 static ngx_str_t ngx_http_akita_response_location = ngx_string( "/trace/v1/response" );
+static ngx_str_t ngx_http_akita_witness_location = ngx_string( "/trace/v1/witness" );
+
+/* Relays a request, whose body (if any) has been read, to the Akita Agent.
+ * If the body was streamed, finish the witness it was copied into. */
+static void
+ngx_http_akita_send_request(ngx_http_request_t *r, ngx_http_akita_ctx_t *ctx,
+                            ngx_http_akita_loc_conf_t *akita_config) {
+  ngx_int_t rc;
+  uint64_t start;
+
+  /* Record (approximate) time of last byte of body, unless the log-phase
+     mode already has a better guess. */
+  if (ctx->request_arrived.tv_sec == 0) {
+    ngx_gettimeofday( &ctx->request_arrived );
+  }
+  ctx->request_sent = 1;
+
+  /* Allocate callback structure from pool */
+  ngx_http_post_subrequest_t *callback = ngx_pcalloc(r->pool, sizeof( ngx_http_post_subrequest_t ));
+  if (callback == NULL) {
+    ngx_log_error( NGX_LOG_ERR, r->connection->log, 0,
+                   "Failed to allocate callback" );    
+    return;
+  }
+  callback->handler = ngx_http_akita_subrequest_callback;
+  callback->data = NULL;
+
+  /* Send the request metadata and body to Akita */
+  if (ngx_http_akita_agents_allowed(akita_config->agents)) {
+    start = ngx_akita_budget_start();
+    ngx_http_akita_check_budget(ctx, ctx->request_body_size);
+    if (ctx->request_body_json != NULL) {
+      rc = ngx_akita_finish_request_body(r, ngx_http_akita_request_location, ctx, akita_config, callback);
+    } else {
+      rc = ngx_akita_send_request_body(r, ngx_http_akita_request_location, ctx, akita_config, callback);
+    }
+    if (rc != NGX_OK) {
+      ngx_log_error( NGX_LOG_ERR, r->connection->log, 0,
+                     "Failed to send request body to Akita agent" );
+    }
+    ngx_akita_budget_stop(start);
+  }
+
+  ctx->request_body_json = NULL;
+}
 
 /* Relays a request to the Akita Agent. To indicate that the we are done
  * processing the request, the status in the request's context is set to
@@ -312,22 +954,10 @@ ngx_http_akita_body_callback(ngx_http_request_t *r) {
     return;
   }
 
-  /* Record (approximate) time of last byte of body */
   ctx = ngx_http_get_module_ctx(r, ngx_http_akita_module );
   if (ctx == NULL) {
     return;
   }
-  ngx_gettimeofday( &ctx->request_arrived );
-
-  /* Allocate callback structure from pool */
-  ngx_http_post_subrequest_t *callback = ngx_pcalloc(r->pool, sizeof( ngx_http_post_subrequest_t ));
-  if (callback == NULL) {
-    ngx_log_error( NGX_LOG_ERR, r->connection->log, 0,
-                   "Failed to allocate callback" );    
-    return;
-  }
-  callback->handler = ngx_http_akita_subrequest_callback;
-  callback->data = NULL;
 
   /* Retrieve maximum size from configuration */
   akita_config = ngx_http_get_module_loc_conf(r, ngx_http_akita_module);
@@ -337,15 +967,8 @@ ngx_http_akita_body_callback(ngx_http_request_t *r) {
     return;
   }
   
-  /* Send the request metadata and body to Akita */
-  if (ngx_http_akita_agent_allowed()) {
-    if (ngx_akita_send_request_body(r, ngx_http_akita_request_location, ctx, akita_config, callback) != NGX_OK) {
-      ngx_log_error( NGX_LOG_ERR, r->connection->log, 0,
-                     "Failed to send request body to Akita agent" );
-      ngx_http_akita_agent_failed(r->connection->log);
-      /* Fall through and continue to send the real request! */
-    }
-  }
+  /* Fall through and continue to send the real request, whatever happens! */
+  ngx_http_akita_send_request(r, ctx, akita_config);
 
   /* Record that we should respond with DECLINED the next time
      the same request hits our handler. */
@@ -370,39 +993,65 @@ static ngx_int_t
 ngx_http_akita_precontent_handler(ngx_http_request_t *r) {
   ngx_http_akita_loc_conf_t *akita_config;
   ngx_http_akita_ctx_t *ctx;
+  size_t *in_flight;
+  uint64_t start;
 
   /* Only mirror the main request, not subrequests */
   if (r != r->main) {
     /* Check if this subrequest was initiated by us */
     ctx = ngx_http_get_module_ctx(r, ngx_http_akita_module);
-    if (ctx && ctx->subrequest_upstream) {
+    if (ctx && ctx->subrequest_upstream && ctx->subrequest_agent) {
       return ngx_http_akita_send_request_to_upstream(r, ctx->subrequest_upstream);
     }
     
     return NGX_DECLINED;
   }
 
-  /*
-   * Do not handle HEAD requests; they lead to bad behavior.
-   * My theory is that subrequests are not given a chance to finish before
-   * the main request responds with its headers and is finalized. This 
-   * leads to both 499's and alerts stating "http finalize non-active request"
-   */
-  if (r->method == NGX_HTTP_HEAD) {
-    return NGX_DECLINED;
-  }
-  
   akita_config = ngx_http_get_module_loc_conf(r, ngx_http_akita_module);
   if ( akita_config == NULL || !akita_config->enabled ) {    
     /* Not enabled for this location. */
     return NGX_DECLINED;
   }
 
-  /* If we've already processed this main request, it will have a
-     context; return whatever that context tells us to. */
-  ctx = ngx_http_get_module_ctx(r, ngx_http_akita_module);
-  if (ctx) {
-    return ctx->status;
+  /* In log-phase mode, the request is left alone until it is logged,
+     unless its body has to be copied as it is read. */
+  if (akita_config->log_phase && !akita_config->stream_request_body) {
+    return NGX_DECLINED;
+  }
+
+  /*
+   * Do not handle HEAD requests with subrequest delivery; they lead to bad
+   * behavior. My theory is that subrequests are not given a chance to
+   * finish before the main request responds with its headers and is
+   * finalized. This leads to both 499's and alerts stating "http finalize
+   * non-active request". Detached calls don't depend on the request.
+   */
+  if (r->method == NGX_HTTP_HEAD
+      && akita_config->delivery == NGX_HTTP_AKITA_DELIVERY_SUBREQUEST) {
+    return NGX_DECLINED;
+  }
+
+  /* If we've already processed this main request, it will have a
+     context; return whatever that context tells us to. */
+  ctx = ngx_http_get_module_ctx(r, ngx_http_akita_module);
+  if (ctx) {
+    return ctx->status;
+  }
+
+  /* While every agent is backed off, don't capture anything: without a
+     context, the filters leave the response alone too. */
+  if (!ngx_http_akita_agents_allowed(akita_config->agents)) {
+    return NGX_DECLINED;
+  }
+
+  /* Nor while this worker has as much in flight as it is allowed, or
+     if the request falls outside the capture rate. */
+  if (!ngx_akita_admission_sample(r)) {
+    return NGX_DECLINED;
+  }
+  in_flight = ngx_akita_admission_admit(r);
+  if (in_flight == NULL) {
+    return NGX_DECLINED;
   }
 
   /* Create a context for this request, set the status to DONE
@@ -413,11 +1062,34 @@ ngx_http_akita_precontent_handler(ngx_http_request_t *r) {
     return NGX_ERROR;
   }
   ctx->status = NGX_DONE;  
+  ctx->in_flight = in_flight;
+  ngx_akita_admission_degrade(r, ctx, akita_config);
   ngx_http_set_ctx(r, ctx, ngx_http_akita_module);
 
   /* Record arrival time at microsecond granularity */
   ngx_gettimeofday( &ctx->request_start );
 
+  /* Without a body there is nothing to wait for, so send the request now
+     and let the real handler have it straight away. */
+  if (r->headers_in.content_length_n <= 0 && !r->headers_in.chunked) {
+    ngx_http_akita_send_request(r, ctx, akita_config);
+    ctx->status = NGX_DECLINED;
+    return NGX_DECLINED;
+  }
+
+  /* Or let the real handler have it straight away, and copy the body as
+     the handler reads it (see ngx_http_akita_request_body_filter). */
+  if (akita_config->stream_request_body) {
+    start = ngx_akita_budget_start();
+    if (ngx_akita_start_request_body(r, ctx, akita_config) != NGX_OK) {
+      ngx_log_error( NGX_LOG_ERR, r->connection->log, 0,
+                     "Failed to mirror request to Akita agent" );
+    }
+    ngx_akita_budget_stop(start);
+    ctx->status = NGX_DECLINED;
+    return NGX_DECLINED;
+  }
+
   /* Set a callback for when entire body is available */
   ngx_int_t rc = ngx_http_read_client_request_body( r, ngx_http_akita_body_callback );
   if ( rc >= NGX_HTTP_SPECIAL_RESPONSE ) {
@@ -438,15 +1110,24 @@ ngx_http_akita_precontent_handler(ngx_http_request_t *r) {
 static ngx_int_t
 ngx_http_akita_subrequest_callback(ngx_http_request_t *r, void * data, ngx_int_t rc ) {
   ngx_uint_t severity = NGX_LOG_DEBUG;
+  ngx_http_akita_ctx_t *ctx;
+
+  ctx = ngx_http_get_module_ctx(r, ngx_http_akita_module);
+  if (ctx == NULL || ctx->subrequest_agent == NULL) {
+    return NGX_OK;
+  }
+
   /* Expect status 200 from server and response code NGX_OK from Nginx.
-   * Otherwise warn and temporarily disable further requests.
+   * Otherwise warn and temporarily disable further requests to this agent.
    */
   if (rc == NGX_HTTP_CLIENT_CLOSED_REQUEST) {
     /* Do not treat "499" as either success or failure. */
   } else if (r->headers_out.status == 200 && rc == NGX_OK) {
-    ngx_http_akita_agent_succeeded();
+    ngx_akita_admission_latency(ngx_current_msec - ctx->subrequest_start);
+    ngx_http_akita_agent_succeeded(ctx->subrequest_agent);
   } else {
-    ngx_http_akita_agent_failed(r->connection->log);
+    ngx_akita_admission_latency(ngx_current_msec - ctx->subrequest_start);
+    ngx_http_akita_agent_failed(ctx->subrequest_agent, r->connection->log);
     severity = NGX_LOG_WARN;
   }
   ngx_log_error( severity, r->connection->log, 0,
@@ -464,6 +1145,7 @@ static ngx_int_t
 ngx_http_akita_response_header_filter(ngx_http_request_t *r) {
   ngx_http_akita_loc_conf_t *akita_config;
   ngx_http_akita_ctx_t *ctx;
+  uint64_t start;
 
   /* Only operate on the main request (in particular, not on our own subrequest!) */
   if ( r != r->main ) {
@@ -476,20 +1158,50 @@ ngx_http_akita_response_header_filter(ngx_http_request_t *r) {
     return ngx_http_next_header_filter(r);
   }
 
+  /* In log-phase mode the witness is written once the response has gone
+     (see ngx_http_akita_log_handler); just note the time, and start
+     copying the body. This also catches responses to requests that
+     never reached the precontent phase. */
+  if (akita_config->log_phase) {
+    ctx = ngx_http_akita_log_ctx(r);
+    if (ctx != NULL) {
+      ngx_gettimeofday( &ctx->response_start );
+      if (ctx->request_arrived.tv_sec == 0) {
+        ctx->request_arrived = ctx->response_start;
+      }
+      ctx->enabled = ctx->in_flight != NULL
+                     && ngx_http_akita_agents_allowed(akita_config->agents);
+    }
+    return ngx_http_next_header_filter(r);
+  }
+
   /* Record time when upstream (or nginx) sent its response */
   ctx = ngx_http_get_module_ctx(r, ngx_http_akita_module );
   if (ctx == NULL) {
     /* No context == did not go through body callback */
     return ngx_http_next_header_filter(r);
   }
+
+  /* A streamed request body that hasn't been read to the end (perhaps
+     because the handler never read it) is sent as far as it got. */
+  if (ctx->request_body_json != NULL) {
+    ngx_http_akita_send_request(r, ctx, akita_config);
+  }
+  /* The agents may have gone away since the request was read. */
+  if (!ngx_http_akita_agents_allowed(akita_config->agents)) {
+    return ngx_http_next_header_filter(r);
+  }
+
   ngx_gettimeofday( &ctx->response_start );
   ctx->enabled = 1;
   
+  start = ngx_akita_budget_start();
   if (ngx_akita_start_response_body(r, ctx) != NGX_OK) {
     ngx_log_error( NGX_LOG_ERR, r->connection->log, 0,
                    "Failed to mirror response to Akita agent." );
     ctx->enabled = 0;
   }
+  ngx_akita_budget_stop(start);
 
   /* A normal HTTP request will go through the body filter even if the 
    * response is empty. But, a HEAD request does not do so; we need to
@@ -515,13 +1227,14 @@ ngx_http_akita_response_complete(ngx_http_request_t *r,
                                  ngx_http_akita_ctx_t *ctx,
                                  ngx_http_akita_loc_conf_t *akita_config) {
   ngx_http_post_subrequest_t *callback;
+  uint64_t start;
 
   ngx_gettimeofday(&ctx->response_complete);
 
   /* Don't pay attention to any further calls to the body filter, just in case. */
   ctx->enabled = 0;
 
-  if (!ngx_http_akita_agent_allowed()) {
+  if (!ngx_http_akita_agents_allowed(akita_config->agents)) {
     return;
   }
   
@@ -536,14 +1249,18 @@ ngx_http_akita_response_complete(ngx_http_request_t *r,
   callback->data = NULL;
 
   /* Create a subrequest containing the response. */
-  if (ngx_akita_finish_response_body(r, ngx_http_akita_response_location,
+  start = ngx_akita_budget_start();
+  if (ngx_akita_finish_response_body(r,
+                                     ctx->request_json != NULL
+                                     ? ngx_http_akita_witness_location
+                                     : ngx_http_akita_response_location,
                                      ctx,
                                      akita_config,
                                      callback) != NGX_OK) {
     ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
                   "Failed to mirror response to Akita agent");
-    ngx_http_akita_agent_failed(r->connection->log);
   }
+  ngx_akita_budget_stop(start);
 }
 
 /* Handles each portion of the HTTP response, adding it to the in-flight
@@ -554,6 +1271,7 @@ ngx_http_akita_response_body_filter(ngx_http_request_t *r, ngx_chain_t *chain) {
   ngx_http_akita_loc_conf_t *akita_config;
   ngx_http_akita_ctx_t *ctx;
   ngx_chain_t *curr;
+  uint64_t start;
   
   if ( r != r->main ) {
     return ngx_http_next_body_filter(r, chain);
@@ -569,6 +1287,23 @@ ngx_http_akita_response_body_filter(ngx_http_request_t *r, ngx_chain_t *chain) {
   if ( ctx == NULL || !ctx->enabled) {
     return ngx_http_next_body_filter(r, chain);
   }
+
+  /* Once the budget is spent, only count the rest of the body. */
+  ngx_http_akita_check_budget(ctx, ctx->response_body_size);
+  start = ngx_akita_budget_start();
+
+  if (akita_config->log_phase) {
+    for (curr = chain; curr != NULL; curr = curr->next) {
+      if (ngx_http_akita_copy_response_body(r, ctx, akita_config, curr->buf) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "Failed to copy body for Akita API call.");
+        ctx->enabled = 0;
+        break;
+      }
+    }
+    ngx_akita_budget_stop(start);
+    return ngx_http_next_body_filter(r, chain);
+  }
   
   for (curr = chain; curr != NULL; curr = curr->next ) {
     if (ngx_akita_append_response_body(r, ctx, akita_config, curr->buf) != NGX_OK) {
@@ -581,71 +1316,306 @@ ngx_http_akita_response_body_filter(ngx_http_request_t *r, ngx_chain_t *chain) {
     }
         
     if (curr->buf->last_buf) {
+      ngx_akita_budget_stop(start);
+      start = 0;
       ngx_http_akita_response_complete(r, ctx, akita_config);
       break;      
     }   
   }
+  ngx_akita_budget_stop(start);
   
   return ngx_http_next_body_filter(r, chain);
 }
 
-/* Per-process state: records if we've had a failure communicating with the
- * agent.  If so, we'll suspend further communication until later.
- * 
- * ngx_http_akita_agent_retry_time = time (epoch seconds) of next allowed call
- * ngx_http_akita_agent_backoff = next interval to use on failure, in seconds
- *
- * TODO: this doesn't distinguish multiple agents; either figure out 
- * a better way (using the server config?) or make a keyed data structure.
- * TODO: it would be less disruptive to let a single or few calls through as a
- * probe of liveness rather than blocking *every* call after the timer.
- */
-static time_t ngx_http_akita_agent_retry_time;
-static ngx_uint_t ngx_http_akita_agent_backoff;
+/* Copies each portion of a streamed request body into the request's
+ * witness as the content handler reads it, and sends the witness once the
+ * last portion has gone by. */
+static ngx_int_t
+ngx_http_akita_request_body_filter(ngx_http_request_t *r, ngx_chain_t *in) {
+  ngx_http_akita_loc_conf_t *akita_config;
+  ngx_http_akita_ctx_t *ctx;
+  ngx_chain_t *cl;
+  uint64_t start;
+
+  ctx = ngx_http_get_module_ctx(r, ngx_http_akita_module);
+  if (ctx == NULL || ctx->request_body_json == NULL) {
+    return ngx_http_next_request_body_filter(r, in);
+  }
+
+  akita_config = ngx_http_get_module_loc_conf(r, ngx_http_akita_module);
+
+  ngx_http_akita_check_budget(ctx, ctx->request_body_size);
+  start = ngx_akita_budget_start();
+
+  for (cl = in; cl != NULL; cl = cl->next) {
+    if (ngx_akita_append_request_body(r, ctx, akita_config, cl->buf) != NGX_OK) {
+      ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                    "Failed to append request body to Akita API call.");
+      ctx->request_body_json = NULL;
+      break;
+    }
+
+    if (cl->buf->last_buf) {
+      ngx_akita_budget_stop(start);
+      start = 0;
+      ngx_http_akita_send_request(r, ctx, akita_config);
+      break;
+    }
+  }
+  ngx_akita_budget_stop(start);
+
+  return ngx_http_next_request_body_filter(r, in);
+}
+
+/* Returns the context of a request in log-phase mode, creating it if the
+ * request hasn't been seen before. NULL if it can't be allocated. A
+ * request that was shed gets a context with no in_flight counter, so
+ * that it is left alone from then on. */
+static ngx_http_akita_ctx_t *
+ngx_http_akita_log_ctx(ngx_http_request_t *r) {
+  ngx_http_akita_ctx_t *ctx;
+
+  ctx = ngx_http_get_module_ctx(r, ngx_http_akita_module);
+  if (ctx != NULL) {
+    return ctx;
+  }
+
+  ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_akita_ctx_t));
+  if (ctx == NULL) {
+    return NULL;
+  }
+  ctx->status = NGX_DECLINED;
+  if (ngx_akita_admission_sample(r)) {
+    ctx->in_flight = ngx_akita_admission_admit(r);
+  }
+  if (ctx->in_flight != NULL) {
+    ngx_akita_admission_degrade(r, ctx, ngx_http_get_module_loc_conf(r, ngx_http_akita_module));
+  }
+  ngx_http_set_ctx(r, ctx, ngx_http_akita_module);
 
-/* Minimum and maximum backoff period, in seconds */
-static const ngx_uint_t ngx_http_akita_agent_initial_backoff = 30;
-static const ngx_uint_t ngx_http_akita_agent_max_backoff = 240;
+  /* Nginx recorded when the request started, if only to the millisecond. */
+  ctx->request_start.tv_sec = r->start_sec;
+  ctx->request_start.tv_usec = r->start_msec * 1000;
+  return ctx;
+}
 
-/* Initialize the per-process backoff state */
+/* Keeps a copy of a portion of the response, up to the body size limit,
+ * for the log handler to write into the witness. The buffer itself may be
+ * reused, or its file closed, by the time the request is logged. A part
+ * in a file would have to be read with a blocking call on the client's
+ * path, so the copy stops there instead. */
 static ngx_int_t
-ngx_http_akita_init_backoff(ngx_cycle_t *cycle) {
-  ngx_http_akita_agent_retry_time = ngx_time();
-  ngx_http_akita_agent_backoff = ngx_http_akita_agent_initial_backoff;
+ngx_http_akita_copy_response_body(ngx_http_request_t *r, ngx_http_akita_ctx_t *ctx,
+                                  ngx_http_akita_loc_conf_t *akita_config, ngx_buf_t *buf) {
+  ngx_chain_t *cl;
+  ngx_buf_t *b;
+  size_t len;
+  off_t size;
+
+  size = ngx_buf_size(buf);
+  if (size > 0 && !ngx_buf_in_memory(buf) && buf->in_file) {
+    ctx->response_body_cut = 1;
+  }
+
+  len = 0;
+  if (ctx->response_body_size < ctx->max_body_size && !ctx->response_body_cut) {
+    len = ngx_min((size_t) size, ctx->max_body_size - ctx->response_body_size);
+  }
+  /* Record the real size */
+  ctx->response_body_size += size;
+
+  if (len == 0 || !ngx_buf_in_memory(buf)) {
+    return NGX_OK;
+  }
+
+  b = ngx_create_temp_buf(r->pool, len);
+  cl = ngx_alloc_chain_link(r->pool);
+  if (b == NULL || cl == NULL) {
+    return NGX_ERROR;
+  }
+  b->last = ngx_cpymem(b->pos, buf->pos, len);
+  cl->buf = b;
+  cl->next = NULL;
+  ngx_akita_admission_charge(ctx->in_flight, len);
+
+  if (ctx->response_body_last == NULL) {
+    ctx->response_body_last = &ctx->response_body;
+  }
+  *ctx->response_body_last = cl;
+  ctx->response_body_last = &cl->next;
   return NGX_OK;
 }
 
-/* Return true if a request can currently be sent */
-static ngx_flag_t
-ngx_http_akita_agent_allowed() {
-  return ngx_time() >= ngx_http_akita_agent_retry_time;
+/* In log-phase mode, writes the witness for a request once its response
+ * has been sent, or abandoned, and hands it to the sender. This sees every
+ * request in an enabled location, including those rejected before the
+ * precontent phase (by limit_req, auth_request, return and so on) and
+ * HEAD requests. */
+static ngx_int_t
+ngx_http_akita_log_handler(ngx_http_request_t *r) {
+  ngx_http_akita_loc_conf_t *akita_config;
+  ngx_http_akita_ctx_t *ctx;
+  uint64_t start;
+
+  if (r != r->main) {
+    return NGX_OK;
+  }
+
+  akita_config = ngx_http_get_module_loc_conf(r, ngx_http_akita_module);
+  if (akita_config == NULL || !akita_config->enabled || !akita_config->log_phase) {
+    return NGX_OK;
+  }
+
+  if (!ngx_http_akita_agents_allowed(akita_config->agents)) {
+    return NGX_OK;
+  }
+
+  ctx = ngx_http_akita_log_ctx(r);
+  if (ctx == NULL || ctx->in_flight == NULL) {
+    return NGX_OK;
+  }
+
+  /* The response is complete now. If no header was ever sent (the client
+     went away, or the request was closed with 444), it was empty. */
+  ngx_gettimeofday( &ctx->response_complete );
+  if (ctx->response_start.tv_sec == 0) {
+    ctx->response_start = ctx->response_complete;
+  }
+  if (ctx->request_arrived.tv_sec == 0) {
+    ctx->request_arrived = ctx->response_start;
+  }
+
+  if (!ctx->request_sent) {
+    ngx_http_akita_send_request(r, ctx, akita_config);
+  }
+
+  start = ngx_akita_budget_start();
+  if (ngx_http_akita_log_response(r, ctx, akita_config) != NGX_OK) {
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                  "Failed to mirror response to Akita agent");
+  }
+  ngx_akita_budget_stop(start);
+
+  return NGX_OK;
 }
 
-/* Handle a successful request by resetting the backoff time
- * to its initial (minimum) value. */
-static void
-ngx_http_akita_agent_succeeded() {
-  ngx_http_akita_agent_backoff = ngx_http_akita_agent_initial_backoff;
+/* Write the response witness from the copies kept by the body filter. */
+static ngx_int_t
+ngx_http_akita_log_response(ngx_http_request_t *r, ngx_http_akita_ctx_t *ctx,
+                            ngx_http_akita_loc_conf_t *akita_config) {
+  ngx_chain_t *cl;
+  size_t total, copied;
+
+  /* The copies were cut off at the limit; keep the real size. */
+  total = ctx->response_body_size;
+  copied = 0;
+  if (ngx_akita_start_response_body(r, ctx) != NGX_OK) {
+    return NGX_ERROR;
+  }
+  for (cl = ctx->response_body; cl != NULL; cl = cl->next) {
+    if (ngx_akita_append_response_body(r, ctx, akita_config, cl->buf) != NGX_OK) {
+      return NGX_ERROR;
+    }
+    copied += ngx_buf_size(cl->buf);
+  }
+  ctx->response_body_size = total;
+
+  /* A body cut off at a part in a file is marked truncated. The request
+     has been written already, so the limit only applies to the response. */
+  if (ctx->response_body_cut) {
+    ctx->max_body_size = ngx_min(ctx->max_body_size, copied);
+  }
+
+  return ngx_akita_finish_response_body(r,
+                                        ctx->request_json != NULL
+                                        ? ngx_http_akita_witness_location
+                                        : ngx_http_akita_response_location,
+                                        ctx,
+                                        akita_config,
+                                        NULL);
 }
 
-/* Handle an unsuccessful request by setting the retry time
- * and doubling the backoff for the next failure */
+/* Once the worker's CPU budget is spent, stop copying a body that is
+ * being captured, at what has been copied so far; the rest is only
+ * counted, as if it were over the body size limit. */
 static void
-ngx_http_akita_agent_failed(ngx_log_t *log) {
-  /* Another request could have already failed and increased the time;
-   * make sure we are not already disabled.*/
-  if (!ngx_http_akita_agent_allowed()) {
-    return;
+ngx_http_akita_check_budget(ngx_http_akita_ctx_t *ctx, size_t copied) {
+  if (copied < ctx->max_body_size && ngx_akita_budget_exhausted()) {
+    ctx->max_body_size = copied;
   }
-  ngx_log_error(NGX_LOG_WARN, log, 0,
-                "Mirroring to Akita blocked for %d seconds",
-                ngx_http_akita_agent_backoff);
-  
-  ngx_http_akita_agent_retry_time = ngx_time() + ngx_http_akita_agent_backoff;
-  
-  if (ngx_http_akita_agent_backoff < ngx_http_akita_agent_max_backoff) {
-    ngx_http_akita_agent_backoff *= 2;
+}
+
+/* Map the ring here, in the master, once the configuration has loaded,
+ * so every worker inherits it. */
+static ngx_int_t
+ngx_http_akita_init_module(ngx_cycle_t *cycle) {
+  ngx_http_akita_main_conf_t *amcf;
+
+  amcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_akita_module);
+  if (amcf == NULL || amcf->ring == NULL) {
+    return NGX_OK;
   }
+  return ngx_akita_ring_init(cycle, amcf->ring);
+}
+
+/* Set up the per-process state for a new worker */
+static ngx_int_t
+ngx_http_akita_init_process(ngx_cycle_t *cycle) {
+  ngx_akita_escape_init();
+  ngx_akita_base64_init();
+  return ngx_akita_sender_init_process(cycle);
+}
+
+/* Return true if a request could currently be sent to any of the agents.
+ * This doesn't use up a probe of an agent that is recovering. */
+ngx_flag_t
+ngx_http_akita_agents_allowed(ngx_http_akita_agent_set_t *set) {
+  ngx_uint_t i;
+
+  for (i = 0; i < set->nagents; i++) {
+    if (!ngx_http_akita_agent_blocked(set->agents[i])) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Find the first point on the ring at or after the request ID's hash,
+ * and take its agent, or the next one along that isn't backed off.
+ * Agents are passed over without spending their probes; a recovering
+ * agent out of probes for this second is passed over too. */
+ngx_int_t
+ngx_http_akita_select_agent(ngx_http_akita_agent_set_t *set, ngx_str_t *request_id) {
+  ngx_http_akita_point_t *point;
+  ngx_uint_t lo, hi, mid, i;
+  uint32_t hash;
+
+  if (set->nagents == 1) {
+    return ngx_http_akita_agent_allowed(set->agents[0]) ? 0 : NGX_DECLINED;
+  }
+
+  hash = ngx_crc32_long(request_id->data, request_id->len);
+
+  lo = 0;
+  hi = set->npoints;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (set->points[mid].hash < hash) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  for (i = 0; i < set->npoints; i++) {
+    point = &set->points[(lo + i) % set->npoints];
+    if (!ngx_http_akita_agent_blocked(set->agents[point->agent])
+        && ngx_http_akita_agent_allowed(set->agents[point->agent])) {
+      return point->agent;
+    }
+  }
+
+  return NGX_DECLINED;
 }
 
 /*
@@ -677,6 +1647,9 @@ ngx_http_akita_send_request_to_upstream(ngx_http_request_t *subreq, ngx_http_ups
   u->process_header = ngx_http_akita_agent_process_status_line;
   u->abort_request = ngx_http_akita_agent_abort_request;
   u->finalize_request = ngx_http_akita_agent_finalize_request;
+  u->input_filter_init = ngx_http_akita_agent_input_filter_init;
+  u->input_filter = ngx_http_akita_agent_input_filter;
+  u->input_filter_ctx = subreq;
   /* subreq->state = 0; -- proxy_module does this, why? */
 
   ngx_http_upstream_init( subreq );
@@ -692,20 +1665,28 @@ ngx_http_akita_agent_create_request(ngx_http_request_t *r) {
   ngx_buf_t *b;
   ngx_chain_t *cl;
   size_t header_len;
+  ngx_http_akita_main_conf_t *amcf;
+  ngx_http_akita_ctx_t *ctx;
   
   ngx_log_error(NGX_LOG_DEBUG, r->connection->log, 0,
                 "create upstream request");
 
-  /* Create HTTP request string and minimal headers */
-  /* If we try to use HTTP/1.1, the response handling gets stuck somewhere,
-   * eventually timing out. I think this might be because the connection is
-   * still open but not sure how to set Nginx up to handle it.
-   */
-  header_len = sizeof("POST  HTTP/1.0" CRLF
-                      "Content-Tength: 12345678901234567890" CRLF
-                      "Content-Type: application/json" CRLF
-                      "Host: api.akitasoftware.com" CRLF CRLF ) - 1 +
-    r->uri.len;
+  ctx = ngx_http_get_module_ctx(r, ngx_http_akita_module);
+  if (ctx == NULL) {
+    return NGX_ERROR;
+  }
+
+  /* Create HTTP request string and minimal headers. We use HTTP/1.1 so
+   * the connection can be reused; if keepalive is turned off, tell the
+   * agent to close it instead. */
+  amcf = ngx_http_get_module_main_conf(r, ngx_http_akita_module);
+  header_len = sizeof("POST  HTTP/1.1" CRLF
+                      "Content-Length: " CRLF
+                      "Content-Type: " CRLF
+                      "Host: " CRLF
+                      "Connection: close" CRLF CRLF ) - 1 +
+    r->uri.len + NGX_OFF_T_LEN + r->headers_in.content_type->value.len +
+    ctx->subrequest_agent->host.len;
   b = ngx_create_temp_buf(r->pool, header_len);
   if (b == NULL) {
     return NGX_ERROR;
@@ -717,11 +1698,15 @@ ngx_http_akita_agent_create_request(ngx_http_request_t *r) {
   }
 
   b->last = ngx_slprintf(b->pos,b->end,
-                         "POST %V HTTP/1.0" CRLF
-                         "Content-Length: %d" CRLF
-                         "Content-Type: application/json" CRLF
-                         "Host: api.akitasoftware.com" CRLF CRLF,
-                         &r->uri, r->headers_in.content_length_n );
+                         "POST %V HTTP/1.1" CRLF
+                         "Content-Length: %O" CRLF
+                         "Content-Type: %V" CRLF
+                         "Host: %V" CRLF
+                         "%s" CRLF,
+                         &r->uri, r->headers_in.content_length_n,
+                         &r->headers_in.content_type->value,
+                         &ctx->subrequest_agent->host,
+                         amcf->keepalive > 0 ? "" : "Connection: close" CRLF );
     
   /* Hook it to the head of the upstream request bufs */
   cl->buf = b;
@@ -731,11 +1716,22 @@ ngx_http_akita_agent_create_request(ngx_http_request_t *r) {
   return NGX_OK;
 }
 
-/* Called when an agent request is restarted; can be a no-op */
+/* Called when an agent request is restarted (for example, after a cached
+ * connection turned out to be closed); reset the response parser. */
 static ngx_int_t
 ngx_http_akita_agent_reinit_request(ngx_http_request_t *r) {
+  ngx_http_akita_ctx_t *ctx;
+
   ngx_log_error(NGX_LOG_DEBUG, r->connection->log, 0,
                 "reinit upstream request");
+
+  ctx = ngx_http_get_module_ctx(r, ngx_http_akita_module);
+  if (ctx != NULL) {
+    ngx_memzero(&ctx->agent_chunked, sizeof(ngx_http_chunked_t));
+  }
+
+  r->state = 0;
+  r->upstream->process_header = ngx_http_akita_agent_process_status_line;
   return NGX_OK;
 }
 
@@ -744,6 +1740,7 @@ ngx_http_akita_agent_reinit_request(ngx_http_request_t *r) {
  * for Nginx to treat it as a HTTP response */
 static ngx_int_t
 ngx_http_akita_agent_process_status_line(ngx_http_request_t *r) {
+  ngx_http_akita_ctx_t *ctx;
   ngx_int_t rc;
   ngx_http_upstream_t *u;
   ngx_http_status_t status;
@@ -763,65 +1760,107 @@ ngx_http_akita_agent_process_status_line(ngx_http_request_t *r) {
     inbound.data = u->buffer.pos;
     ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
                   "Akita agent did not sent a valid HTTP header: '%V'", &inbound );
+    u->headers_in.connection_close = 1;
     return NGX_OK;
   }
 
   u->headers_in.status_n = status.code;
+
+  ctx = ngx_http_get_module_ctx(r, ngx_http_akita_module);
+  ngx_http_akita_agent_hints_init(&ctx->agent_hints);
+
+  /* An HTTP/1.0 agent closes the connection after each response. */
+  if (status.http_version < NGX_HTTP_VERSION_11) {
+    u->headers_in.connection_close = 1;
+  }
   u->process_header = ngx_http_akita_agent_process_headers;
   
   return ngx_http_akita_agent_process_headers(r);
 }
 
-/* Called to process the rest of the headers the agent
- * sends back, but we don't actually care, we just need to fix up the
- * upstream state. */
+/* Called to process the rest of the headers the agent sends back. We only
+ * care about the ones that say how the response body is framed, and
+ * whether the connection can be reused afterwards. */
 static ngx_int_t
 ngx_http_akita_agent_process_headers(ngx_http_request_t *r) {
+  ngx_http_akita_ctx_t *ctx;
   ngx_int_t rc;
   ngx_table_elt_t *h;
-  ngx_int_t content_length_parsed;
+  ngx_http_upstream_t *u;
+  off_t content_length_parsed;
+
+  static ngx_str_t content_length_lc = ngx_string("content-length");
+  static ngx_str_t transfer_encoding_lc = ngx_string("transfer-encoding");
+  static ngx_str_t connection_lc = ngx_string("connection");
+
+  u = r->upstream;
+  ctx = ngx_http_get_module_ctx(r, ngx_http_akita_module);
   
   while (1) {
     /* This function manipulates the r->header_* fields and the input chain. */
-    rc = ngx_http_parse_header_line(r, &r->upstream->buffer, 1);
+    rc = ngx_http_parse_header_line(r, &u->buffer, 1);
             
     if (rc == NGX_OK) {
-      /* Handle content-length but ignore other headers. Copy the header data into 
-         a fresh buffer instead of just referencing it in-place.
-         The code here is adapted from ngx_http_proxy_module's upstream handling  */
-      u_char *content_length_lc = (u_char *)"content-length";
-      if (ngx_strncasecmp( content_length_lc,
-                           r->header_name_start,
-                           r->header_name_end - r->header_name_start ) == 0 ) {
-        h = ngx_list_push(&r->upstream->headers_in.headers);
+      if (ngx_http_akita_agent_header_is(r, &content_length_lc)) {
+        h = ngx_http_akita_agent_copy_header(r, &content_length_lc);
         if (h == NULL) {
           return NGX_ERROR;
         }
-        h->hash = 0;
-        h->key.len = r->header_name_end - r->header_name_start;
-        h->value.len = r->header_end - r->header_start; /* header_start = start of value, not start of entire thing */        
-        h->key.data = ngx_pcalloc(r->pool, h->key.len + h->value.len + 2); /* Include null termination? */
-        h->value.data = h->key.data + h->key.len + 1;
-        ngx_memcpy(h->key.data, r->header_name_start, h->key.len);
-        ngx_memcpy(h->value.data, r->header_start, h->value.len);
-        h->lowcase_key = content_length_lc;
-
-        r->upstream->headers_in.content_length = h;
+
+        u->headers_in.content_length = h;
         content_length_parsed = ngx_atoof(h->value.data, h->value.len);
         if (content_length_parsed == NGX_ERROR) {
           ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
                         "Invalid Content-Length header from agent");
           return NGX_HTTP_UPSTREAM_INVALID_HEADER;
         }
-        r->upstream->headers_in.content_length_n = content_length_parsed;
+        u->headers_in.content_length_n = content_length_parsed;
+        
+      } else if (ngx_http_akita_agent_header_is(r, &transfer_encoding_lc)) {
+        h = ngx_http_akita_agent_copy_header(r, &transfer_encoding_lc);
+        if (h == NULL) {
+          return NGX_ERROR;
+        }
+
+        if (ngx_strlcasestrn(h->value.data, h->value.data + h->value.len,
+                             (u_char *) "chunked", sizeof("chunked") - 2) != NULL) {
+          u->headers_in.chunked = 1;
+        }
+        
+      } else if (ngx_http_akita_agent_header_is(r, &connection_lc)) {
+        h = ngx_http_akita_agent_copy_header(r, &connection_lc);
+        if (h == NULL) {
+          return NGX_ERROR;
+        }
+
+        if (ngx_strlcasestrn(h->value.data, h->value.data + h->value.len,
+                             (u_char *) "close", sizeof("close") - 2) != NULL) {
+          u->headers_in.connection_close = 1;
+        }
+
+      } else {
+        (void) ngx_http_akita_agent_parse_hint(&ctx->agent_hints,
+                                               r->header_name_start,
+                                               r->header_name_end - r->header_name_start,
+                                               r->header_start,
+                                               r->header_end - r->header_start);
       }
       
       continue;
     }
     if (rc == NGX_HTTP_PARSE_HEADER_DONE) {
-      /* TODO: handle persistent connection to agent, for efficiency. */
-      r->upstream->keepalive = 0;
-      r->upstream->upgrade = 0;
+      /* Chunked framing takes precedence over any Content-Length. */
+      if (u->headers_in.chunked) {
+        u->headers_in.content_length_n = -1;
+      }
+
+      ngx_http_akita_agent_apply_hints(ctx->subrequest_agent, &ctx->agent_hints,
+                                       r->connection->log);
+      
+      /* The input filter decides whether the connection can be reused,
+       * once it has seen the end of the response. */
+      u->keepalive = 0;
+      u->upgrade = 0;
       return NGX_OK;
     }
     if (rc == NGX_AGAIN) {
@@ -836,6 +1875,147 @@ ngx_http_akita_agent_process_headers(ngx_http_request_t *r) {
   }
 }
 
+/* Check whether the header just parsed from the agent's response has the
+ * given (lowercase) name. */
+static ngx_flag_t
+ngx_http_akita_agent_header_is(ngx_http_request_t *r, ngx_str_t *lowcase_name) {
+  size_t len = r->header_name_end - r->header_name_start;
+  
+  return len == lowcase_name->len
+    && ngx_strncasecmp(r->header_name_start, lowcase_name->data, len) == 0;
+}
+
+/* Copy the header just parsed from the agent's response into the
+ * upstream's headers_in, instead of just referencing it in-place.
+ * The code here is adapted from ngx_http_proxy_module's upstream handling. */
+static ngx_table_elt_t *
+ngx_http_akita_agent_copy_header(ngx_http_request_t *r, ngx_str_t *lowcase_name) {
+  ngx_table_elt_t *h;
+
+  h = ngx_list_push(&r->upstream->headers_in.headers);
+  if (h == NULL) {
+    return NULL;
+  }
+  h->hash = 0;
+  h->key.len = r->header_name_end - r->header_name_start;
+  h->value.len = r->header_end - r->header_start; /* header_start = start of value, not start of entire thing */
+  h->key.data = ngx_pcalloc(r->pool, h->key.len + h->value.len + 2); /* Include null termination? */
+  if (h->key.data == NULL) {
+    return NULL;
+  }
+  h->value.data = h->key.data + h->key.len + 1;
+  ngx_memcpy(h->key.data, r->header_name_start, h->key.len);
+  ngx_memcpy(h->value.data, r->header_start, h->value.len);
+  h->lowcase_key = lowcase_name->data;
+  
+  return h;
+}
+
+/* Called once the agent's headers are processed. Works out how long the
+ * response body is, so we know when it has all arrived. */
+static ngx_int_t
+ngx_http_akita_agent_input_filter_init(void *data) {
+  ngx_http_request_t *r = data;
+  ngx_http_upstream_t *u = r->upstream;
+  ngx_http_akita_ctx_t *ctx;
+
+  if (u->headers_in.status_n == NGX_HTTP_NO_CONTENT
+      || u->headers_in.status_n == NGX_HTTP_NOT_MODIFIED) {
+    u->length = 0;
+  } else if (u->headers_in.chunked) {
+    ctx = ngx_http_get_module_ctx(r, ngx_http_akita_module);
+    if (ctx == NULL) {
+      return NGX_ERROR;
+    }
+    ngx_memzero(&ctx->agent_chunked, sizeof(ngx_http_chunked_t));
+    
+    /* Not zero until the last chunk has been seen. */
+    u->length = 1;
+  } else {
+    /* -1 if there was no Content-Length; read until the agent closes. */
+    u->length = u->headers_in.content_length_n;
+  }
+
+  if (u->length == 0) {
+    u->keepalive = !u->headers_in.connection_close;
+  }
+  
+  return NGX_OK;
+}
+
+/* Called with each piece of the agent's response body, which starts at
+ * u->buffer.last. We don't use the body, so it is left in place to be
+ * overwritten by the next read; we only track where the response ends. */
+static ngx_int_t
+ngx_http_akita_agent_input_filter(void *data, ssize_t bytes) {
+  ngx_http_request_t *r = data;
+  ngx_http_upstream_t *u = r->upstream;
+  ngx_http_akita_ctx_t *ctx;
+  ngx_buf_t b;
+  ngx_int_t rc;
+  off_t size;
+
+  if (!u->headers_in.chunked) {
+    if (u->length == -1) {
+      return NGX_OK;
+    }
+    
+    if (bytes > u->length) {
+      ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                    "Akita agent sent more data than specified in Content-Length");
+      u->length = 0;
+      return NGX_OK;
+    }
+
+    u->length -= bytes;
+    if (u->length == 0) {
+      u->keepalive = !u->headers_in.connection_close;
+    }
+    return NGX_OK;
+  }
+
+  ctx = ngx_http_get_module_ctx(r, ngx_http_akita_module);
+  if (ctx == NULL) {
+    return NGX_ERROR;
+  }
+
+  b = u->buffer;
+  b.pos = u->buffer.last;
+  b.last = u->buffer.last + bytes;
+  
+  for ( ;; ) {
+    rc = ngx_http_parse_chunked(r, &b, &ctx->agent_chunked);
+    
+    if (rc == NGX_OK) {
+      /* Skip over the chunk's data. */
+      size = ngx_min(ctx->agent_chunked.size, b.last - b.pos);
+      b.pos += size;
+      ctx->agent_chunked.size -= size;
+      continue;
+    }
+
+    if (rc == NGX_DONE) {
+      u->length = 0;
+      u->keepalive = !u->headers_in.connection_close;
+      
+      if (b.pos != b.last) {
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                      "Akita agent sent data after final chunk");
+        u->keepalive = 0;
+      }
+      return NGX_OK;
+    }
+
+    if (rc == NGX_AGAIN) {
+      return NGX_OK;
+    }
+
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                  "Akita agent sent invalid chunked response");
+    return NGX_ERROR;
+  }
+}
+
 /* Called when an agent request is aborted by Nginx (in response to a client abort); can be a no-op */
 static void
 ngx_http_akita_agent_abort_request(ngx_http_request_t *r) {
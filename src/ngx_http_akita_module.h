@@ -9,24 +9,210 @@
 #include <ngx_core.h>
 #include <ngx_http.h>
 
+/* Forward declarations of the keepalive cache (see akita_keepalive.c)
+ * and the sender (see akita_sender.c) */
+struct ngx_akita_keepalive_s;
+struct ngx_akita_sender_s;
+struct ngx_akita_ring_s;
+struct ngx_akita_datagram_s;
+struct ngx_akita_health_s;
+
+/* 
+ * An Akita agent that one or more locations send to. There is one of these
+ * per upstream, so locations that name the same address share it.
+ */
+typedef struct {
+  /* The upstream server block created for the agent's address. */
+  ngx_http_upstream_srv_conf_t *upstream;
+
+  /* Per-worker cache of idle connections to the agent. */
+  struct ngx_akita_keepalive_s *keepalive;
+
+  /* The Host header sent with each call to the agent. */
+  ngx_str_t host;
+
+  /* The agent's address as configured, and what it resolved to. */
+  ngx_str_t address;
+  ngx_addr_t *addrs;
+  ngx_uint_t naddrs;
+
+  /* Per-worker sender for calls that are not made as subrequests. */
+  struct ngx_akita_sender_s *sender;
+
+  /* Backoff after failed calls, shared by all workers (see akita_health). */
+  struct ngx_akita_health_s *health;
+} ngx_http_akita_agent_t;
+
+/* A point on the consistent-hash ring of an agent set. */
+typedef struct {
+  uint32_t hash;
+  ngx_uint_t agent;            /* Index into the set's agents */
+} ngx_http_akita_point_t;
+
+/*
+ * The agents a location sends to. All calls for one request go to the
+ * same agent, found by hashing the request ID onto a ring of points; an
+ * agent that is backed off is passed over for the next one on the ring.
+ */
+typedef struct {
+  ngx_http_akita_agent_t **agents;
+  ngx_uint_t nagents;
+
+  /* Sorted by hash */
+  ngx_http_akita_point_t *points;
+  ngx_uint_t npoints;
+} ngx_http_akita_agent_set_t;
+
+/* Configuration for the Akita module that applies to the whole http block. */
+typedef struct {
+  /* Every agent created by a location, as ngx_http_akita_agent_t pointers. */
+  ngx_array_t agents;
+
+  /* Maximum number of idle connections to each agent cached by a worker. */
+  ngx_int_t keepalive;
+
+  /* How long an idle connection to the agent stays in the cache. */
+  ngx_msec_t keepalive_timeout;
+
+  /* Send witnesses in batches of about this many bytes; 0 to disable. */
+  size_t batch_size;
+
+  /* Longest time a witness waits in a batch before it is sent. */
+  ngx_msec_t batch_interval;
+
+  /* Talk HTTP/2 to the agent, multiplexing calls over one connection. */
+  ngx_flag_t http2;
+
+  /* Shared-memory ring the agent reads witnesses from (see akita_ring). */
+  ngx_str_t ring_path;
+  size_t ring_size;
+  ngx_uint_t ring_overflow;
+  struct ngx_akita_ring_s *ring;
+
+  /* Socket the agent receives datagrams on (see akita_datagram). */
+  struct ngx_akita_datagram_s *datagram;
+
+  /* Counters shared by all workers (see akita_stats). */
+  ngx_shm_zone_t *stats_zone;
+
+  /* Health of each agent, shared by all workers (see akita_health). */
+  ngx_shm_zone_t *health_zone;
+
+  /* Calls per second let through to an agent that is recovering, and how
+   * many must succeed in a row before all calls go through again. */
+  ngx_int_t probe_rate;
+  ngx_int_t probe_successes;
+
+  /* Most captures, and bytes of witness data held for them, that a
+   * worker may have in flight; 0 for no limit (see akita_admission). */
+  ngx_uint_t max_in_flight;
+  size_t max_in_flight_size;
+
+  /* Load, as a percentage, at which a worker steps down to each fidelity
+   * (indexed by NGX_HTTP_AKITA_FIDELITY_*), or NULL to always capture in
+   * full; and the body size limit for truncated captures. */
+  ngx_uint_t *degrade;
+  size_t degrade_body_size;
+
+  /* The agent latency that the capture rate is adjusted to stay under, or
+   * 0 to capture every request; the lowest rate, and how much the rate
+   * goes up each second, in units of NGX_HTTP_AKITA_RATE_SCALE. */
+  ngx_msec_t rate_latency;
+  ngx_uint_t rate_min;
+  ngx_uint_t rate_increase;
+
+  /* Share of a core each worker may spend mirroring, in hundredths of a
+   * percent; 0 for no limit (see akita_budget). */
+  ngx_uint_t cpu_budget;
+
+  /* Set once the upstream module has initialized all known upstreams. */
+  ngx_flag_t upstreams_initialized;
+} ngx_http_akita_main_conf_t;
+
+/* How calls to the agent are delivered (see akita_delivery) */
+#define NGX_HTTP_AKITA_DELIVERY_SUBREQUEST  0
+#define NGX_HTTP_AKITA_DELIVERY_DETACHED    1
+#define NGX_HTTP_AKITA_DELIVERY_RING        2
+#define NGX_HTTP_AKITA_DELIVERY_DATAGRAM    3
+
+/* A capture rate of 100% (see akita_adaptive_rate) */
+#define NGX_HTTP_AKITA_RATE_SCALE  10000
+
+/* How much of a request and response is captured (see akita_degrade) */
+#define NGX_HTTP_AKITA_FIDELITY_FULL       0
+#define NGX_HTTP_AKITA_FIDELITY_TRUNCATED  1    /* Bodies cut short */
+#define NGX_HTTP_AKITA_FIDELITY_HEADERS    2    /* No bodies */
+#define NGX_HTTP_AKITA_FIDELITY_METADATA   3    /* No headers or bodies */
+
+/* How bodies are written into witnesses (see akita_body_encoding) */
+#define NGX_HTTP_AKITA_BODY_STRING  0
+#define NGX_HTTP_AKITA_BODY_BASE64  1
+#define NGX_HTTP_AKITA_BODY_AUTO    2
+
+/* How witnesses are encoded (see akita_format and akita_frame.h) */
+#define NGX_HTTP_AKITA_FORMAT_JSON    0
+#define NGX_HTTP_AKITA_FORMAT_BINARY  1
+
 /* Location-specific configuration for the Akita module. */
 typedef struct {
-  /* The network address for the Akita agent REST API.*/  
+  /* The network address for the Akita agent REST API, if no agents are
+     configured. */  
   ngx_str_t agent_address;
 
-  /* The upstream configuration created for agent_address. */
+  /* The agents named by akita_agent, or the one for agent_address. */
+  ngx_http_akita_agent_set_t *agents;
+
+  /* The upstream configuration created for the first agent. */
   ngx_http_upstream_conf_t upstream;
 
+  /* Copies of upstream for each agent in agents, in the same order. */
+  ngx_http_upstream_conf_t *agent_upstreams;
+
   /* The max size of a body to send to the Akita agent */
   size_t max_body_size;
 
   /* Whether the agent is enabled in this location */
   ngx_flag_t enabled;
 
+  /* One of the NGX_HTTP_AKITA_DELIVERY_* values */
+  ngx_uint_t delivery;
+
+  /* Send each request and its response as a single witness */
+  ngx_flag_t combined;
+
+  /* Let requests through without reading their bodies first, and copy
+   * the bodies as they are read by the content handler */
+  ngx_flag_t stream_request_body;
+
+  /* Build and send witnesses from the log phase, once the response has
+   * been sent, so that every request is seen */
+  ngx_flag_t log_phase;
+
+  /* Embed request and response bodies that are valid JSON as they are,
+   * rather than as escaped strings */
+  ngx_flag_t embed_json;
+
+  /* One of the NGX_HTTP_AKITA_BODY_* values */
+  ngx_uint_t body_encoding;
+
+  /* One of the NGX_HTTP_AKITA_FORMAT_* values */
+  ngx_uint_t format;
+
 } ngx_http_akita_loc_conf_t;
 
-/* Forward declaration of JSON buffer */
+/* Control headers the agent may answer a call with; -1 where absent, and
+ * NGX_HTTP_AKITA_HINT_INVALID where present but malformed */
+#define NGX_HTTP_AKITA_HINT_INVALID  -2
+
+typedef struct {
+  ngx_int_t sample_rate;       /* Akita-Sample-Rate, in NGX_HTTP_AKITA_RATE_SCALE */
+  ssize_t max_body_size;       /* Akita-Max-Body-Size */
+  time_t pause;                /* Akita-Pause, in seconds */
+} ngx_http_akita_agent_hints_t;
+
+/* Forward declaration of JSON buffer, and of a body being written into one */
 struct json_data_s;
+struct json_body_s;
 
 /* Context for a particular HTTP request */
 typedef struct {
@@ -38,6 +224,13 @@ typedef struct {
      the location on which we were enabled.) */
   ngx_http_upstream_conf_t *subrequest_upstream;
 
+  /* The agent that our subrequest is sent to, and when it was made. */
+  ngx_http_akita_agent_t *subrequest_agent;
+  ngx_msec_t subrequest_start;
+
+  /* Control headers in the agent's answer to our subrequest. */
+  ngx_http_akita_agent_hints_t agent_hints;
+
   /* Continue processing this request? */
   ngx_flag_t      enabled;
   
@@ -54,8 +247,76 @@ typedef struct {
    * or the body size limit. */
   struct json_data_s *response_json;
   size_t response_body_size;
+
+  /* How the response body is being written into response_json. */
+  struct json_body_s *response_body_writer;
+
+  /* JSON buffer holding a request while its body is streamed through
+   * the request body filter, and the size of the body so far. NULL once
+   * the request has been sent. */
+  struct json_data_s *request_body_json;
+  size_t request_body_size;
+  struct json_body_s *request_body_writer;
+
+  /* JSON buffer holding the request, when it is sent together with the
+   * response as a combined witness. */
+  struct json_data_s *request_json;
+
+  /* What the witness data held for this request is charged to (see
+   * akita_admission). */
+  size_t *in_flight;
+
+  /* One of the NGX_HTTP_AKITA_FIDELITY_* values, and the body size limit
+   * that goes with it. */
+  ngx_uint_t fidelity;
+  size_t max_body_size;
+
+  /* Has the request been sent (or held for a combined witness)? */
+  ngx_flag_t request_sent;
+
+  /* The agent chosen when the first half of the request was sent, by
+   * index in the location's agent set; the second half goes there too. */
+  ngx_uint_t agent_index;
+  ngx_flag_t agent_chosen;
+
+  /* Copies of the response body, up to the size limit, kept for the log
+   * handler in log-phase mode. */
+  ngx_chain_t *response_body;
+  ngx_chain_t **response_body_last;
+
+  /* Set once the response reached a part held in a file, which isn't
+   * read; the body is cut off there, as if at the size limit. */
+  ngx_flag_t response_body_cut;
+
+  /* State of the parser for a chunked response from the agent; only used
+   * in our own subrequests. */
+  ngx_http_chunked_t agent_chunked;
 } ngx_http_akita_ctx_t;
 
+/* Backoff after failed calls to an agent (see akita_health.c) */
+ngx_flag_t ngx_http_akita_agent_allowed(ngx_http_akita_agent_t *agent);
+ngx_flag_t ngx_http_akita_agent_blocked(ngx_http_akita_agent_t *agent);
+void ngx_http_akita_agent_succeeded(ngx_http_akita_agent_t *agent);
+void ngx_http_akita_agent_failed(ngx_http_akita_agent_t *agent, ngx_log_t *log);
+
+/* Control headers from an agent (see akita_health.c) */
+void ngx_http_akita_agent_hints_init(ngx_http_akita_agent_hints_t *hints);
+ngx_flag_t ngx_http_akita_agent_parse_hint(ngx_http_akita_agent_hints_t *hints,
+                                           u_char *name, size_t name_len,
+                                           u_char *value, size_t value_len);
+void ngx_http_akita_agent_apply_hints(ngx_http_akita_agent_t *agent,
+                                      ngx_http_akita_agent_hints_t *hints, ngx_log_t *log);
+ngx_uint_t ngx_http_akita_agents_sample_rate(ngx_http_akita_agent_set_t *set);
+size_t ngx_http_akita_agents_max_body_size(ngx_http_akita_agent_set_t *set);
+
+/* Choose the agent for the request with the given ID. Returns its index
+ * in the set, or NGX_DECLINED if every agent is backed off. Only the
+ * agent chosen uses up a probe, if it is recovering. */
+ngx_int_t ngx_http_akita_select_agent(ngx_http_akita_agent_set_t *set, ngx_str_t *request_id);
+
+/* Return true if any agent in the set is not blocked */
+ngx_flag_t ngx_http_akita_agents_allowed(ngx_http_akita_agent_set_t *set);
+
 /* The module structure is necessary to access per-module config or context */
 extern ngx_module_t ngx_http_akita_module;
 